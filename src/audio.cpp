@@ -17,358 +17,1153 @@
 
 #define __STDC_LIMIT_MACROS
 
-#include <windows.h>
 #include <string>
 #include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
 #include <assert.h>
 #include <sndfile.h>
 #include <tr1/memory>
 #include <map>
-#include <queue>
+#include <utility>
+#include <algorithm>
+#include <sstream>
+#include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <io.h>
+#endif
 
 #include "audio.hpp"
 #include "ds-capture.h"
-#include "ui.hpp"
-#include "capture.hpp"
 #include "resample.hpp"
 
-struct audio_buffer
+/* Number of samples narrowed and written to the output file at a time. */
+#define WRITE_BLOCK_SAMPLES 65536
+
+/* Largest amount of sample data written to a plain WAV file, leaving room
+ * for the header within the 4GB limit.
+*/
+#define WAV_MAX_DATA (0xFFFFFFFFULL - 65536)
+
+/* Output files are written in runs of about WRITE_RUN_SIZE bytes, each of
+ * which ends on a multiple of WRITE_ALIGN bytes into the file.
+*/
+#define WRITE_ALIGN    4096
+#define WRITE_RUN_SIZE (1024 * 1024)
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+/* Milliseconds to wait between checks for more of a log being followed. */
+#define TAIL_POLL_INTERVAL 50
+
+/* Voices with a gain below this are skipped while mixing, as even a full
+ * scale sample scaled by it would not reach one step of a 16-bit sample.
+*/
+#define MIN_AUDIBLE_GAIN (1.0 / 65536)
+
+/* Identifies a cached mix bus, the version is bumped whenever the mixer
+ * changes in a way which alters its output or the header changes.
+*/
+#define STEM_MAGIC   "ARECSTEM"
+#define STEM_VERSION 4
+
+/* Bytes of the log read at a time when hashing it. */
+#define HASH_BLOCK_SIZE (1024 * 1024)
+
+const wav_format wav_formats[] = {
+	{ "16-bit PCM", SF_FORMAT_PCM_16 },
+	{ "24-bit PCM", SF_FORMAT_PCM_24 },
+	{ "32-bit float", SF_FORMAT_FLOAT },
+	{ NULL }
+};
+
+const unsigned int sample_rates[] = {
+	44100,
+	48000,
+	0
+};
+
+const char *mix_buses[] = {
+	"32-bit integer",
+	"32-bit float",
+	NULL
+};
+
+/* Get the index of a named format within wav_formats.
+ * Returns -1 if the named format was not found.
+*/
+int get_wav_format_index(const std::string &name)
+{
+	for(int i = 0; wav_formats[i].name; i++)
+	{
+		if(name == wav_formats[i].name)
+		{
+			return i;
+		}
+	}
+	
+	return -1;
+}
+
+audio_render_options::audio_render_options()
+{
+	frame_rate  = 50;
+	sample_rate = 44100;
+	
+	mix_bus = MIX_BUS_INT32;
+	format  = SF_FORMAT_PCM_16;
+	
+	init_vol = 100;
+	
+	fix_clipping = true;
+	min_vol      = 40;
+	
+	normalise     = false;
+	target_lufs   = -23;
+	max_true_peak = -1;
+	
+	frame_count = 0;
+	
+	scan_ahead = 0;
+}
+
+audio_log_file::audio_log_file(FILE *file)
+{
+	this->file = file;
+	
+	/* We don't know where the stream is, so the first read always seeks. */
+	file_pos = (uint64_t)(-1);
+}
+
+size_t audio_log_file::read(uint64_t offset, void *buf, size_t size)
+{
+	/* The log is mostly read sequentially, so only seek when a read doesn't
+	 * continue on from the last one.
+	*/
+	
+	if(offset != file_pos)
+	{
+		if(fseeko64(file, offset, SEEK_SET) != 0)
+		{
+			return 0;
+		}
+		
+		file_pos = offset;
+	}
+	
+	size_t r = fread(buf, 1, size, file);
+	file_pos += r;
+	
+	/* A short read leaves the stream stuck at the end of the file, so the
+	 * next read seeks again in case the log has grown since.
+	*/
+	
+	if(r < size)
+	{
+		file_pos = (uint64_t)(-1);
+	}
+	
+	return r;
+}
+
+uint64_t audio_log_file::size()
+{
+	if(fseeko64(file, 0, SEEK_END) != 0)
+	{
+		return 0;
+	}
+	
+	file_pos = ftello64(file);
+	
+	return file_pos;
+}
+
+static void sleep_ms(unsigned int ms)
+{
+	#ifdef _WIN32
+	Sleep(ms);
+	#else
+	usleep(ms * 1000);
+	#endif
+}
+
+audio_log_tail::audio_log_tail(audio_log_source &log):
+	log(log) {}
+
+size_t audio_log_tail::read(uint64_t offset, void *buf, size_t size)
+{
+	while(1)
+	{
+		/* The writer is checked before reading, so anything it wrote
+		 * before it finished is always seen.
+		*/
+		
+		bool done = writer_done();
+		
+		size_t r = log.read(offset, buf, size);
+		
+		if(r == size || done)
+		{
+			return r;
+		}
+		
+		sleep_ms(TAIL_POLL_INTERVAL);
+	}
+}
+
+uint64_t audio_log_tail::size()
 {
-	unsigned char *buf;
-	size_t size;
+	return log.size();
+}
+
+static size_t gcd(size_t a, size_t b)
+{
+	while(b != 0)
+	{
+		size_t t = a % b;
+		
+		a = b;
+		b = t;
+	}
+	
+	return a;
+}
+
+static int64_t tell_file(int fd)
+{
+	#ifdef _WIN32
+	return _lseeki64(fd, 0, SEEK_CUR);
+	#else
+	return lseek(fd, 0, SEEK_CUR);
+	#endif
+}
+
+#ifdef _WIN32
+/* Set the end of a file without moving its file pointer. */
+static bool set_end_of_file(int fd, uint64_t size)
+{
+	HANDLE file = (HANDLE)(_get_osfhandle(fd));
+	
+	LARGE_INTEGER zero, pos, end;
+	zero.QuadPart = 0;
+	end.QuadPart  = size;
+	
+	if(!SetFilePointerEx(file, zero, &pos, FILE_CURRENT))
+	{
+		return false;
+	}
+	
+	bool ok = SetFilePointerEx(file, end, NULL, FILE_BEGIN) && SetEndOfFile(file);
+	
+	SetFilePointerEx(file, pos, NULL, FILE_BEGIN);
+	
+	return ok;
+}
+#endif
+
+/* Reserve disk space for the first size bytes of a file. */
+static bool preallocate_file(int fd, uint64_t size)
+{
+	#ifdef _WIN32
+	/* NTFS allocates the space without writing anything to it, the part
+	 * which hasn't been written yet just reads back as zeros.
+	*/
+	
+	return set_end_of_file(fd, size);
+	#else
+	return posix_fallocate(fd, 0, size) == 0;
+	#endif
+}
+
+static bool resize_file(int fd, uint64_t size)
+{
+	#ifdef _WIN32
+	return set_end_of_file(fd, size);
+	#else
+	return ftruncate(fd, size) == 0;
+	#endif
+}
+
+audio_wav_output::audio_wav_output(const std::string &path)
+{
+	this->path = path;
+	
+	fd  = -1;
+	wav = NULL;
+}
+
+audio_wav_output::~audio_wav_output()
+{
+	cleanup();
+}
+
+void audio_wav_output::cleanup()
+{
+	if(wav)
+	{
+		sf_close(wav);
+		wav = NULL;
+	}
+	
+	if(fd != -1)
+	{
+		::close(fd);
+		fd = -1;
+	}
+}
+
+bool audio_wav_output::open(unsigned int sample_rate, unsigned int channels, int format, uint64_t frames)
+{
+	switch(format)
+	{
+		case SF_FORMAT_PCM_16:
+			sample_size = 2;
+			break;
+		
+		case SF_FORMAT_PCM_24:
+			sample_size = 3;
+			break;
+		
+		case SF_FORMAT_FLOAT:
+			sample_size = 4;
+			break;
+		
+		default:
+			last_error = path + ": Unsupported sample format";
+			return false;
+	}
+	
+	uint64_t data_size = frames * channels * sample_size;
+	
+	/* The sizes in a WAV file are only 32 bits, so anything bigger than
+	 * 4GB has to be written as RF64. Files of unknown length are written
+	 * as WAV, as they always were.
+	*/
+	
+	SF_INFO wav_fmt;
+	memset(&wav_fmt, 0, sizeof(wav_fmt));
+	
+	wav_fmt.samplerate = sample_rate;
+	wav_fmt.channels   = channels;
+	wav_fmt.format     = SF_FORMAT_WAV | format;
+	
+	if(data_size > WAV_MAX_DATA)
+	{
+		wav_fmt.format = SF_FORMAT_RF64 | format;
+		
+		if(!sf_format_check(&wav_fmt))
+		{
+			/* Versions of libsndfile before 1.0.19 can't write
+			 * RF64, but all of them can write W64.
+			*/
+			
+			wav_fmt.format = SF_FORMAT_W64 | format;
+		}
+	}
+	
+	fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0666);
+	if(fd == -1)
+	{
+		last_error = path + ": " + strerror(errno);
+		return false;
+	}
+	
+	/* Reserving the space up front stops a long file fragmenting as it
+	 * grows, anything which isn't used is trimmed off by close().
+	*/
+	
+	preallocated = data_size > 0 && preallocate_file(fd, data_size + WRITE_ALIGN);
+	
+	wav = sf_open_fd(fd, SFM_WRITE, &wav_fmt, SF_FALSE);
+	if(!wav)
+	{
+		last_error = path + ": " + sf_strerror(NULL);
+		cleanup();
+		
+		return false;
+	}
+	
+	/* The samples are packed here rather than by libsndfile, so it can't
+	 * fill in a PEAK chunk.
+	*/
+	
+	sf_command(wav, SFC_SET_ADD_PEAK_CHUNK, NULL, SF_FALSE);
+	
+	/* libsndfile writes the final header on the first write, so make an
+	 * empty one to find out where the samples start.
+	*/
+	
+	sf_write_raw(wav, NULL, 0);
+	int64_t data_start = tell_file(fd);
+	
+	/* Each write has to be whole frames as well as a whole number of
+	 * aligned blocks, the first is cut short to end on the first aligned
+	 * frame boundary after the header if there is one.
+	*/
+	
+	size_t frame_size = channels * sample_size;
+	size_t run_size   = frame_size * (WRITE_ALIGN / gcd(frame_size, WRITE_ALIGN));
+	
+	block_size = std::max((size_t)(WRITE_RUN_SIZE / run_size), (size_t)(1)) * run_size;
+	flush_size = block_size;
+	
+	if(data_start > 0)
+	{
+		for(size_t lead = WRITE_ALIGN - (data_start % WRITE_ALIGN); lead <= run_size; lead += WRITE_ALIGN)
+		{
+			if(lead % frame_size == 0)
+			{
+				flush_size = lead;
+				break;
+			}
+		}
+	}
+	
+	buffer.resize(block_size);
+	buffer_used = 0;
+	
+	return true;
+}
+
+/* Pack samples into the little endian layout used by WAV files. */
+
+static inline void pack_sample(unsigned char *out, int16_t sample)
+{
+	uint16_t s = sample;
+	
+	out[0] = s;
+	out[1] = s >> 8;
+}
+
+static inline void pack_sample(unsigned char *out, int32_t sample)
+{
+	/* Only the most significant 24 bits are written. */
+	
+	uint32_t s = sample;
+	
+	out[0] = s >> 8;
+	out[1] = s >> 16;
+	out[2] = s >> 24;
+}
+
+static inline void pack_sample(unsigned char *out, float sample)
+{
+	uint32_t s;
+	memcpy(&s, &sample, sizeof(s));
+	
+	out[0] = s;
+	out[1] = s >> 8;
+	out[2] = s >> 16;
+	out[3] = s >> 24;
+}
+
+template <typename Sample> static unsigned char *pack_sample_run(unsigned char *out, const Sample *samples, size_t count, size_t sample_size)
+{
+	for(size_t i = 0; i < count; ++i, out += sample_size)
+	{
+		pack_sample(out, samples[i]);
+	}
+	
+	return out;
+}
+
+unsigned char *pack_samples(unsigned char *out, const int16_t *samples, size_t count)
+{
+	return pack_sample_run(out, samples, count, 2);
+}
+
+unsigned char *pack_samples(unsigned char *out, const int32_t *samples, size_t count)
+{
+	return pack_sample_run(out, samples, count, 3);
+}
+
+unsigned char *pack_samples(unsigned char *out, const float *samples, size_t count)
+{
+	return pack_sample_run(out, samples, count, 4);
+}
+
+template <typename Sample> bool audio_wav_output::write_samples(const Sample *samples, size_t count)
+{
+	while(count > 0)
+	{
+		size_t n = std::min(count, (flush_size - buffer_used) / sample_size);
+		
+		pack_samples(&(buffer[buffer_used]), samples, n);
+		
+		buffer_used += n * sample_size;
+		
+		samples += n;
+		count   -= n;
+		
+		if(buffer_used == flush_size && !flush())
+		{
+			return false;
+		}
+	}
+	
+	return true;
+}
+
+bool audio_wav_output::write(const int16_t *samples, size_t count)
+{
+	return sample_size == 2 ? write_samples(samples, count) : bad_sample_type();
+}
+
+bool audio_wav_output::write(const int32_t *samples, size_t count)
+{
+	return sample_size == 3 ? write_samples(samples, count) : bad_sample_type();
+}
+
+bool audio_wav_output::write(const float *samples, size_t count)
+{
+	return sample_size == 4 ? write_samples(samples, count) : bad_sample_type();
+}
+
+bool audio_wav_output::bad_sample_type()
+{
+	last_error = path + ": Samples don't match the output format";
+	return false;
+}
+
+/* Pass the packed samples on to libsndfile. */
+bool audio_wav_output::flush()
+{
+	if(buffer_used > 0 && sf_write_raw(wav, &(buffer[0]), buffer_used) != (sf_count_t)(buffer_used))
+	{
+		last_error = path + ": " + sf_strerror(wav);
+		return false;
+	}
+	
+	buffer_used = 0;
+	flush_size  = block_size;
+	
+	return true;
+}
+
+bool audio_wav_output::close()
+{
+	bool ok = flush();
+	
+	int64_t data_end = tell_file(fd);
+	
+	int err = sf_close(wav);
+	wav = NULL;
+	
+	if(ok && err != 0)
+	{
+		last_error = path + ": " + sf_error_number(err);
+		ok = false;
+	}
+	
+	/* Trim off any preallocated space which wasn't used, libsndfile may
+	 * have written past the samples when it closed the file.
+	*/
+	
+	if(ok && preallocated && !resize_file(fd, std::max(data_end, tell_file(fd))))
+	{
+		last_error = path + ": Could not truncate file";
+		ok = false;
+	}
+	
+	if(::close(fd) != 0 && ok)
+	{
+		last_error = path + ": " + strerror(errno);
+		ok = false;
+	}
+	
+	fd = -1;
+	
+	return ok;
+}
+
+std::string audio_wav_output::error()
+{
+	return last_error;
+}
+
+/* Scale a sample by a gain and convert it to the mix bus format. Both bus
+ * formats hold samples at 16-bit scale, the integer bus keeps the precision
+ * of the 16-bit sample while the float bus keeps any fraction.
+*/
+template <typename BusSample> inline BusSample bus_sample(int16_t sample, double gain);
+
+template <> inline int32_t bus_sample<int32_t>(int16_t sample, double gain)
+{
+	return (int16_t)(sample * gain);
+}
+
+template <> inline float bus_sample<float>(int16_t sample, double gain)
+{
+	return sample * gain;
+}
+
+audio_buffer::audio_buffer(size_t new_size, unsigned int new_rate, unsigned int new_bits, unsigned int new_channels)
+{
+	buf  = new unsigned char[new_size];
+	size = new_size;
+	
+	if(new_bits == 8)
+	{
+		memset(buf, 128, size);
+	}
+	else{
+		memset(buf, 0, size);
+	}
+	
+	sample_rate = new_rate;
+	sample_bits = new_bits;
+	channels    = new_channels;
+	
+	playing  = false;
+	looping  = false;
+	position = 0;
+	gain     = 1.00;
+}
+
+audio_buffer::audio_buffer(const audio_buffer &src)
+{
+	buf  = new unsigned char[src.size];
+	size = src.size;
+	
+	memcpy(buf, src.buf, size);
+	
+	sample_rate = src.sample_rate;
+	sample_bits = src.sample_bits;
+	channels    = src.channels;
+	
+	playing  = src.playing;
+	looping  = src.looping;
+	position = src.position;
+	gain     = src.gain;
+}
+
+audio_buffer::~audio_buffer()
+{
+	delete[] buf;
+}
+
+/* Read the next frame worth of audio from the buffer and mix it into
+ * f_samples at the buffer's gain.
+*/
+template <typename BusSample> void audio_buffer::mix_frame(std::vector<BusSample> &f_samples, unsigned int frame_rate, unsigned int out_rate)
+{
+	/* Step 1: Populate resample_in with samples in the source
+	 * format.
+	*/
+	
+	size_t input_frame_size    = (sample_bits / 8) * channels; /* Size of one audio frame in the buffer */
+	size_t input_frames_needed = sample_rate / frame_rate;     /* Number of those frames needed */
+	
+	/* Buffers which are stopped or have played to the end produce
+	 * only silence, and ones with too little gain to be heard just
+	 * have their play position advanced without mixing anything.
+	*/
+	
+	if(!playing || (!looping && position + input_frame_size >= size))
+	{
+		return;
+	}
+	
+	if(gain < MIN_AUDIBLE_GAIN)
+	{
+		for(size_t f = 0; f < input_frames_needed; ++f)
+		{
+			if(looping && position + input_frame_size >= size)
+			{
+				position = 0;
+			}
+			
+			if(position + input_frame_size < size)
+			{
+				position += input_frame_size;
+			}
+		}
+		
+		return;
+	}
+	
+	size_t ri_size             = input_frame_size * input_frames_needed;
+	unsigned char *resample_in = new unsigned char[ri_size];
+	
+	if(sample_bits == 8)
+	{
+		memset(resample_in, 128, ri_size);
+	}
+	else{
+		memset(resample_in, 0, ri_size);
+	}
+	
+	for(size_t f = 0; f < input_frames_needed && playing; ++f)
+	{
+		if(looping && position + input_frame_size >= size)
+		{
+			position = 0;
+		}
+		
+		if(position + input_frame_size < size)
+		{
+			memcpy(resample_in + (input_frame_size * f), buf + position, input_frame_size);
+			position += input_frame_size;
+		}
+	}
+	
+	/* Step 2: Resample to the output format. */
 	
-	unsigned int sample_rate;
-	unsigned int sample_bits;
-	unsigned int channels;
+	std::vector<int16_t> resample_out;
+	
+	if(sample_bits == 8)
+	{
+		resample_out = pcm_resample<uint8_t,int16_t>((uint8_t*)(resample_in), (uint8_t*)(resample_in + ri_size), channels, sample_rate, out_rate);
+	}
+	else if(sample_bits == 16)
+	{
+		resample_out = pcm_resample<int16_t,int16_t>((int16_t*)(resample_in), (int16_t*)(resample_in + ri_size), channels, sample_rate, out_rate);
+	}
 	
-	bool playing;
-	bool looping;
-	size_t position;
-	double gain;
+	/* Step 3: Extract the samples from the PCM data, dropping or
+	 * duplicating channels as necessary and mix them in.
+	*/
 	
-	audio_buffer(size_t new_size, unsigned int new_rate, unsigned int new_bits, unsigned int new_channels)
+	for(size_t f = 0, i = 0; f < (out_rate / frame_rate); ++f)
 	{
-		buf  = new unsigned char[new_size];
-		size = new_size;
+		size_t so = f * channels;
 		
-		if(new_bits == 8)
+		BusSample left = 0;
+		
+		if(so < resample_out.size())
 		{
-			memset(buf, 128, size);
-		}
-		else{
-			memset(buf, 0, size);
+			left = bus_sample<BusSample>(resample_out[so++], gain);
 		}
 		
-		sample_rate = new_rate;
-		sample_bits = new_bits;
-		channels    = new_channels;
+		f_samples[i++] += left;
 		
-		playing  = false;
-		looping  = false;
-		position = 0;
-		gain     = 1.00;
+		if(channels >= 2 && so < resample_out.size())
+		{
+			f_samples[i++] += bus_sample<BusSample>(resample_out[so++], gain);
+		}
+		else{
+			f_samples[i++] += left;
+		}
+	}
+	
+	delete[] resample_in;
+}
+
+typedef std::map<unsigned int, audio_buffer>::iterator buffer_iter;
+
+background_buffer::background_buffer(background_tmp &tmp, unsigned int out_rate)
+{
+	rate     = tmp.rate;
+	bits     = tmp.bits;
+	channels = tmp.channels;
+	
+	/* Steal the data rather than copying the whole track. */
+	data.swap(tmp.data);
+	
+	start_frame = tmp.start_frame;
+	starved     = false;
+	
+	this->out_rate = out_rate;
+	
+	count_samples();
+	position = 0;
+}
+
+/* Work out the length of the track, called again whenever more data is
+ * appended to it.
+*/
+void background_buffer::count_samples()
+{
+	/* Only whole input frames are resampled. */
+	
+	samples = 0;
+	
+	if(bits == 8 || bits == 16)
+	{
+		samples = ((data.size() / (bits / 8)) / channels) * channels;
 	}
 	
-	audio_buffer(const audio_buffer &src)
+	frames = pcm_resample_frames(samples, channels, rate, out_rate);
+}
+
+/* Resample up to max_frames of the track on demand into resample_out and
+ * return how many were resampled. Nothing is resampled if the gain is too
+ * low to be heard, but the track still moves on.
+*/
+size_t background_buffer::next_frame(size_t max_frames, double gain)
+{
+	size_t out_frames = std::min(max_frames, frames - position);
+	
+	if(out_frames == 0)
 	{
-		buf  = new unsigned char[src.size];
-		size = src.size;
-		
-		memcpy(buf, src.buf, size);
-		
-		sample_rate = src.sample_rate;
-		sample_bits = src.sample_bits;
-		channels    = src.channels;
-		
-		playing  = src.playing;
-		looping  = src.looping;
-		position = src.position;
-		gain     = src.gain;
+		return 0;
 	}
 	
-	~audio_buffer()
+	if(gain < MIN_AUDIBLE_GAIN)
 	{
-		delete buf;
+		position += out_frames;
+		return 0;
 	}
 	
-	std::vector<int16_t> read_frame()
+	resample_out.resize(out_frames * channels);
+	
+	if(bits == 8)
 	{
-		/* Step 1: Populate resample_in with samples in the source
-		 * format.
-		*/
+		uint8_t *br_begin = (uint8_t*)(&(data[0]));
+		uint8_t *br_end   = br_begin + samples;
 		
-		size_t input_frame_size    = (sample_bits / 8) * channels;    /* Size of one audio frame in the buffer */
-		size_t input_frames_needed = sample_rate / config.frame_rate; /* Number of those frames needed */
+		pcm_resample_range<uint8_t,int16_t>(br_begin, br_end, channels, rate, out_rate, position, out_frames, resample_out.begin());
+	}
+	else if(bits == 16)
+	{
+		int16_t *br_begin = (int16_t*)(&(data[0]));
+		int16_t *br_end   = br_begin + samples;
 		
-		size_t ri_size             = input_frame_size * input_frames_needed;
-		unsigned char *resample_in = new unsigned char[ri_size];
+		pcm_resample_range<int16_t,int16_t>(br_begin, br_end, channels, rate, out_rate, position, out_frames, resample_out.begin());
+	}
+	
+	position += out_frames;
+	
+	return out_frames;
+}
+
+/* Mix the frames returned by next_frame() into f_samples at the given gain,
+ * duplicating or skipping channels as necessary.
+*/
+template <typename BusSample> void background_buffer::mix_frame(std::vector<BusSample> &f_samples, size_t out_frames, double gain)
+{
+	for(size_t f = 0, i = 0; f < out_frames; ++f)
+	{
+		const int16_t *in = &(resample_out[f * channels]);
 		
-		if(sample_bits == 8)
-		{
-			memset(resample_in, 128, ri_size);
-		}
-		else{
-			memset(resample_in, 0, ri_size);
-		}
+		int16_t s = 0;
 		
-		for(size_t f = 0; f < input_frames_needed && playing; ++f)
+		for(unsigned int c = 0; c < CHANNELS; ++c, ++i)
 		{
-			if(looping && position + input_frame_size >= size)
+			if(c < channels)
 			{
-				position = 0;
+				s = in[c];
 			}
 			
-			if(position + input_frame_size < size)
-			{
-				memcpy(resample_in + (input_frame_size * f), buf + position, input_frame_size);
-				position += input_frame_size;
-			}
-		}
-		
-		/* Step 2: Resample to the output format. */
-		
-		std::vector<int16_t> resample_out;
-		
-		if(sample_bits == 8)
-		{
-			resample_out = pcm_resample<uint8_t,int16_t>((uint8_t*)(resample_in), (uint8_t*)(resample_in + ri_size), channels, sample_rate, SAMPLE_RATE);
+			f_samples[i] += s * gain;
 		}
-		else if(sample_bits == 16)
-		{
-			resample_out = pcm_resample<int16_t,int16_t>((int16_t*)(resample_in), (int16_t*)(resample_in + ri_size), channels, sample_rate, SAMPLE_RATE);
-		}
-		
-		/* Step 3: Extract the samples from the PCM data and drop or
-		 * duplicate channels as necessary.
-		*/
-		
-		std::vector<int16_t> ret;
+	}
+}
+
+audio_renderer::audio_renderer(const audio_render_options &options, audio_log_source &log, audio_output &output, audio_render_listener &listener):
+	options(options), log(log), output(output), listener(listener)
+{
+	for(int s = 0; s < STEM_COUNT; ++s)
+	{
+		stem_outputs[s] = NULL;
+	}
+}
+
+void audio_renderer::set_stem_output(audio_stem stem, audio_output *output)
+{
+	stem_outputs[stem] = output;
+}
+
+bool audio_renderer::render()
+{
+	reset_mix();
+	
+	loudness = loudness_stats();
+	
+	bool ok;
+	
+	/* If the mix bus has already been cached, only the volume needs to be
+	 * applied to it. The cache only holds the master, so any stems need the
+	 * log to be mixed again.
+	*/
+	
+	bool want_stems = false;
+	
+	for(int s = 0; s < STEM_COUNT; ++s)
+	{
+		want_stems = want_stems || stem_outputs[s];
+	}
+	
+	if(!options.stem_path.empty() && !want_stems)
+	{
+		stem_header header;
 		
-		for(size_t f = 0; f < (SAMPLE_RATE / config.frame_rate); ++f)
+		FILE *stem = open_stem(header);
+		if(stem)
 		{
-			size_t so = f * channels;
-			
-			if(so < resample_out.size())
+			if(options.mix_bus == MIX_BUS_FLOAT)
 			{
-				ret.push_back(resample_out[so++] * gain);
+				ok = write_stem_output<float>(stem, header);
 			}
 			else{
-				ret.push_back(0);
+				ok = write_stem_output<int32_t>(stem, header);
 			}
 			
-			if(channels >= 2 && so < resample_out.size())
-			{
-				ret.push_back(resample_out[so++] * gain);
-			}
-			else{
-				ret.push_back(ret.back());
-			}
+			fclose(stem);
+			
+			listener.phase(rp_done);
+			
+			return ok;
 		}
+	}
+	
+	/* The log is searched for background music up front unless the search
+	 * is to be kept just ahead of the mix.
+	*/
+	
+	if(options.scan_ahead == 0)
+	{
+		listener.phase(rp_scan);
 		
-		delete resample_in;
-		
-		return ret;
+		if(!find_background())
+		{
+			listener.phase(rp_done);
+			return false;
+		}
 	}
-};
-
-typedef std::map<unsigned int, audio_buffer>::iterator buffer_iter;
-
-struct background_tmp
-{
-	/* PCM format */
-	unsigned int rate;
-	unsigned int bits;
-	unsigned int channels;
 	
-	/* PCM data */
-	std::vector<unsigned char> data;
+	/* Mix the log down in the selected mix bus format and write the output
+	 * from that.
+	*/
+	
+	if(options.mix_bus == MIX_BUS_FLOAT)
+	{
+		ok = mix_and_write<float>();
+	}
+	else{
+		ok = mix_and_write<int32_t>();
+	}
 	
-	/* Confirmed as a background buffer */
-	bool is_background;
+	reset_mix();
 	
-	/* Last frame an AUDIO_OP_START was seen at */
-	unsigned int start_frame;
-};
+	listener.phase(rp_done);
+	
+	return ok;
+}
 
-struct background_buffer
+/* Forget every buffer and start the search for background music over. */
+void audio_renderer::reset_mix()
 {
-	std::queue<int16_t> samples;
-	unsigned int start_frame;
-};
+	buffers.clear();
+	background_buffers.clear();
+	
+	scan_buffers.clear();
+	scan_offset = 0;
+	scan_frame  = 0;
+	scan_done   = false;
+	
+	scan_mixed.clear();
+	scan_late = false;
+}
 
-bool make_output_wav()
+/* Read size bytes from the log at offset and advance offset past them.
+ * Returns false if the log ends first.
+*/
+bool audio_renderer::read_log(uint64_t &offset, void *buf, size_t size)
 {
-	std::string log_path = config.capture_dir + "\\" FRAME_PREFIX "audio.dat";
-	std::string wav_path = config.capture_dir + "\\" FRAME_PREFIX "audio.wav";
-	
-	FILE *log = fopen(log_path.c_str(), "rb");
-	if(!log)
+	if(log.read(offset, buf, size) != size)
 	{
-		log_push(std::string("Could not open " FRAME_PREFIX "audio.dat: ") + w32_error(GetLastError()) + "\r\n");
 		return false;
 	}
 	
-	/* Background audio is held in a streaming buffer and properly
-	 * synchronising the play/write pointers after the fact is difficult,
-	 * so we make a first pass over the log, locating each buffer which
-	 * receives writes from offsets other than zero and concatenate each
-	 * write to them together, forming buffers containing the full length
-	 * of each background track.
-	*/
+	offset += size;
+	
+	return true;
+}
+
+/* Background audio is held in a streaming buffer and properly synchronising
+ * the play/write pointers after the fact is difficult, so we make a first
+ * pass over the log, locating each buffer which receives writes from offsets
+ * other than zero and concatenate each write to them together, forming
+ * buffers containing the full length of each background track.
+*/
+bool audio_renderer::find_background()
+{
+	listener.log("Searching for background music...");
 	
-	log_push("Searching for background music...\r\n");
+	return scan_log(UINT_MAX);
+}
+
+/* Carry the search for background music on through the log until an event
+ * after until_frame has been seen or the log ends.
+ *
+ * Each buffer which turns out to be background audio is moved into
+ * background_buffers as soon as it is found, where anything written to it
+ * after that is appended and it will be resampled to the output format as
+ * it is mixed. This lets the search run just ahead of the mix instead of
+ * over the whole log first.
+ *
+ * A search of the whole log knows where each track really starts and has
+ * all of it before anything is mixed. When the search is only just ahead,
+ * scan_late is set if it finds a track which has already been mixed as a
+ * sound effect, a track which has already been playing being started again
+ * or more of a track which the mix has already run out of.
+*/
+bool audio_renderer::scan_log(unsigned int until_frame)
+{
+	if(scan_done)
+	{
+		return true;
+	}
 	
-	std::map<unsigned int, background_buffer> background_buffers;
+	struct audio_event event;
 	
+	while(!scan_done && scan_frame <= until_frame)
 	{
-		/* First we populate buffers_in with all the buffers and all the
-		 * data that ever gets written to them.
-		*/
-		
-		std::map<unsigned int, background_tmp> buffers_in;
+		if(!read_log(scan_offset, &event, sizeof(event)))
+		{
+			scan_done = true;
+			break;
+		}
 		
-		struct audio_event event;
-		while(fread(&event, sizeof(event), 1, log))
+		if(event.check != 0x12345678)
 		{
-			if(event.check != 0x12345678)
-			{
-				log_push("Encountered record with invalid check\r\n");
-				break;
-			}
+			listener.log("Encountered record with invalid check");
 			
-			if(event.op == AUDIO_OP_INIT)
-			{
-				background_tmp new_tmp;
-				
-				new_tmp.rate     = event.e.init.sample_rate;
-				new_tmp.bits     = event.e.init.sample_bits;
-				new_tmp.channels = event.e.init.channels;
-				
-				buffers_in.insert(std::make_pair(event.e.init.buf_id, new_tmp));
-			}
-			else if(event.op == AUDIO_OP_LOAD)
-			{
-				auto b = buffers_in.find(event.e.load.buf_id);
-				if(b == buffers_in.end())
-				{
-					continue;
-				}
-				
-				size_t base = b->second.data.size();
-				b->second.data.resize(base + event.e.load.size);
-				
-				if(fread(&(b->second.data[base]), 1, event.e.load.size, log) != event.e.load.size)
-				{
-					log_push("Unexpected end of log!\r\n");
-					fclose(log);
-					return false;
-				}
-				
-				if(event.e.load.offset)
-				{
-					b->second.is_background = true;
-				}
-			}
-			else if(event.op == AUDIO_OP_START)
-			{
-				auto b = buffers_in.find(event.e.load.buf_id);
-				if(b == buffers_in.end())
-				{
-					continue;
-				}
-				
-				b->second.start_frame = event.frame;
-			}
+			scan_done = true;
+			break;
 		}
 		
-		/* Reset the log's read pointer for the next task. */
-		assert(fseek(log, 0, SEEK_SET) == 0);
+		scan_frame = event.frame;
 		
-		/* Now we iterate over each of those buffers, looking for any
-		 * that match the criteria for being background audio, any that
-		 * do so are resampled to the output format and stored in
-		 * background_buffers.
-		*/
-		
-		for(auto i = buffers_in.begin(); i != buffers_in.end(); ++i)
+		if(event.op == AUDIO_OP_INIT)
+		{
+			background_tmp new_tmp;
+			
+			new_tmp.rate     = event.e.init.sample_rate;
+			new_tmp.bits     = event.e.init.sample_bits;
+			new_tmp.channels = event.e.init.channels;
+			
+			new_tmp.is_background = false;
+			new_tmp.start_frame   = 0;
+			
+			scan_buffers.insert(std::make_pair(event.e.init.buf_id, new_tmp));
+		}
+		else if(event.op == AUDIO_OP_FREE)
+		{
+			/* Buffer IDs are never reused, so a buffer which has not
+			 * been identified as background audio by the time it is
+			 * released never will be.
+			*/
+			
+			scan_buffers.erase(event.e.free.buf_id);
+		}
+		else if(event.op == AUDIO_OP_LOAD)
 		{
-			if(!(i->second.is_background))
+			auto bb = background_buffers.find(event.e.load.buf_id);
+			auto b  = scan_buffers.find(event.e.load.buf_id);
+			
+			std::vector<unsigned char> *data;
+			
+			if(bb != background_buffers.end())
+			{
+				data = &(bb->second.data);
+			}
+			else if(b != scan_buffers.end())
 			{
+				data = &(b->second.data);
+			}
+			else{
+				scan_offset += event.e.load.size;
 				continue;
 			}
 			
-			background_buffer new_buffer;
-			new_buffer.start_frame = i->second.start_frame;
-			
-			/* Resample the raw PCM to the output format. */
+			size_t base = data->size();
+			data->resize(base + event.e.load.size);
 			
-			std::vector<int16_t> resample_out;
+			if(!read_log(scan_offset, &((*data)[base]), event.e.load.size))
+			{
+				listener.log("Unexpected end of log!");
+				return false;
+			}
 			
-			if(i->second.bits == 8)
+			if(bb != background_buffers.end())
 			{
-				uint8_t *br_begin = (uint8_t*)(&(i->second.data[0]));
-				uint8_t *br_end   = (uint8_t*)(&(i->second.data[0]) + i->second.data.size());
+				scan_late = scan_late || bb->second.starved;
 				
-				resample_out = pcm_resample<uint8_t,int16_t>(br_begin, br_end, i->second.channels, i->second.rate, SAMPLE_RATE);
+				bb->second.count_samples();
 			}
-			else if(i->second.bits == 16)
+			else if(event.e.load.offset)
 			{
-				int16_t *br_begin = (int16_t*)(&(i->second.data[0]));
-				int16_t *br_end   = (int16_t*)(&(i->second.data[0]) + i->second.data.size());
+				scan_late = scan_late || scan_mixed.count(b->first);
 				
-				resample_out = pcm_resample<int16_t,int16_t>(br_begin, br_end, i->second.channels, i->second.rate, SAMPLE_RATE);
+				b->second.is_background = true;
+				
+				background_buffer new_buffer(b->second, options.sample_rate);
+				background_buffers.insert(std::make_pair(b->first, std::move(new_buffer)));
+				
+				scan_buffers.erase(b);
 			}
+		}
+		else if(event.op == AUDIO_OP_START)
+		{
+			auto bb = background_buffers.find(event.e.start.buf_id);
+			auto b  = scan_buffers.find(event.e.start.buf_id);
 			
-			/* Populate the background samples buffer with samples
-			 * in the output format, duplicating or skipping
-			 * channels as necessary.
-			*/
-			
-			for(size_t s = 0; s < resample_out.size();)
+			if(bb != background_buffers.end())
 			{
-				for(unsigned int c = 0; c < CHANNELS; ++c)
-				{
-					if(c < i->second.channels)
-					{
-						new_buffer.samples.push(resample_out[s++]);
-					}
-					else{
-						new_buffer.samples.push(new_buffer.samples.back());
-					}
-				}
+				scan_late = scan_late || bb->second.position > 0 || bb->second.starved;
 				
-				if(i->second.channels > CHANNELS)
-				{
-					s += (i->second.channels - CHANNELS);
-				}
+				bb->second.start_frame = event.frame;
+			}
+			else if(b != scan_buffers.end())
+			{
+				b->second.start_frame = event.frame;
 			}
-			
-			log_push(std::string("Background music detected, ")
-				+ to_string((new_buffer.samples.size() / SAMPLE_RATE) / CHANNELS)
-				+ " seconds long at "
-				+ to_string(i->second.start_frame / config.frame_rate)
-				+ " seconds\r\n");
-			
-			background_buffers.insert(std::make_pair(i->first,new_buffer));
 		}
 	}
 	
-	std::map<unsigned int, audio_buffer> buffers;
+	if(scan_done)
+	{
+		log_background();
+		scan_buffers.clear();
+	}
+	
+	return true;
+}
+
+void audio_renderer::log_background()
+{
+	for(auto i = background_buffers.begin(); i != background_buffers.end(); ++i)
+	{
+		std::ostringstream msg;
+		msg << "Background music detected, "
+			<< (i->second.frames / options.sample_rate)
+			<< " seconds long at "
+			<< (i->second.start_frame / options.frame_rate)
+			<< " seconds";
+		
+		listener.log(msg.str());
+	}
+}
+
+/* Mix the audio described by the log into all_samples, in the format of the
+ * mix bus.
+*/
+template <typename BusSample> bool audio_renderer::mix(std::vector<BusSample> &all_samples, std::vector<BusSample> stem_samples[])
+{
+	uint64_t offset = 0;
 	
 	struct audio_event event;
 	
 	unsigned int frame_num = 0;
 	
-	std::vector<int64_t> all_samples;
-	all_samples.reserve(get_frame_count() * (SAMPLE_RATE / config.frame_rate) * CHANNELS);
+	loudness_meter meter(options.sample_rate, CHANNELS);
 	
-	while(fread(&event, sizeof(event), 1, log))
+	while(read_log(offset, &event, sizeof(event)))
 	{
 		assert(event.frame >= frame_num);
 		
 		if(event.check != 0x12345678)
 		{
-			log_push("Encountered record with invalid check\r\n");
+			listener.log("Encountered record with invalid check");
 			break;
 		}
 		
@@ -382,7 +1177,23 @@ bool make_output_wav()
 			 * frame while mixing.
 			*/
 			
-			std::vector<int64_t> f_samples((SAMPLE_RATE / config.frame_rate) * CHANNELS);
+			std::vector<BusSample> f_samples((options.sample_rate / options.frame_rate) * CHANNELS);
+			std::vector<BusSample> f_music(stem_outputs[STEM_MUSIC] ? f_samples.size() : 0);
+			
+			/* Keep the search for background music ahead of the
+			 * frame being mixed, giving up on this mix if it has
+			 * already gone wrong.
+			*/
+			
+			if(!scan_log(frame_num + options.scan_ahead))
+			{
+				return false;
+			}
+			
+			if(scan_late)
+			{
+				return true;
+			}
 			
 			/* Mix in sound effects... */
 			
@@ -393,14 +1204,18 @@ bool make_output_wav()
 					continue;
 				}
 				
-				std::vector<int16_t> b_samples = b->second.read_frame();
-				
-				assert(f_samples.size() == b_samples.size());
-				
-				for(size_t i = 0; i < f_samples.size() && i < b_samples.size(); ++i)
+				if(!scan_done && b->second.playing)
 				{
-					f_samples[i] += b_samples[i];
+					scan_mixed.insert(b->first);
 				}
+				
+				b->second.mix_frame(f_samples, options.frame_rate, options.sample_rate);
+			}
+			
+			if(stem_outputs[STEM_EFFECTS])
+			{
+				std::vector<BusSample> &effects = stem_samples[STEM_EFFECTS];
+				effects.insert(effects.end(), f_samples.begin(), f_samples.end());
 			}
 			
 			/* Mix in background music... */
@@ -409,24 +1224,59 @@ bool make_output_wav()
 			{
 				if(b->second.start_frame > frame_num)
 				{
-					continue;
+					continue;
+				}
+				
+				/* A track found ahead of the mix may not have
+				 * been created by the mix yet.
+				*/
+				
+				auto bi = buffers.find(b->first);
+				if(bi == buffers.end())
+				{
+					continue;
+				}
+				
+				size_t want   = f_samples.size() / CHANNELS;
+				size_t before = b->second.position;
+				
+				size_t out_frames = b->second.next_frame(want, bi->second.gain);
+				
+				if(!scan_done && b->second.position - before < want)
+				{
+					b->second.starved = true;
 				}
 				
-				for(size_t i = 0; i < f_samples.size() && !b->second.samples.empty(); ++i)
+				b->second.mix_frame(f_samples, out_frames, bi->second.gain);
+				
+				/* The music stem gets its own copy of each
+				 * resampled frame rather than being taken out
+				 * of the master, so the master comes out the
+				 * same whichever stems are written.
+				*/
+				
+				if(stem_outputs[STEM_MUSIC])
 				{
-					auto bi = buffers.find(b->first);
-					assert(bi != buffers.end());
-					
-					f_samples[i] += b->second.samples.front() * bi->second.gain;
-					b->second.samples.pop();
+					b->second.mix_frame(f_music, out_frames, bi->second.gain);
 				}
 			}
 			
+			if(stem_outputs[STEM_MUSIC])
+			{
+				std::vector<BusSample> &music = stem_samples[STEM_MUSIC];
+				music.insert(music.end(), f_music.begin(), f_music.end());
+			}
+			
 			/* Append the mixed samples from this frame to the list
 			 * of all samples.
 			*/
 			
 			all_samples.insert(all_samples.end(), f_samples.begin(), f_samples.end());
+			
+			/* The bus is at 16-bit scale. */
+			meter.add(&(f_samples[0]), f_samples.size() / CHANNELS, 1.0 / 32768);
+			
+			listener.progress(frame_num, options.frame_count);
 		}
 		
 		switch(event.op)
@@ -452,7 +1302,7 @@ bool make_output_wav()
 				
 				if(bi == buffers.end())
 				{
-					log_push("Attempted to clone unknown buffer!\r\n");
+					listener.log("Attempted to clone unknown buffer!");
 					break;
 				}
 				
@@ -465,11 +1315,10 @@ bool make_output_wav()
 			{
 				unsigned char *tmp = new unsigned char[event.e.load.size];
 				
-				if(fread(tmp, 1, event.e.load.size, log) != event.e.load.size)
+				if(!read_log(offset, tmp, event.e.load.size))
 				{
-					log_push("Unexpected end of log!\r\n");
-					delete tmp;
-					fclose(log);
+					listener.log("Unexpected end of log!");
+					delete[] tmp;
 					
 					return false;
 				}
@@ -478,8 +1327,8 @@ bool make_output_wav()
 				
 				if(bi == buffers.end())
 				{
-					log_push("Attempted to load into unknown buffer!\r\n");
-					delete tmp;
+					listener.log("Attempted to load into unknown buffer!");
+					delete[] tmp;
 					
 					break;
 				}
@@ -488,15 +1337,18 @@ bool make_output_wav()
 				{
 					size_t max = bi->second.size - event.e.load.offset;
 					
-					log_push("Attempted to write past the end of a buffer!\r\n");
-					log_push(std::string("Truncating write from ") + to_string(event.e.load.size) + " to " + to_string(max) + "\r\n");
+					std::ostringstream msg;
+					msg << "Truncating write from " << event.e.load.size << " to " << max;
+					
+					listener.log("Attempted to write past the end of a buffer!");
+					listener.log(msg.str());
 					
 					event.e.load.size = max;
 				}
 				
 				memcpy(bi->second.buf + event.e.load.offset, tmp, event.e.load.size);
 				
-				delete tmp;
+				delete[] tmp;
 				
 				break;
 			}
@@ -507,7 +1359,7 @@ bool make_output_wav()
 				
 				if(bi == buffers.end())
 				{
-					log_push("Attempted to play unknown buffer!\r\n");
+					listener.log("Attempted to play unknown buffer!");
 					break;
 				}
 				
@@ -523,7 +1375,7 @@ bool make_output_wav()
 				
 				if(bi == buffers.end())
 				{
-					log_push("Attempted to stop unknown buffer!\r\n");
+					listener.log("Attempted to stop unknown buffer!");
 					break;
 				}
 				
@@ -538,13 +1390,13 @@ bool make_output_wav()
 				
 				if(bi == buffers.end())
 				{
-					log_push("Attempted to set position of unknown buffer!\r\n");
+					listener.log("Attempted to set position of unknown buffer!");
 					break;
 				}
 				
 				if(event.e.jmp.offset >= bi->second.size)
 				{
-					log_push("Attempted to set position past end of buffer!\r\n");
+					listener.log("Attempted to set position past end of buffer!");
 					break;
 				}
 				
@@ -559,7 +1411,7 @@ bool make_output_wav()
 				
 				if(bi == buffers.end())
 				{
-					log_push("Attempted to set frequency of unknown buffer!\r\n");
+					listener.log("Attempted to set frequency of unknown buffer!");
 					break;
 				}
 				
@@ -574,7 +1426,7 @@ bool make_output_wav()
 				
 				if(bi == buffers.end())
 				{
-					log_push("Attempted to set gain of unknown buffer!\r\n");
+					listener.log("Attempted to set gain of unknown buffer!");
 					break;
 				}
 				
@@ -585,59 +1437,507 @@ bool make_output_wav()
 			
 			default:
 			{
-				log_push("Unknown event ID in log!\r\n");
+				listener.log("Unknown event ID in log!");
 				break;
 			}
 		}
 	}
 	
-	fclose(log);
+	loudness = meter.stats();
+	log_loudness();
+	
+	return true;
+}
+
+/* Find the lowest and highest samples in the mix. */
+template <typename BusSample> static void find_peaks(const std::vector<BusSample> &all_samples, double &low, double &high)
+{
+	BusSample b_low = 0, b_high = 0;
+	
+	for(auto si = all_samples.begin(); si != all_samples.end(); ++si)
+	{
+		b_low  = std::min(b_low, *si);
+		b_high = std::max(b_high, *si);
+	}
+	
+	low  = b_low;
+	high = b_high;
+}
+
+/* Mix the log and write the output through a BusSample mix bus. */
+template <typename BusSample> bool audio_renderer::mix_and_write()
+{
+	listener.phase(rp_mix);
+	
+	size_t expect_samples = options.frame_count * (options.sample_rate / options.frame_rate) * CHANNELS;
+	
+	std::vector<BusSample> all_samples;
+	all_samples.reserve(expect_samples);
+	
+	std::vector<BusSample> stem_samples[STEM_COUNT];
+	
+	for(int s = 0; s < STEM_COUNT; ++s)
+	{
+		if(stem_outputs[s])
+		{
+			stem_samples[s].reserve(expect_samples);
+		}
+	}
+	
+	if(!mix(all_samples, stem_samples))
+	{
+		return false;
+	}
+	
+	/* Throw away a mix which the search for background music got ahead
+	 * of and do it again from a search of the whole log, which waits for
+	 * the rest of a log which is still being written.
+	*/
+	
+	if(scan_late)
+	{
+		listener.log("Background music was found after it had been mixed, mixing again...");
+		
+		reset_mix();
+		
+		all_samples.clear();
+		
+		for(int s = 0; s < STEM_COUNT; ++s)
+		{
+			stem_samples[s].clear();
+		}
+		
+		listener.phase(rp_scan);
+		
+		if(!find_background())
+		{
+			return false;
+		}
+		
+		listener.phase(rp_mix);
+		
+		if(!mix(all_samples, stem_samples))
+		{
+			return false;
+		}
+	}
+	
+	listener.phase(rp_normalise);
+	
+	double low, high;
+	find_peaks(all_samples, low, high);
+	
+	if(!options.stem_path.empty())
+	{
+		save_stem(all_samples, low, high);
+	}
+	
+	/* The volume is chosen from the master alone, so it comes out the
+	 * same whichever stems are written. The stems are written at the same
+	 * volume so that they still add up to it, a stem can peak higher than
+	 * the master where the music and effects cancel out, in which case
+	 * its samples are clamped to the output format.
+	*/
+	
+	double scale = choose_scale(low, high);
+	
+	listener.phase(rp_write);
+	
+	if(!write_output(output, all_samples, scale, false))
+	{
+		return false;
+	}
+	
+	for(int s = 0; s < STEM_COUNT; ++s)
+	{
+		if(stem_outputs[s] && !write_output(*(stem_outputs[s]), stem_samples[s], scale, true))
+		{
+			return false;
+		}
+	}
+	
+	return true;
+}
+
+const loudness_stats &audio_renderer::get_loudness() const
+{
+	return loudness;
+}
+
+void audio_renderer::log_loudness()
+{
+	if(!loudness.valid)
+	{
+		listener.log("Mix is too short or quiet to measure its loudness");
+		return;
+	}
+	
+	std::ostringstream msg;
+	msg.setf(std::ios::fixed);
+	msg.precision(1);
+	
+	msg << "Integrated loudness: " << loudness.integrated << " LUFS, "
+		<< "loudness range: " << loudness.range << " LU, "
+		<< "true peak: " << loudness.true_peak << " dBTP";
+	
+	listener.log(msg.str());
+}
+
+/* Choose the scale to apply to a mix with the given peaks when writing it
+ * out. Loudness normalisation falls back to the fixed volume if the loudness
+ * couldn't be measured.
+*/
+double audio_renderer::choose_scale(double low, double high)
+{
+	if(!options.normalise || !loudness.valid)
+	{
+		return (double)(choose_volume(low, high)) / 100;
+	}
+	
+	double gain = options.target_lufs - loudness.integrated;
 	
+	std::ostringstream msg;
+	msg.setf(std::ios::fixed);
+	msg.precision(1);
+	
+	msg << "Normalising to " << options.target_lufs << " LUFS";
+	
+	/* The gain is applied as is, so the true peak moves up or down with
+	 * the loudness and may have to hold the loudness back.
+	*/
+	
+	if(loudness.true_peak + gain > options.max_true_peak)
+	{
+		gain = options.max_true_peak - loudness.true_peak;
+		
+		msg << ", limited to " << (loudness.integrated + gain) << " LUFS by the true peak";
+	}
+	
+	double scale = pow(10, gain / 20);
+	
+	/* Integer formats must not clip whatever the true peak limit is. */
+	
+	if(options.format != SF_FORMAT_FLOAT)
 	{
-		int volume = config.init_vol, pv;
+		if(high * scale > INT16_MAX)
+		{
+			scale = INT16_MAX / high;
+		}
 		
-		std::vector<int16_t> w_samples(all_samples.size());
+		if(low * scale < INT16_MIN)
+		{
+			scale = INT16_MIN / low;
+		}
+	}
+	
+	msg << ", applying " << (20 * log10(scale)) << " dB of gain";
+	listener.log(msg.str());
+	
+	return scale;
+}
+
+/* Choose the output volume for a mix with the given peaks. */
+int audio_renderer::choose_volume(double low, double high)
+{
+	int volume = options.init_vol;
+	
+	/* Integer formats can clip, if enabled we reduce the volume just far
+	 * enough for the loudest peaks of the mix to fit. Float output can't
+	 * clip, so any normalisation is left for the encoder.
+	*/
+	
+	if(options.fix_clipping && options.format != SF_FORMAT_FLOAT)
+	{
+		while(volume > options.min_vol
+			&& ((int)(low * ((double)(volume) / 100)) < INT16_MIN
+			|| (int)(high * ((double)(volume) / 100)) > INT16_MAX))
+		{
+			--volume;
+		}
 		
-		do {
-			pv = volume;
+		if(volume != options.init_vol)
+		{
+			std::ostringstream msg;
+			msg << "Clipping detected, reducing volume to " << volume << "%";
 			
-			auto si = all_samples.begin();
+			listener.log(msg.str());
+		}
+	}
+	
+	return volume;
+}
+
+/* Scale a block of mixed samples to the output volume and write them out in
+ * the chosen output format.
+ *
+ * 24-bit samples which don't fit are always clamped, 16-bit ones only if clamp
+ * is true and otherwise wrap around as the master always has.
+*/
+template <typename BusSample> bool audio_renderer::write_block(audio_output &out, const BusSample *samples, size_t n, double scale, bool clamp)
+{
+	bool w_ok = true;
+	
+	if(options.format == SF_FORMAT_PCM_16)
+	{
+		std::vector<int16_t> w_samples(n);
+		
+		for(size_t i = 0; i < n; ++i)
+		{
+			int s = samples[i] * scale;
 			
-			for(size_t i = 0; si != all_samples.end(); ++si, ++i)
+			if(clamp)
 			{
-				int s = *si * ((double)(volume) / 100);
-				
-				while(config.fix_clipping && volume > config.min_vol && (s < INT16_MIN || s > INT16_MAX))
-				{
-					s = *si * ((double)(--volume) / 100);
-				}
-				
-				w_samples[i] = s;
+				s = std::max(s, (int)(INT16_MIN));
+				s = std::min(s, (int)(INT16_MAX));
 			}
 			
-			if(volume != pv)
-			{
-				log_push(std::string("Clipping detected, reducing volume to ") + to_string(volume) + "%\r\n");
-			}
-		} while(volume != pv);
+			w_samples[i] = s;
+		}
+		
+		w_ok = out.write(&(w_samples[0]), n);
+	}
+	else if(options.format == SF_FORMAT_PCM_24)
+	{
+		/* 24-bit samples are passed on as the most significant 24 bits
+		 * of each 32-bit sample.
+		*/
+		
+		std::vector<int32_t> w_samples(n);
+		
+		for(size_t i = 0; i < n; ++i)
+		{
+			double s = samples[i] * scale * 65536;
+			
+			s = std::max(s, (double)(INT32_MIN));
+			s = std::min(s, (double)(INT32_MAX));
+			
+			w_samples[i] = s;
+		}
 		
-		/* Write the output audio file. */
+		w_ok = out.write(&(w_samples[0]), n);
+	}
+	else if(options.format == SF_FORMAT_FLOAT)
+	{
+		std::vector<float> w_samples(n);
+		
+		for(size_t i = 0; i < n; ++i)
+		{
+			w_samples[i] = samples[i] * scale / 32768;
+		}
 		
-		SF_INFO wav_fmt;
-		wav_fmt.samplerate = SAMPLE_RATE;
-		wav_fmt.channels   = CHANNELS;
-		wav_fmt.format     = SF_FORMAT_WAV | SF_FORMAT_PCM_16;
+		w_ok = out.write(&(w_samples[0]), n);
+	}
+	
+	if(!w_ok)
+	{
+		listener.log(std::string("Could not write ") + out.error());
+		return false;
+	}
+	
+	return true;
+}
+
+/* Write a whole bus to an output at the given scale. */
+template <typename BusSample> bool audio_renderer::write_output(audio_output &out, const std::vector<BusSample> &all_samples, double scale, bool clamp)
+{
+	if(!out.open(options.sample_rate, CHANNELS, options.format, all_samples.size() / CHANNELS))
+	{
+		listener.log(std::string("Could not open ") + out.error());
+		return false;
+	}
+	
+	/* The samples are narrowed and written in blocks to avoid holding a
+	 * second copy of the whole mix in memory.
+	*/
+	
+	for(size_t base = 0; base < all_samples.size(); base += WRITE_BLOCK_SAMPLES)
+	{
+		size_t n = std::min((size_t)(WRITE_BLOCK_SAMPLES), all_samples.size() - base);
 		
-		SNDFILE *wav = sf_open(wav_path.c_str(), SFM_WRITE, &wav_fmt);
-		if(!wav)
+		if(!write_block(out, &(all_samples[base]), n, scale, clamp))
 		{
-			log_push(std::string("Could not open ") + wav_path + ": " + sf_strerror(NULL) + "\r\n");
+			out.close();
 			return false;
 		}
+	}
+	
+	if(!out.close())
+	{
+		listener.log(std::string("Could not close ") + out.error());
+		return false;
+	}
+	
+	return true;
+}
+
+/* Save the mix bus to the stem file, so that later renders with different
+ * volume settings don't have to mix the log again. Failing to save it isn't
+ * an error, it just won't be there next time.
+*/
+template <typename BusSample> void audio_renderer::save_stem(const std::vector<BusSample> &all_samples, double low, double high)
+{
+	FILE *stem = fopen(options.stem_path.c_str(), "wb");
+	if(!stem)
+	{
+		listener.log(std::string("Could not create ") + options.stem_path + ": " + strerror(errno));
+		return;
+	}
+	
+	stem_header header;
+	memset(&header, 0, sizeof(header));
+	
+	memcpy(header.magic, STEM_MAGIC, sizeof(header.magic));
+	header.version = STEM_VERSION;
+	
+	header.mix_bus     = options.mix_bus;
+	header.sample_rate = options.sample_rate;
+	header.frame_rate  = options.frame_rate;
+	header.channels    = CHANNELS;
+	header.scan_ahead  = options.scan_ahead;
+	
+	header.log_size = log.size();
+	header.log_hash = hash_log();
+	header.samples  = all_samples.size();
+	
+	header.low  = low;
+	header.high = high;
+	
+	header.loudness_valid = loudness.valid;
+	header.integrated     = loudness.integrated;
+	header.range          = loudness.range;
+	header.true_peak      = loudness.true_peak;
+	
+	if(fwrite(&header, sizeof(header), 1, stem) != 1
+		|| (!all_samples.empty() && fwrite(&(all_samples[0]), sizeof(BusSample), all_samples.size(), stem) != all_samples.size())
+		|| fclose(stem) != 0)
+	{
+		listener.log(std::string("Could not write ") + options.stem_path + ": " + strerror(errno));
+		remove(options.stem_path.c_str());
+	}
+}
+
+/* Open the stem file and read its header if it holds the mix of the current
+ * log with the current settings. Returns NULL otherwise.
+*/
+FILE *audio_renderer::open_stem(stem_header &header)
+{
+	FILE *stem = fopen(options.stem_path.c_str(), "rb");
+	if(!stem)
+	{
+		return NULL;
+	}
+	
+	uint64_t stem_size = 0;
+	
+	if(fseeko64(stem, 0, SEEK_END) == 0)
+	{
+		stem_size = ftello64(stem);
+	}
+	
+	if(fseeko64(stem, 0, SEEK_SET) != 0 || fread(&header, sizeof(header), 1, stem) != 1)
+	{
+		fclose(stem);
+		return NULL;
+	}
+	
+	if(memcmp(header.magic, STEM_MAGIC, sizeof(header.magic)) != 0
+		|| header.version != STEM_VERSION
+		|| header.mix_bus != options.mix_bus
+		|| header.sample_rate != options.sample_rate
+		|| header.frame_rate != options.frame_rate
+		|| header.channels != CHANNELS
+		|| header.scan_ahead != options.scan_ahead
+		|| header.log_size != log.size()
+		|| stem_size != sizeof(header) + header.samples * 4
+		|| header.log_hash != hash_log())
+	{
+		listener.log("Ignoring out of date " + options.stem_path);
+		
+		fclose(stem);
+		return NULL;
+	}
+	
+	return stem;
+}
+
+/* 64-bit FNV-1a of the whole log, so a cached mix isn't reused for another
+ * log of the same size or one rewritten in place. The log is only read, which
+ * is far quicker than mixing it.
+*/
+uint64_t audio_renderer::hash_log()
+{
+	uint64_t hash = 14695981039346656037ULL;
+	
+	std::vector<unsigned char> buf(HASH_BLOCK_SIZE);
+	
+	uint64_t offset = 0;
+	size_t len;
+	
+	while((len = log.read(offset, &(buf[0]), buf.size())) > 0)
+	{
+		for(size_t i = 0; i < len; ++i)
+		{
+			hash = (hash ^ buf[i]) * 1099511628211ULL;
+		}
 		
-		sf_write_short(wav, &(w_samples[0]), w_samples.size());
+		offset += len;
+	}
+	
+	return hash;
+}
+
+/* Write the output from the stem file, which open_stem() has checked. */
+template <typename BusSample> bool audio_renderer::write_stem_output(FILE *stem, const stem_header &header)
+{
+	listener.log("Using the mix from " + options.stem_path);
+	
+	listener.phase(rp_normalise);
+	
+	if(header.loudness_valid)
+	{
+		loudness.valid      = true;
+		loudness.integrated = header.integrated;
+		loudness.range      = header.range;
+		loudness.true_peak  = header.true_peak;
+	}
+	
+	log_loudness();
+	
+	double scale = choose_scale(header.low, header.high);
+	
+	listener.phase(rp_write);
+	
+	if(!output.open(options.sample_rate, CHANNELS, options.format, header.samples / CHANNELS))
+	{
+		listener.log(std::string("Could not open ") + output.error());
+		return false;
+	}
+	
+	std::vector<BusSample> block(WRITE_BLOCK_SAMPLES);
+	
+	for(uint64_t base = 0; base < header.samples; base += WRITE_BLOCK_SAMPLES)
+	{
+		size_t n = std::min((uint64_t)(WRITE_BLOCK_SAMPLES), header.samples - base);
 		
-		sf_close(wav);
+		if(fread(&(block[0]), sizeof(BusSample), n, stem) != n)
+		{
+			listener.log(std::string("Could not read ") + options.stem_path);
+			output.close();
+			
+			return false;
+		}
+		
+		if(!write_block(output, &(block[0]), n, scale, false))
+		{
+			output.close();
+			return false;
+		}
+	}
+	
+	if(!output.close())
+	{
+		listener.log(std::string("Could not close ") + output.error());
+		return false;
 	}
 	
 	return true;
@@ -18,20 +18,450 @@
 #ifndef AREC_AUDIO_HPP
 #define AREC_AUDIO_HPP
 
-#include <windows.h>
 #include <string>
 #include <vector>
 #include <map>
+#include <set>
 #include <stdint.h>
+#include <stdio.h>
 #include <sndfile.h>
 
-#include "main.hpp"
+#include "loudness.hpp"
 
-/* Format to use when generating the game audio. */
-#define SAMPLE_RATE 44100
+/* Format to use when generating the game audio. The sample rate is chosen
+ * from sample_rates by config.audio_rate.
+*/
 #define SAMPLE_BITS 16
 #define CHANNELS    2
 
-bool make_output_wav();
+extern const unsigned int sample_rates[];
+
+/* Sample formats used to hold the mix before it is narrowed to the output
+ * format, indexes into mix_buses.
+*/
+#define MIX_BUS_INT32 0
+#define MIX_BUS_FLOAT 1
+
+extern const char *mix_buses[];
+
+struct wav_format
+{
+	const char *name;
+	int format;	/* SF_FORMAT_XXX subtype */
+};
+
+extern const wav_format wav_formats[];
+
+int get_wav_format_index(const std::string &name);
+
+/* Settings for an audio_renderer. */
+struct audio_render_options
+{
+	unsigned int frame_rate;	/* Frame rate the log was captured at */
+	unsigned int sample_rate;	/* Sample rate of the output */
+	
+	unsigned int mix_bus;		/* MIX_BUS_XXX */
+	int format;			/* SF_FORMAT_XXX subtype of the output */
+	
+	int init_vol;
+	
+	bool fix_clipping;
+	int min_vol;
+	
+	/* Set the volume to bring the integrated loudness of the mix to
+	 * target_lufs instead of using init_vol, without letting the true
+	 * peak exceed max_true_peak dBTP.
+	*/
+	bool normalise;
+	double target_lufs;
+	double max_true_peak;
+	
+	/* Number of frames in the capture if known, used to size the mix
+	 * up front.
+	*/
+	size_t frame_count;
+	
+	/* File to cache the mix bus in before the output volume is applied,
+	 * empty to disable. If the cache matches the log and settings, the
+	 * log isn't mixed again and only the volume and output format are
+	 * applied to it.
+	*/
+	std::string stem_path;
+	
+	/* Number of frames the search for background music is kept ahead of
+	 * the mix, zero to search the whole log before mixing any of it. A
+	 * log which is still being written can only be mixed as it grows if
+	 * this is set. The mix comes out the same either way, if the search
+	 * finds anything too late for the part already mixed, the whole log
+	 * is searched and mixed again.
+	*/
+	unsigned int scan_ahead;
+	
+	audio_render_options();
+};
+
+/* Source of the audio log for an audio_renderer. */
+class audio_log_source
+{
+	public:
+		virtual ~audio_log_source() {}
+		
+		/* Read up to size bytes from offset within the log into buf.
+		 * Returns the number of bytes read, which is only less than
+		 * size at the end of the log.
+		*/
+		virtual size_t read(uint64_t offset, void *buf, size_t size) = 0;
+		
+		/* Total size of the log in bytes. */
+		virtual uint64_t size() = 0;
+};
+
+/* Reads an audio log from an open stdio stream. */
+class audio_log_file: public audio_log_source
+{
+	public:
+		audio_log_file(FILE *file);
+		
+		virtual size_t read(uint64_t offset, void *buf, size_t size);
+		virtual uint64_t size();
+	
+	private:
+		FILE *file;
+		uint64_t file_pos;
+};
+
+/* Follows an audio log which is still being written. Reads past the end of
+ * what has been written so far wait for the rest to arrive, until the writer
+ * is done with the log.
+*/
+class audio_log_tail: public audio_log_source
+{
+	public:
+		audio_log_tail(audio_log_source &log);
+		
+		virtual size_t read(uint64_t offset, void *buf, size_t size);
+		
+		/* Size of the log written so far. */
+		virtual uint64_t size();
+	
+	protected:
+		/* Returns true once nothing more will be written to the log. */
+		virtual bool writer_done() = 0;
+	
+	private:
+		audio_log_source &log;
+};
+
+/* Destination for the audio mixed by an audio_renderer. */
+class audio_output
+{
+	public:
+		virtual ~audio_output() {}
+		
+		/* Prepare to receive samples in the given format, which is an
+		 * SF_FORMAT_XXX subtype. frames is the number of frames which
+		 * will be written, zero if not known. Returns false on error.
+		*/
+		virtual bool open(unsigned int sample_rate, unsigned int channels, int format, uint64_t frames) = 0;
+		
+		/* Write interleaved samples. 16-bit PCM output is written as
+		 * int16_t, 24-bit PCM as the most significant bits of int32_t
+		 * and float output as float.
+		*/
+		virtual bool write(const int16_t *samples, size_t count) = 0;
+		virtual bool write(const int32_t *samples, size_t count) = 0;
+		virtual bool write(const float *samples, size_t count) = 0;
+		
+		virtual bool close() = 0;
+		
+		/* Description of the last error. */
+		virtual std::string error() = 0;
+};
+
+/* Pack samples into the little endian layout used by WAV files, which is also
+ * that of raw s16le, s24le and f32le PCM, and return the end of the packed
+ * samples. 24-bit samples are the most significant bits of each int32_t.
+*/
+unsigned char *pack_samples(unsigned char *out, const int16_t *samples, size_t count);
+unsigned char *pack_samples(unsigned char *out, const int32_t *samples, size_t count);
+unsigned char *pack_samples(unsigned char *out, const float *samples, size_t count);
+
+/* Writes mixed audio to a WAV file using libsndfile.
+ *
+ * Files which would be too big for a WAV file are written as RF64, or W64 if
+ * libsndfile can't write RF64. The file is preallocated when its size is
+ * known and the samples are written in large blocks aligned to the disk.
+*/
+class audio_wav_output: public audio_output
+{
+	public:
+		audio_wav_output(const std::string &path);
+		virtual ~audio_wav_output();
+		
+		virtual bool open(unsigned int sample_rate, unsigned int channels, int format, uint64_t frames);
+		
+		virtual bool write(const int16_t *samples, size_t count);
+		virtual bool write(const int32_t *samples, size_t count);
+		virtual bool write(const float *samples, size_t count);
+		
+		virtual bool close();
+		
+		virtual std::string error();
+	
+	private:
+		std::string path;
+		
+		int fd;
+		SNDFILE *wav;
+		
+		bool preallocated;
+		
+		/* Samples are packed into buffer and handed to libsndfile in
+		 * flush_size runs, the first of which is cut short to bring
+		 * the rest into alignment.
+		*/
+		unsigned int sample_size;
+		std::vector<unsigned char> buffer;
+		size_t buffer_used;
+		size_t flush_size;
+		size_t block_size;
+		
+		std::string last_error;
+		
+		template <typename Sample> bool write_samples(const Sample *samples, size_t count);
+		bool bad_sample_type();
+		bool flush();
+		
+		void cleanup();
+};
+
+/* Stages of rendering, in the order they are reported to listeners. */
+enum audio_render_phase
+{
+	rp_scan,	/* Searching the log for background music */
+	rp_mix,		/* Mixing the log down */
+	rp_normalise,	/* Choosing the output volume */
+	rp_write,	/* Writing to the output */
+	rp_done
+};
+
+/* Receives status messages and progress from an audio_renderer. */
+class audio_render_listener
+{
+	public:
+		virtual ~audio_render_listener() {}
+		
+		/* A line of status output, without any line ending. */
+		virtual void log(const std::string &msg) = 0;
+		
+		/* Called after each frame has been mixed. frames is the
+		 * frame_count from the options, zero if not known.
+		*/
+		virtual void progress(unsigned int frame, size_t frames) {}
+		
+		/* Called as rendering moves on to each phase, and with rp_done
+		 * once it has finished or failed.
+		*/
+		virtual void phase(audio_render_phase phase) {}
+};
+
+/* A buffer being played by the game. */
+struct audio_buffer
+{
+	unsigned char *buf;
+	size_t size;
+	
+	unsigned int sample_rate;
+	unsigned int sample_bits;
+	unsigned int channels;
+	
+	bool playing;
+	bool looping;
+	size_t position;
+	double gain;
+	
+	audio_buffer(size_t new_size, unsigned int new_rate, unsigned int new_bits, unsigned int new_channels);
+	audio_buffer(const audio_buffer &src);
+	~audio_buffer();
+	
+	template <typename BusSample> void mix_frame(std::vector<BusSample> &f_samples, unsigned int frame_rate, unsigned int out_rate);
+};
+
+/* Everything written to a buffer while searching for background music. */
+struct background_tmp
+{
+	/* PCM format */
+	unsigned int rate;
+	unsigned int bits;
+	unsigned int channels;
+	
+	/* PCM data */
+	std::vector<unsigned char> data;
+	
+	/* Confirmed as a background buffer */
+	bool is_background;
+	
+	/* Last frame an AUDIO_OP_START was seen at */
+	unsigned int start_frame;
+};
+
+/* A background music track, resampled as it is mixed. */
+struct background_buffer
+{
+	/* PCM format */
+	unsigned int rate;
+	unsigned int bits;
+	unsigned int channels;
+	
+	/* PCM data of the track, taken from background_tmp and added to as
+	 * the rest of it is found.
+	*/
+	std::vector<unsigned char> data;
+	
+	unsigned int start_frame;
+	
+	/* Set if the mix ran out of the track before the search for
+	 * background music had reached the end of the log.
+	*/
+	bool starved;
+	
+	/* Output sample rate, number of whole samples in data, the length of
+	 * the track once resampled to the output format and the next frame of
+	 * it to be mixed.
+	*/
+	unsigned int out_rate;
+	size_t samples;
+	size_t frames;
+	size_t position;
+	
+	/* Scratch space for resampling one frame at a time. */
+	std::vector<int16_t> resample_out;
+	
+	background_buffer(background_tmp &tmp, unsigned int out_rate);
+	
+	void count_samples();
+	
+	size_t next_frame(size_t max_frames, double gain);
+	template <typename BusSample> void mix_frame(std::vector<BusSample> &f_samples, size_t out_frames, double gain);
+};
+
+/* Header of a cached mix bus, followed by the samples of the bus in the
+ * native byte order.
+*/
+struct stem_header
+{
+	char magic[8];
+	uint32_t version;
+	
+	/* Settings the log was mixed with. */
+	uint32_t mix_bus;
+	uint32_t sample_rate;
+	uint32_t frame_rate;
+	uint32_t channels;
+	uint32_t scan_ahead;
+	
+	/* Nonzero if the loudness below was measured. */
+	uint32_t loudness_valid;
+	
+	/* Size and hash of the log which was mixed. */
+	uint64_t log_size;
+	uint64_t log_hash;
+	
+	/* Number of samples in the bus and the lowest and highest of them. */
+	uint64_t samples;
+	double low, high;
+	
+	/* Loudness of the bus at full volume. */
+	double integrated, range, true_peak;
+};
+
+/* Parts of the mix which can be written to outputs of their own. */
+enum audio_stem
+{
+	STEM_MUSIC,	/* Background music */
+	STEM_EFFECTS,	/* Every other sound */
+	STEM_COUNT
+};
+
+/* Mixes the game audio described by an audio log.
+ *
+ * An audio_renderer holds all of its own state, so any number of them may
+ * be run at once with different sources, outputs and listeners.
+*/
+class audio_renderer
+{
+	public:
+		audio_renderer(const audio_render_options &options, audio_log_source &log, audio_output &output, audio_render_listener &listener);
+		
+		/* Also write one part of the mix to its own output, which
+		 * must stay valid until render() returns. The stems are mixed
+		 * in the same pass as the master and written at the same
+		 * volume. Pass NULL to stop writing a stem.
+		*/
+		void set_stem_output(audio_stem stem, audio_output *output);
+		
+		/* Mix the whole log and write it to the output.
+		 * Returns false on error.
+		*/
+		bool render();
+		
+		/* Loudness of the mix at full volume, measured by the last
+		 * call to render().
+		*/
+		const loudness_stats &get_loudness() const;
+	
+	private:
+		audio_render_options options;
+		
+		audio_log_source &log;
+		audio_output &output;
+		audio_render_listener &listener;
+		
+		audio_output *stem_outputs[STEM_COUNT];
+		
+		std::map<unsigned int, background_buffer> background_buffers;
+		std::map<unsigned int, audio_buffer> buffers;
+		
+		/* Progress of the search for background music, which may be
+		 * run ahead of the mix a bit at a time. scan_buffers holds the
+		 * buffers which haven't been ruled out yet.
+		 *
+		 * scan_mixed holds the buffers which have been mixed as sound
+		 * effects while the search was running and scan_late is set
+		 * once the search finds something which changes part of the
+		 * mix already done.
+		*/
+		std::map<unsigned int, background_tmp> scan_buffers;
+		uint64_t scan_offset;
+		unsigned int scan_frame;
+		bool scan_done;
+		
+		std::set<unsigned int> scan_mixed;
+		bool scan_late;
+		
+		loudness_stats loudness;
+		
+		bool read_log(uint64_t &offset, void *buf, size_t size);
+		
+		void reset_mix();
+		bool find_background();
+		bool scan_log(unsigned int until_frame);
+		void log_background();
+		
+		template <typename BusSample> bool mix_and_write();
+		template <typename BusSample> bool mix(std::vector<BusSample> &all_samples, std::vector<BusSample> stem_samples[]);
+		int choose_volume(double low, double high);
+		double choose_scale(double low, double high);
+		
+		void log_loudness();
+		
+		template <typename BusSample> bool write_block(audio_output &out, const BusSample *samples, size_t n, double scale, bool clamp);
+		template <typename BusSample> bool write_output(audio_output &out, const std::vector<BusSample> &all_samples, double scale, bool clamp);
+		
+		template <typename BusSample> void save_stem(const std::vector<BusSample> &all_samples, double low, double high);
+		FILE *open_stem(stem_header &header);
+		uint64_t hash_log();
+		template <typename BusSample> bool write_stem_output(FILE *stem, const stem_header &header);
+};
 
 #endif /* !AREC_AUDIO_HPP */
@@ -0,0 +1,364 @@
+/* Armageddon Recorder - Mixer benchmark
+ * Copyright (C) 2013 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <string>
+#include <chrono>
+#include <sndfile.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+
+#include "audio.hpp"
+#include "synth-log.hpp"
+
+typedef std::chrono::steady_clock bench_clock;
+
+static double seconds_since(bench_clock::time_point begin)
+{
+	return std::chrono::duration<double>(bench_clock::now() - begin).count();
+}
+
+/* Counts the samples written to an output. With no output the samples are
+ * discarded, so only the cost of the renderer itself is measured.
+*/
+struct counting_output: public audio_output
+{
+	audio_output *output;
+	uint64_t samples;
+	
+	counting_output(audio_output *output): output(output), samples(0) {}
+	
+	virtual bool open(unsigned int sample_rate, unsigned int channels, int format, uint64_t frames)
+	{
+		return !output || output->open(sample_rate, channels, format, frames);
+	}
+	
+	virtual bool write(const int16_t *s, size_t count)
+	{
+		samples += count;
+		return !output || output->write(s, count);
+	}
+	
+	virtual bool write(const int32_t *s, size_t count)
+	{
+		samples += count;
+		return !output || output->write(s, count);
+	}
+	
+	virtual bool write(const float *s, size_t count)
+	{
+		samples += count;
+		return !output || output->write(s, count);
+	}
+	
+	virtual bool close()
+	{
+		return !output || output->close();
+	}
+	
+	virtual std::string error()
+	{
+		return output ? output->error() : "";
+	}
+};
+
+/* Records how long the renderer spends in each phase. */
+struct timing_listener: public audio_render_listener
+{
+	bench_clock::time_point phase_begin;
+	audio_render_phase current;
+	
+	double times[rp_done];
+	
+	timing_listener()
+	{
+		current = rp_done;
+		
+		for(int i = 0; i < rp_done; ++i)
+		{
+			times[i] = 0;
+		}
+	}
+	
+	virtual void log(const std::string &msg)
+	{
+		fprintf(stderr, "%s\n", msg.c_str());
+	}
+	
+	virtual void phase(audio_render_phase phase)
+	{
+		if(current != rp_done)
+		{
+			times[current] += seconds_since(phase_begin);
+		}
+		
+		current     = phase;
+		phase_begin = bench_clock::now();
+	}
+};
+
+/* Peak memory use of the process in bytes. */
+static uint64_t peak_rss()
+{
+	#ifdef _WIN32
+	PROCESS_MEMORY_COUNTERS pmc;
+	
+	if(GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof(pmc)))
+	{
+		return pmc.PeakWorkingSetSize;
+	}
+	#else
+	struct rusage usage;
+	
+	if(getrusage(RUSAGE_SELF, &usage) == 0)
+	{
+		return (uint64_t)(usage.ru_maxrss) * 1024;
+	}
+	#endif
+	
+	return 0;
+}
+
+static void usage(const char *argv0)
+{
+	fprintf(stderr, "Usage: %s [options]\n", argv0);
+	fprintf(stderr, "\n");
+	fprintf(stderr, "Workload:\n");
+	fprintf(stderr, "  -i <path>     Mix an existing log instead of generating one\n");
+	fprintf(stderr, "  -t <minutes>  Length of the generated game, 1 to 60 (default 5)\n");
+	fprintf(stderr, "  -n <voices>   Sound effects playing at once (default 16)\n");
+	fprintf(stderr, "  -c <voices>   Size of each clone storm, 0 to disable (default 32)\n");
+	fprintf(stderr, "  -M            Don't stream background music\n");
+	fprintf(stderr, "  -S <seed>     Random seed (default 1)\n");
+	fprintf(stderr, "  -l <path>     Keep the generated log at path\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "Rendering:\n");
+	fprintf(stderr, "  -r <rate>     Frame rate (default 50)\n");
+	fprintf(stderr, "  -s <rate>     Output sample rate (default 44100)\n");
+	fprintf(stderr, "  -b <bus>      Mix bus, int32 or float (default int32)\n");
+	fprintf(stderr, "  -f <format>   Output format, 16, 24 or float (default 16)\n");
+	fprintf(stderr, "  -o <path>     Write the mix to a WAV file instead of discarding it\n");
+}
+
+static unsigned int get_opt_uint(char opt, const char *arg, unsigned int min, unsigned int max)
+{
+	char *end;
+	
+	errno = 0;
+	unsigned long value = strtoul(arg, &end, 10);
+	
+	if(*arg == '\0' || *end != '\0' || errno != 0 || value < min || value > max)
+	{
+		fprintf(stderr, "Invalid value for -%c: %s\n", opt, arg);
+		exit(1);
+	}
+	
+	return value;
+}
+
+int main(int argc, char **argv)
+{
+	synth_log_options synth;
+	audio_render_options options;
+	
+	const char *in_path  = NULL;
+	const char *log_path = NULL;
+	const char *wav_path = NULL;
+	
+	unsigned int minutes = 5;
+	
+	int opt;
+	while((opt = getopt(argc, argv, "i:t:n:c:MS:l:r:s:b:f:o:")) != -1)
+	{
+		switch(opt)
+		{
+			case 'i':
+				in_path = optarg;
+				break;
+			
+			case 't':
+				minutes = get_opt_uint(opt, optarg, 1, 60);
+				break;
+			
+			case 'n':
+				synth.voices = get_opt_uint(opt, optarg, 0, 1000);
+				break;
+			
+			case 'c':
+				synth.clone_storm = get_opt_uint(opt, optarg, 0, 1000);
+				break;
+			
+			case 'M':
+				synth.music = false;
+				break;
+			
+			case 'S':
+				synth.seed = get_opt_uint(opt, optarg, 0, 0xFFFFFFFF);
+				break;
+			
+			case 'l':
+				log_path = optarg;
+				break;
+			
+			case 'r':
+				options.frame_rate = synth.frame_rate = get_opt_uint(opt, optarg, 1, 1000);
+				break;
+			
+			case 's':
+				options.sample_rate = get_opt_uint(opt, optarg, 1000, 384000);
+				break;
+			
+			case 'b':
+			{
+				if(strcmp(optarg, "int32") == 0)
+				{
+					options.mix_bus = MIX_BUS_INT32;
+				}
+				else if(strcmp(optarg, "float") == 0)
+				{
+					options.mix_bus = MIX_BUS_FLOAT;
+				}
+				else{
+					fprintf(stderr, "Unknown mix bus: %s\n", optarg);
+					return 1;
+				}
+				
+				break;
+			}
+			
+			case 'f':
+			{
+				if(strcmp(optarg, "16") == 0)
+				{
+					options.format = SF_FORMAT_PCM_16;
+				}
+				else if(strcmp(optarg, "24") == 0)
+				{
+					options.format = SF_FORMAT_PCM_24;
+				}
+				else if(strcmp(optarg, "float") == 0)
+				{
+					options.format = SF_FORMAT_FLOAT;
+				}
+				else{
+					fprintf(stderr, "Unknown output format: %s\n", optarg);
+					return 1;
+				}
+				
+				break;
+			}
+			
+			case 'o':
+				wav_path = optarg;
+				break;
+			
+			default:
+				usage(argv[0]);
+				return 1;
+		}
+	}
+	
+	if(optind != argc || options.sample_rate < options.frame_rate)
+	{
+		usage(argv[0]);
+		return 1;
+	}
+	
+	synth.frames = minutes * 60 * synth.frame_rate;
+	
+	FILE *log;
+	
+	if(in_path)
+	{
+		if(!(log = fopen(in_path, "rb")))
+		{
+			fprintf(stderr, "Could not open %s: %s\n", in_path, strerror(errno));
+			return 1;
+		}
+	}
+	else{
+		if(!(log = (log_path ? fopen(log_path, "w+b") : tmpfile())))
+		{
+			fprintf(stderr, "Could not create log: %s\n", strerror(errno));
+			return 1;
+		}
+		
+		bench_clock::time_point begin = bench_clock::now();
+		
+		synth_log_stats stats;
+		
+		if(!synth_log_write(log, synth, stats) || fflush(log) != 0)
+		{
+			fprintf(stderr, "Could not write log: %s\n", strerror(errno));
+			return 1;
+		}
+		
+		printf("Generated %u minute log: %u frames, %llu events, %.1f MB in %.3f s\n",
+			minutes, stats.frames, (unsigned long long)(stats.events),
+			stats.bytes / 1048576.0, seconds_since(begin));
+		
+		options.frame_count = stats.frames;
+	}
+	
+	audio_wav_output wav(wav_path ? wav_path : "");
+	counting_output output(wav_path ? &wav : NULL);
+	
+	audio_log_file log_source(log);
+	timing_listener listener;
+	
+	bench_clock::time_point begin = bench_clock::now();
+	
+	audio_renderer renderer(options, log_source, output, listener);
+	bool ok = renderer.render();
+	
+	double total = seconds_since(begin);
+	
+	fclose(log);
+	
+	if(!ok)
+	{
+		return 1;
+	}
+	
+	static const char *phase_names[] = { "scan", "mix", "normalise", "write" };
+	
+	for(int i = 0; i < rp_done; ++i)
+	{
+		printf("%-10s %8.3f s\n", phase_names[i], listener.times[i]);
+	}
+	
+	uint64_t samples = output.samples;
+	
+	printf("%-10s %8.3f s\n", "total", total);
+	printf("\n");
+	printf("Samples:   %llu\n", (unsigned long long)(samples));
+	printf("Mix:       %.0f samples/sec\n", samples / listener.times[rp_mix]);
+	printf("Overall:   %.0f samples/sec (%.1fx realtime)\n", samples / total,
+		((double)(samples) / (options.sample_rate * CHANNELS)) / total);
+	printf("Peak RSS:  %.1f MB\n", peak_rss() / 1048576.0);
+	
+	return 0;
+}
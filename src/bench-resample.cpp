@@ -0,0 +1,254 @@
+/* Armageddon Recorder - Resampler benchmark
+ * Copyright (C) 2013 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <math.h>
+#include <stdint.h>
+#include <vector>
+#include <chrono>
+
+#include "resample.hpp"
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+/* Level of the test tone relative to full scale. */
+#define TONE_LEVEL 0.9
+
+typedef std::chrono::steady_clock bench_clock;
+
+static double seconds_since(bench_clock::time_point begin)
+{
+	return std::chrono::duration<double>(bench_clock::now() - begin).count();
+}
+
+struct bench_settings
+{
+	double seconds;		/* Length of the input */
+	double tone;		/* Frequency of the test tone in Hz */
+	double min_time;	/* Minimum time to spend timing each case */
+};
+
+/* Quantise a sample in the range -1..1 to an input format. */
+template <typename InSample> InSample quantise(double v);
+
+template <> uint8_t quantise<uint8_t>(double v)
+{
+	return 128 + (int)(lround(v * 127));
+}
+
+template <> int16_t quantise<int16_t>(double v)
+{
+	return lround(v * 32767);
+}
+
+template <typename InSample> const char *sample_name();
+template <> const char *sample_name<uint8_t>() { return "u8"; }
+template <> const char *sample_name<int16_t>() { return "s16"; }
+
+/* The exact value of the test tone in channel c at time t, at 16-bit scale.
+ * Each channel is given a different phase so that any mixing up of channels
+ * shows up as error.
+*/
+static double tone_at(const bench_settings &settings, unsigned int c, double t)
+{
+	return TONE_LEVEL * 32767 * sin(2 * M_PI * settings.tone * t + c);
+}
+
+/* Signal to noise ratio of out against the exact tone, in dB. Only frames
+ * which are interpolated between two input frames are counted, the frames
+ * past the end of the input are just the last input frame extended.
+*/
+static double snr(const bench_settings &settings, const std::vector<int16_t> &out, unsigned int channels, unsigned int rate_in, unsigned int rate_out, size_t in_frames)
+{
+	double signal = 0, noise = 0;
+	
+	for(size_t f = 0; f < out.size() / channels; ++f)
+	{
+		if((size_t)(ceil(f * ((double)(rate_in) / rate_out))) >= in_frames)
+		{
+			break;
+		}
+		
+		for(unsigned int c = 0; c < channels; ++c)
+		{
+			double ref = tone_at(settings, c, (double)(f) / rate_out);
+			double err = out[f * channels + c] - ref;
+			
+			signal += ref * ref;
+			noise  += err * err;
+		}
+	}
+	
+	return noise > 0 ? 10 * log10(signal / noise) : INFINITY;
+}
+
+/* Run fn repeatedly for at least min_time seconds and return the average
+ * time it took in nanoseconds per output sample.
+*/
+template <typename F> double time_ns_per_sample(const bench_settings &settings, size_t out_samples, F fn)
+{
+	unsigned int runs = 0;
+	bench_clock::time_point begin = bench_clock::now();
+	
+	do {
+		fn();
+		++runs;
+	} while(seconds_since(begin) < settings.min_time);
+	
+	return (seconds_since(begin) * 1e9) / ((double)(out_samples) * runs);
+}
+
+template <typename InSample> void bench_case(const bench_settings &settings, unsigned int channels, unsigned int rate_in, unsigned int rate_out)
+{
+	/* Generate the test tone in the input format. */
+	
+	size_t in_frames = settings.seconds * rate_in;
+	
+	std::vector<InSample> in(in_frames * channels);
+	
+	for(size_t f = 0; f < in_frames; ++f)
+	{
+		for(unsigned int c = 0; c < channels; ++c)
+		{
+			in[f * channels + c] = quantise<InSample>(tone_at(settings, c, (double)(f) / rate_in) / 32767);
+		}
+	}
+	
+	/* The quality of the input itself limits how good the output can be,
+	 * so report it alongside the output.
+	*/
+	
+	std::vector<int16_t> in16 = pcm_resample<InSample,int16_t>(in.begin(), in.end(), channels, rate_in, rate_in);
+	double in_snr = snr(settings, in16, channels, rate_in, rate_in, in_frames);
+	
+	size_t out_samples = pcm_resample_frames(in.size(), channels, rate_in, rate_out) * channels;
+	
+	std::vector<int16_t> out;
+	
+	double serial_ns = time_ns_per_sample(settings, out_samples, [&]()
+	{
+		out = pcm_resample<InSample,int16_t>(in.begin(), in.end(), channels, rate_in, rate_out);
+	});
+	
+	double out_snr = snr(settings, out, channels, rate_in, rate_out, in_frames);
+	
+	double parallel_ns = time_ns_per_sample(settings, out_samples, [&]()
+	{
+		out = pcm_resample_parallel<InSample,int16_t>(in.begin(), in.end(), channels, rate_in, rate_out);
+	});
+	
+	printf("%-4s %-4s %8u %8u %8u %10.2f %10.2f %8.1f %8.1f\n",
+		sample_name<InSample>(), "s16", channels, rate_in, rate_out,
+		serial_ns, parallel_ns, out_snr, in_snr);
+}
+
+static void usage(const char *argv0)
+{
+	fprintf(stderr, "Usage: %s [options]\n", argv0);
+	fprintf(stderr, "\n");
+	fprintf(stderr, "  -d <seconds>  Length of the input (default 10)\n");
+	fprintf(stderr, "  -F <hz>       Frequency of the test tone (default 1000)\n");
+	fprintf(stderr, "  -t <seconds>  Minimum time to spend timing each case (default 0.5)\n");
+}
+
+static double get_opt_double(char opt, const char *arg, double min, double max)
+{
+	char *end;
+	
+	errno = 0;
+	double value = strtod(arg, &end);
+	
+	if(*arg == '\0' || *end != '\0' || errno != 0 || value < min || value > max)
+	{
+		fprintf(stderr, "Invalid value for -%c: %s\n", opt, arg);
+		exit(1);
+	}
+	
+	return value;
+}
+
+int main(int argc, char **argv)
+{
+	bench_settings settings;
+	settings.seconds  = 10;
+	settings.tone     = 1000;
+	settings.min_time = 0.5;
+	
+	int opt;
+	while((opt = getopt(argc, argv, "d:F:t:")) != -1)
+	{
+		switch(opt)
+		{
+			case 'd':
+				settings.seconds = get_opt_double(opt, optarg, 0.1, 3600);
+				break;
+			
+			case 'F':
+				settings.tone = get_opt_double(opt, optarg, 1, 5000);
+				break;
+			
+			case 't':
+				settings.min_time = get_opt_double(opt, optarg, 0, 60);
+				break;
+			
+			default:
+				usage(argv[0]);
+				return 1;
+		}
+	}
+	
+	if(optind != argc)
+	{
+		usage(argv[0]);
+		return 1;
+	}
+	
+	/* Rates used by the game's sounds and music, converted to each of the
+	 * output rates.
+	*/
+	
+	static const unsigned int rates[][2] = {
+		{ 11025, 44100 },
+		{ 22050, 44100 },
+		{ 44100, 44100 },
+		{ 48000, 44100 },
+		{ 11025, 48000 },
+		{ 22050, 48000 },
+		{ 44100, 48000 },
+		{ 0, 0 }
+	};
+	
+	printf("%-4s %-4s %8s %8s %8s %10s %10s %8s %8s\n",
+		"in", "out", "channels", "rate in", "rate out",
+		"ns/sample", "parallel", "SNR dB", "input");
+	
+	for(unsigned int channels = 1; channels <= 2; ++channels)
+	{
+		for(int r = 0; rates[r][0]; ++r)
+		{
+			bench_case<uint8_t>(settings, channels, rates[r][0], rates[r][1]);
+			bench_case<int16_t>(settings, channels, rates[r][0], rates[r][1]);
+		}
+	}
+	
+	return 0;
+}
@@ -0,0 +1,824 @@
+/* Armageddon Recorder - Parallel capture planning and stitching
+ * Copyright (C) 2013 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <ctype.h>
+#include <map>
+#include <set>
+#include <sstream>
+#include <algorithm>
+
+#include "capture-segments.hpp"
+#include "capture.hpp"
+#include "ds-capture.h"
+
+#ifdef _WIN32
+#define PATH_SEP "\\"
+#else
+#define PATH_SEP "/"
+#endif
+
+#define EVENT_CHECK 0x12345678
+
+/* Parse a replay time in the [[H:]M:]S[.ss] format WA takes, to the nearest
+ * millisecond below it.
+*/
+bool parse_replay_time(const std::string &time, uint64_t &ms)
+{
+	uint64_t secs = 0;
+	size_t i = 0;
+	
+	for(int field = 0; field < 3; ++field)
+	{
+		if(i >= time.length() || !isdigit(time[i]))
+		{
+			return false;
+		}
+		
+		uint64_t value = 0;
+		
+		while(i < time.length() && isdigit(time[i]))
+		{
+			value = value * 10 + (time[i++] - '0');
+		}
+		
+		secs = secs * 60 + value;
+		
+		if(i >= time.length() || time[i] != ':')
+		{
+			break;
+		}
+		
+		++i;
+	}
+	
+	ms = secs * 1000;
+	
+	if(i < time.length() && time[i] == '.')
+	{
+		unsigned int scale = 100;
+		
+		for(++i; i < time.length() && isdigit(time[i]); ++i)
+		{
+			ms += (time[i] - '0') * scale;
+			scale /= 10;
+		}
+	}
+	
+	return i == time.length();
+}
+
+std::string format_replay_time(uint64_t ms)
+{
+	char time[64];
+	
+	unsigned int h = ms / 3600000;
+	unsigned int m = (ms / 60000) % 60;
+	unsigned int s = (ms / 1000) % 60;
+	
+	if(ms % 10)
+	{
+		snprintf(time, sizeof(time), "%u:%02u:%02u.%03u", h, m, s, (unsigned int)(ms % 1000));
+	}
+	else{
+		snprintf(time, sizeof(time), "%u:%02u:%02u.%02u", h, m, s, (unsigned int)(ms % 1000) / 10);
+	}
+	
+	return time;
+}
+
+/* Split the part of a replay from start_ms to end_ms into up to count
+ * segments to be captured at once.
+ *
+ * The segments begin a whole number of seconds after the start, so every WA
+ * instance renders its frames at the same points in the replay as the first
+ * one and the frame numbers line up.
+*/
+std::vector<capture_segment> plan_capture_segments(uint64_t start_ms, uint64_t end_ms,
+	unsigned int frame_rate, unsigned int count, unsigned int lead_in_secs)
+{
+	std::vector<capture_segment> segments;
+	
+	uint64_t length   = end_ms > start_ms ? end_ms - start_ms : 0;
+	uint64_t seg_secs = std::max<uint64_t>((length + count * 1000 - 1) / (count * 1000), 1);
+	
+	lead_in_secs = std::min<uint64_t>(lead_in_secs, seg_secs);
+	
+	for(unsigned int i = 0; i < count; ++i)
+	{
+		uint64_t begin = start_ms + i * seg_secs * 1000;
+		uint64_t end   = begin + seg_secs * 1000;
+		
+		bool last = (i + 1 == count || end >= end_ms);
+		
+		char prefix[32];
+		snprintf(prefix, sizeof(prefix), FRAME_PREFIX "s%02u_", i);
+		
+		capture_segment segment;
+		
+		segment.prefix = prefix;
+		segment.lead_in = i ? lead_in_secs * frame_rate : 0;
+		
+		segment.start_time = format_replay_time(begin - (i ? lead_in_secs * 1000 : 0));
+		segment.end_time   = format_replay_time(last ? end_ms : end);
+		
+		segment.first_frame = i * seg_secs * frame_rate;
+		segment.frames      = last ? 0 : seg_secs * frame_rate;
+		
+		segments.push_back(segment);
+		
+		if(last)
+		{
+			break;
+		}
+	}
+	
+	return segments;
+}
+
+/* Plan the capture of a replay from start_time to end_time, in the format WA
+ * takes them with an empty start_time for the start of the replay.
+ *
+ * The capture is split between up to instances segments if there is more than
+ * one and it has a usable end time, and split is set. Otherwise it is left to
+ * a single instance writing under FRAME_PREFIX.
+*/
+std::vector<capture_segment> plan_capture(const std::string &start_time, const std::string &end_time,
+	unsigned int frame_rate, unsigned int instances, unsigned int lead_in_secs, bool &split)
+{
+	uint64_t start_ms = 0, end_ms;
+	
+	split = instances > 1
+		&& parse_replay_time(end_time, end_ms)
+		&& (start_time.empty() || parse_replay_time(start_time, start_ms));
+	
+	if(split)
+	{
+		return plan_capture_segments(start_ms, end_ms, frame_rate, instances, lead_in_secs);
+	}
+	
+	capture_segment whole;
+	
+	whole.prefix      = FRAME_PREFIX;
+	whole.start_time  = start_time;
+	whole.end_time    = end_time;
+	whole.first_frame = 0;
+	whole.lead_in     = 0;
+	whole.frames      = 0;
+	
+	return std::vector<capture_segment>(1, whole);
+}
+
+/* Start an instance capturing each part of the replay, stopping at the first
+ * which can't be started.
+*/
+bool launch_capture(capture_launcher &launcher, const capture_settings &settings,
+	const std::vector<capture_segment> &parts, std::string &error)
+{
+	for(auto p = parts.begin(); p != parts.end(); ++p)
+	{
+		capture_instance instance;
+		
+		instance.args.push_back("/getvideo");
+		instance.args.push_back(settings.replay_file);
+		instance.args.push_back(settings.frame_rate_arg);
+		instance.args.push_back(p->start_time);
+		instance.args.push_back(p->end_time);
+		
+		std::ostringstream width, height;
+		width  << settings.width;
+		height << settings.height;
+		
+		instance.args.push_back(width.str());
+		instance.args.push_back(height.str());
+		instance.args.push_back(p->prefix);
+		
+		instance.frame_prefix = settings.dir + PATH_SEP + p->prefix;
+		instance.audio_log    = settings.dir + PATH_SEP + p->prefix + "audio.dat";
+		
+		if(!launcher.launch(instance, error))
+		{
+			return false;
+		}
+	}
+	
+	return true;
+}
+
+static std::string frame_path(const std::string &dir, const std::string &prefix, unsigned int frame)
+{
+	char name[32];
+	snprintf(name, sizeof(name), "%06u.png", frame);
+	
+	return dir + PATH_SEP + prefix + name;
+}
+
+/* Rename the frames kept from a segment into the stitched sequence of frames
+ * and delete the rest, or delete all of them if it is dropped. kept is set to
+ * the number of frames which were or would have been kept.
+*/
+static bool move_frames(const std::string &dir, const capture_segment &s, bool drop, unsigned int &kept, std::string &error)
+{
+	kept = 0;
+	
+	for(unsigned int frame = 0;; ++frame)
+	{
+		std::string path = frame_path(dir, s.prefix, frame);
+		
+		bool keep = frame >= s.lead_in && (s.frames == 0 || kept < s.frames);
+		
+		int ret = (keep && !drop)
+			? rename(path.c_str(), frame_path(dir, FRAME_PREFIX, s.first_frame + kept).c_str())
+			: remove(path.c_str());
+		
+		if(ret != 0)
+		{
+			if(errno == ENOENT)
+			{
+				break;
+			}
+			
+			error = "Cannot move " + path + ": " + strerror(errno);
+			return false;
+		}
+		
+		if(keep)
+		{
+			++kept;
+		}
+	}
+	
+	return true;
+}
+
+/* Rename the frames kept from each segment into a single sequence of frames
+ * and delete the rest.
+ *
+ * An end time past the end of the replay leaves the segment the replay ends in
+ * short, as WA stops there. The capture is cut down to end with it, and the
+ * segments after it are dropped along with their audio logs. Those can't have
+ * got past their lead ins, or an instance stopped early for some other reason.
+*/
+bool stitch_frames(const std::string &dir, std::vector<capture_segment> &segments, std::string &error)
+{
+	size_t end = segments.size();
+	std::string short_error;
+	
+	for(size_t i = 0; i < segments.size(); ++i)
+	{
+		capture_segment &s = segments[i];
+		unsigned int kept;
+		
+		if(!move_frames(dir, s, i >= end, kept, error))
+		{
+			return false;
+		}
+		
+		if(i >= end)
+		{
+			if(kept)
+			{
+				error = short_error;
+				return false;
+			}
+			
+			remove((dir + PATH_SEP + s.prefix + "audio.dat").c_str());
+		}
+		else if(kept < s.frames)
+		{
+			std::ostringstream msg;
+			msg << "Only " << kept << " of " << s.frames << " frames were captured by " << s.prefix;
+			
+			short_error = msg.str();
+			
+			s.frames = kept;
+			end = i + 1;
+		}
+	}
+	
+	segments.resize(end);
+	
+	return true;
+}
+
+/* State of a buffer, followed through the lead in of a segment to find out
+ * where it has got to by the time the segment's frames are used.
+*/
+struct stitch_buffer
+{
+	unsigned int id;
+	
+	stitch_buffer(unsigned int id):
+		id(id), size(0), sample_rate(0), sample_bits(0), channels(0),
+		playing(false), looping(false), position(0),
+		background(false), carried(false) {}
+	
+	size_t size;
+	unsigned int sample_rate, sample_bits, channels;
+	
+	bool playing, looping;
+	size_t position;
+	
+	/* Background music is streamed through the buffer. If it is carried,
+	 * the buffer was created by an earlier segment and this segment's
+	 * stream is appended to it once the lead in is over.
+	*/
+	bool background, carried;
+	
+	/* Advance the play position by one frame, the same way the renderer
+	 * does when it mixes the buffer.
+	*/
+	void advance(unsigned int frame_rate)
+	{
+		size_t frame_size = (sample_bits / 8) * channels;
+		
+		if(!playing || (!looping && position + frame_size >= size))
+		{
+			return;
+		}
+		
+		for(unsigned int f = 0; f < sample_rate / frame_rate; ++f)
+		{
+			if(looping && position + frame_size >= size)
+			{
+				position = 0;
+			}
+			
+			if(position + frame_size < size)
+			{
+				position += frame_size;
+			}
+		}
+	}
+};
+
+/* Find the buffers the renderer will take for background music in the part
+ * of a log before end_frame (zero for all of it), in the order it finds them,
+ * and rewind the log. Like the renderer, a buffer is taken to be streaming
+ * music once it is loaded at an offset other than the start.
+*/
+static bool find_background(FILE *in, unsigned int end_frame, std::vector<unsigned int> &ids)
+{
+	std::set<unsigned int> created;
+	
+	audio_event event;
+	
+	while(fread(&event, sizeof(event), 1, in) == 1 && event.check == EVENT_CHECK
+		&& (!end_frame || event.frame < end_frame))
+	{
+		if(event.op == AUDIO_OP_INIT)
+		{
+			created.insert(event.e.init.buf_id);
+		}
+		else if(event.op == AUDIO_OP_FREE)
+		{
+			created.erase(event.e.free.buf_id);
+		}
+		else if(event.op == AUDIO_OP_LOAD)
+		{
+			if(event.e.load.offset && created.erase(event.e.load.buf_id))
+			{
+				ids.push_back(event.e.load.buf_id);
+			}
+			
+			if(fseek(in, event.e.load.size, SEEK_CUR) != 0)
+			{
+				return false;
+			}
+		}
+	}
+	
+	bool ok = !ferror(in);
+	rewind(in);
+	
+	return ok;
+}
+
+/* Copies the events kept from each segment's audio log into the stitched log,
+ * giving every segment's buffers their own IDs.
+ *
+ * WA's music isn't tied to the replay time, so every instance starts it
+ * afresh. Rather than restarting the track at each join, the music streamed
+ * by a later segment is appended to the buffer the first segment streamed it
+ * through, leaving out whatever was streamed during its lead in.
+*/
+class log_stitcher
+{
+	public:
+		log_stitcher(FILE *out, unsigned int frame_rate):
+			out(out), frame_rate(frame_rate), next_id(1) {}
+		
+		bool add_segment(FILE *in, const capture_segment &segment, std::string &error);
+	
+	private:
+		FILE *out;
+		unsigned int frame_rate;
+		
+		unsigned int next_id;
+		
+		/* Buffers of the segment being added, by their ID in its log,
+		 * and the frame of its lead in they have been followed to.
+		*/
+		std::map<unsigned int, stitch_buffer> buffers;
+		unsigned int frame;
+		
+		/* Stitched IDs of the background music buffers carried from
+		 * one segment to the next, until they are freed.
+		*/
+		std::vector<unsigned int> music;
+		
+		stitch_buffer &buffer(unsigned int id);
+		bool carried(const audio_event &event);
+		void advance(unsigned int to_frame);
+		
+		bool write(audio_event event, unsigned int frame, const std::vector<unsigned char> &data);
+};
+
+/* Get a buffer of the segment being added, giving it a new stitched ID if it
+ * hasn't been seen before. Events on buffers the log never created are passed
+ * on like any other, the renderer ignores them.
+*/
+stitch_buffer &log_stitcher::buffer(unsigned int id)
+{
+	auto b = buffers.find(id);
+	
+	if(b == buffers.end())
+	{
+		b = buffers.insert(std::make_pair(id, stitch_buffer(next_id++))).first;
+	}
+	
+	return b->second;
+}
+
+/* Check if an event is on a carried background buffer. */
+bool log_stitcher::carried(const audio_event &event)
+{
+	unsigned int id;
+	
+	switch(event.op)
+	{
+		case AUDIO_OP_INIT:  id = event.e.init.buf_id;  break;
+		case AUDIO_OP_FREE:  id = event.e.free.buf_id;  break;
+		case AUDIO_OP_LOAD:  id = event.e.load.buf_id;  break;
+		case AUDIO_OP_START: id = event.e.start.buf_id; break;
+		case AUDIO_OP_STOP:  id = event.e.stop.buf_id;  break;
+		case AUDIO_OP_JMP:   id = event.e.jmp.buf_id;   break;
+		case AUDIO_OP_FREQ:  id = event.e.freq.buf_id;  break;
+		case AUDIO_OP_GAIN:  id = event.e.gain.buf_id;  break;
+		
+		default:
+			return false;
+	}
+	
+	auto b = buffers.find(id);
+	
+	return b != buffers.end() && b->second.carried;
+}
+
+void log_stitcher::advance(unsigned int to_frame)
+{
+	for(; frame < to_frame; ++frame)
+	{
+		for(auto b = buffers.begin(); b != buffers.end(); ++b)
+		{
+			b->second.advance(frame_rate);
+		}
+	}
+}
+
+bool log_stitcher::write(audio_event event, unsigned int frame, const std::vector<unsigned char> &data)
+{
+	event.frame = frame;
+	
+	switch(event.op)
+	{
+		case AUDIO_OP_INIT:  event.e.init.buf_id  = buffer(event.e.init.buf_id).id;  break;
+		case AUDIO_OP_LOAD:  event.e.load.buf_id  = buffer(event.e.load.buf_id).id;  break;
+		case AUDIO_OP_START: event.e.start.buf_id = buffer(event.e.start.buf_id).id; break;
+		case AUDIO_OP_STOP:  event.e.stop.buf_id  = buffer(event.e.stop.buf_id).id;  break;
+		case AUDIO_OP_JMP:   event.e.jmp.buf_id   = buffer(event.e.jmp.buf_id).id;   break;
+		case AUDIO_OP_FREQ:  event.e.freq.buf_id  = buffer(event.e.freq.buf_id).id;  break;
+		case AUDIO_OP_GAIN:  event.e.gain.buf_id  = buffer(event.e.gain.buf_id).id;  break;
+		
+		case AUDIO_OP_CLONE:
+			event.e.clone.src_buf_id = buffer(event.e.clone.src_buf_id).id;
+			event.e.clone.new_buf_id = buffer(event.e.clone.new_buf_id).id;
+			break;
+		
+		case AUDIO_OP_FREE:
+		{
+			unsigned int id = event.e.free.buf_id;
+			
+			event.e.free.buf_id = buffer(id).id;
+			music.erase(std::remove(music.begin(), music.end(), event.e.free.buf_id), music.end());
+			
+			buffers.erase(id);
+			
+			break;
+		}
+	}
+	
+	return fwrite(&event, sizeof(event), 1, out) == 1
+		&& (data.empty() || fwrite(&(data[0]), data.size(), 1, out) == 1);
+}
+
+bool log_stitcher::add_segment(FILE *in, const capture_segment &segment, std::string &error)
+{
+	buffers.clear();
+	frame = 0;
+	
+	unsigned int end_frame = segment.frames ? segment.lead_in + segment.frames : 0;
+	
+	/* Match the segment's background buffers up with the ones carried
+	 * from the segments before it, in the order they were found.
+	*/
+	
+	std::vector<unsigned int> background;
+	
+	if(!find_background(in, end_frame, background))
+	{
+		error = segment.prefix + "audio.dat: " + strerror(errno);
+		return false;
+	}
+	
+	size_t carried_count = music.size();
+	
+	for(size_t i = 0; i < background.size(); ++i)
+	{
+		stitch_buffer sb(i < carried_count ? music[i] : next_id++);
+		
+		sb.background = true;
+		sb.carried    = (i < carried_count);
+		
+		if(!sb.carried)
+		{
+			music.push_back(sb.id);
+		}
+		
+		buffers.insert(std::make_pair(background[i], sb));
+	}
+	
+	bool started = false;
+	
+	audio_event event;
+	std::vector<unsigned char> data;
+	
+	while(1)
+	{
+		size_t got = fread(&event, 1, sizeof(event), in);
+		
+		if(got == sizeof(event) && event.check != EVENT_CHECK)
+		{
+			error = segment.prefix + "audio.dat: Encountered record with invalid check";
+			return false;
+		}
+		
+		bool eof = got < sizeof(event) || (end_frame && event.frame >= end_frame);
+		
+		if(!started && (eof || event.frame >= segment.lead_in))
+		{
+			/* Start the buffers which were playing at the end of
+			 * the lead in from where they had got to.
+			*/
+			
+			advance(segment.lead_in);
+			
+			for(auto b = buffers.begin(); b != buffers.end(); ++b)
+			{
+				if(!b->second.playing)
+				{
+					continue;
+				}
+				
+				audio_event start;
+				memset(&start, 0, sizeof(start));
+				
+				start.check = EVENT_CHECK;
+				
+				start.op = AUDIO_OP_JMP;
+				start.e.jmp.buf_id = b->first;
+				start.e.jmp.offset = b->second.position;
+				
+				if(!write(start, segment.first_frame, std::vector<unsigned char>()))
+				{
+					break;
+				}
+				
+				start.op = AUDIO_OP_START;
+				start.e.start.buf_id = b->first;
+				start.e.start.loop   = b->second.looping;
+				
+				if(!write(start, segment.first_frame, std::vector<unsigned char>()))
+				{
+					break;
+				}
+			}
+			
+			started = true;
+		}
+		
+		if(eof)
+		{
+			break;
+		}
+		
+		data.clear();
+		
+		if(event.op == AUDIO_OP_LOAD)
+		{
+			data.resize(event.e.load.size);
+			
+			if(!data.empty() && fread(&(data[0]), data.size(), 1, in) != 1)
+			{
+				error = segment.prefix + "audio.dat: Unexpected end of log";
+				return false;
+			}
+		}
+		
+		if(event.frame >= segment.lead_in)
+		{
+			if(!write(event, segment.first_frame + (event.frame - segment.lead_in), data))
+			{
+				break;
+			}
+			
+			continue;
+		}
+		
+		/* Events in the lead in are all moved to the first frame,
+		 * except for starting buffers which is done once the lead in
+		 * is over. Carried music buffers are already playing.
+		*/
+		
+		if(carried(event))
+		{
+			continue;
+		}
+		
+		advance(event.frame);
+		
+		switch(event.op)
+		{
+			case AUDIO_OP_INIT:
+			{
+				stitch_buffer &sb = buffer(event.e.init.buf_id);
+				
+				sb.size        = event.e.init.size;
+				sb.sample_rate = event.e.init.sample_rate;
+				sb.sample_bits = event.e.init.sample_bits;
+				sb.channels    = event.e.init.channels;
+				
+				break;
+			}
+			
+			case AUDIO_OP_CLONE:
+			{
+				stitch_buffer sb = buffer(event.e.clone.src_buf_id);
+				sb.id = next_id++;
+				
+				buffers.erase(event.e.clone.new_buf_id);
+				buffers.insert(std::make_pair(event.e.clone.new_buf_id, sb));
+				
+				break;
+			}
+			
+			case AUDIO_OP_START:
+			{
+				stitch_buffer &sb = buffer(event.e.start.buf_id);
+				
+				sb.playing = true;
+				sb.looping = event.e.start.loop;
+				
+				continue;
+			}
+			
+			case AUDIO_OP_STOP:
+				buffer(event.e.stop.buf_id).playing = false;
+				break;
+			
+			case AUDIO_OP_JMP:
+			{
+				stitch_buffer &sb = buffer(event.e.jmp.buf_id);
+				
+				if(event.e.jmp.offset < sb.size)
+				{
+					sb.position = event.e.jmp.offset;
+				}
+				
+				break;
+			}
+			
+			case AUDIO_OP_FREQ:
+				buffer(event.e.freq.buf_id).sample_rate = event.e.freq.sample_rate;
+				break;
+		}
+		
+		if(!write(event, segment.first_frame, data))
+		{
+			break;
+		}
+	}
+	
+	if(ferror(out))
+	{
+		error = std::string("Cannot write audio log: ") + strerror(errno);
+		return false;
+	}
+	
+	/* Free the segment's buffers where the next segment takes over, apart
+	 * from the background music which it carries on with.
+	*/
+	
+	std::vector<unsigned int> ending;
+	
+	for(auto b = buffers.begin(); end_frame && b != buffers.end(); ++b)
+	{
+		if(!b->second.background)
+		{
+			ending.push_back(b->first);
+		}
+	}
+	
+	for(size_t i = 0; i < ending.size(); ++i)
+	{
+		audio_event free;
+		memset(&free, 0, sizeof(free));
+		
+		free.check = EVENT_CHECK;
+		free.op    = AUDIO_OP_FREE;
+		free.e.free.buf_id = ending[i];
+		
+		if(!write(free, segment.first_frame + segment.frames, std::vector<unsigned char>()))
+		{
+			error = std::string("Cannot write audio log: ") + strerror(errno);
+			return false;
+		}
+	}
+	
+	return true;
+}
+
+/* Join the audio logs of the segments into the one the renderer reads. */
+bool stitch_audio_logs(const std::string &dir, const std::vector<capture_segment> &segments, unsigned int frame_rate, std::string &error)
+{
+	std::string out_path = dir + PATH_SEP FRAME_PREFIX "audio.dat";
+	
+	FILE *out = fopen(out_path.c_str(), "wb");
+	if(!out)
+	{
+		error = "Cannot create " + out_path + ": " + strerror(errno);
+		return false;
+	}
+	
+	log_stitcher stitcher(out, frame_rate);
+	
+	for(auto s = segments.begin(); s != segments.end(); ++s)
+	{
+		std::string in_path = dir + PATH_SEP + s->prefix + "audio.dat";
+		
+		FILE *in = fopen(in_path.c_str(), "rb");
+		if(!in)
+		{
+			error = "Cannot open " + in_path + ": " + strerror(errno);
+			
+			fclose(out);
+			return false;
+		}
+		
+		bool ok = stitcher.add_segment(in, *s, error);
+		
+		fclose(in);
+		
+		if(!ok)
+		{
+			fclose(out);
+			return false;
+		}
+		
+		remove(in_path.c_str());
+	}
+	
+	if(fclose(out) != 0)
+	{
+		error = "Cannot write " + out_path + ": " + strerror(errno);
+		return false;
+	}
+	
+	return true;
+}
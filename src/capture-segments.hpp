@@ -0,0 +1,104 @@
+/* Armageddon Recorder - Parallel capture planning and stitching
+ * Copyright (C) 2013 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef AREC_CAPTURE_SEGMENTS_HPP
+#define AREC_CAPTURE_SEGMENTS_HPP
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+/* Part of a replay captured by its own WA instance, alongside the others.
+ *
+ * Each instance writes its frames and audio log into the capture directory
+ * under its own prefix. Every instance but the first starts capturing lead_in
+ * frames early, so that the sounds which are playing when its part begins
+ * can be picked up. Those frames are thrown away when the parts are stitched
+ * back together.
+*/
+struct capture_segment
+{
+	std::string prefix;
+	
+	/* Replay times passed to WA. */
+	std::string start_time, end_time;
+	
+	/* First frame of the stitched capture taken from this segment. */
+	unsigned int first_frame;
+	
+	unsigned int lead_in;
+	
+	/* Frames kept after the lead in, zero to keep the rest. */
+	unsigned int frames;
+};
+
+/* Settings every instance capturing the replay is started with. */
+struct capture_settings
+{
+	/* Directory WA writes the frames of the replay into. */
+	std::string dir;
+	
+	std::string replay_file;
+	
+	/* Frame rate in the form the version of WA being run takes it. */
+	std::string frame_rate_arg;
+	
+	unsigned int width, height;
+};
+
+/* How to start an instance capturing one segment. */
+struct capture_instance
+{
+	/* Arguments WA is run with, after the path to WA.exe. */
+	std::vector<std::string> args;
+	
+	/* Where dsound.dll looks for the frames the instance has written and
+	 * writes its audio log, passed in the AREC_FRAME_PREFIX and
+	 * DSOUND_CAPTURE_FILE environment variables.
+	*/
+	std::string frame_prefix;
+	std::string audio_log;
+};
+
+/* Starts the process which captures a segment, WA.exe when capturing for
+ * real. Anything else which takes the same arguments and environment and
+ * writes frames and an audio log in the same way can stand in for it.
+*/
+class capture_launcher
+{
+	public:
+		virtual ~capture_launcher() {}
+		
+		/* Returns false with error set if it couldn't be started. */
+		virtual bool launch(const capture_instance &instance, std::string &error) = 0;
+};
+
+bool parse_replay_time(const std::string &time, uint64_t &ms);
+std::string format_replay_time(uint64_t ms);
+
+std::vector<capture_segment> plan_capture_segments(uint64_t start_ms, uint64_t end_ms,
+	unsigned int frame_rate, unsigned int count, unsigned int lead_in_secs);
+std::vector<capture_segment> plan_capture(const std::string &start_time, const std::string &end_time,
+	unsigned int frame_rate, unsigned int instances, unsigned int lead_in_secs, bool &split);
+
+bool launch_capture(capture_launcher &launcher, const capture_settings &settings,
+	const std::vector<capture_segment> &parts, std::string &error);
+
+bool stitch_frames(const std::string &dir, std::vector<capture_segment> &segments, std::string &error);
+bool stitch_audio_logs(const std::string &dir, const std::vector<capture_segment> &segments, unsigned int frame_rate, std::string &error);
+
+#endif /* !AREC_CAPTURE_SEGMENTS_HPP */
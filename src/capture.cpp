@@ -21,53 +21,347 @@
 #include <assert.h>
 #include <time.h>
 #include <stdio.h>
+#include <limits.h>
+#include <vector>
+#include <algorithm>
 
 #include "capture.hpp"
+#include "capture-segments.hpp"
+#include "frame-recompress.hpp"
+#include "encode.hpp"
 #include "ui.hpp"
 #include "main.hpp"
 
+/* Seconds captured before each part of a replay captured in parallel, so the
+ * sounds already playing when the part begins are in its audio log.
+*/
+#define CAPTURE_LEAD_IN 5
+
+/* Longest time in milliseconds between checks for new frames, and the time
+ * the tracker waits after each check so frames written in a burst are counted
+ * together.
+*/
+#define FRAME_POLL_INTERVAL 1000
+#define FRAME_TRACK_BATCH   250
+
+/* Milliseconds of capture the frame rate is measured over. */
+#define FRAME_RATE_WINDOW 5000
+
 static unsigned int frame_count;
 
+/* Frames written by each WA instance so far, counted by the tracker thread
+ * which keeps them up to date while WA is running.
+*/
+static std::vector<std::string> track_prefixes;
+static volatile LONG track_counts[MAXIMUM_WAIT_OBJECTS];
+
+static HANDLE tracker_thread = NULL;
+static HANDLE track_change   = INVALID_HANDLE_VALUE;
+
+/* Signalled to stop the tracker thread. */
+static HANDLE track_stop = NULL;
+
+/* Finished frames are handed to the recompressor as they are counted, up to
+ * but not including the last frame of each prefix which WA may still be
+ * writing.
+*/
+static frame_recompressor *recompressor = NULL;
+static unsigned int track_queued[MAXIMUM_WAIT_OBJECTS];
+
+static DWORD track_start, track_end;
+static unsigned int track_expected;
+
+/* Recent capture rate in hundredths of a frame per second. */
+static volatile LONG track_rate;
+
 static std::map<std::string, DWORD> original_options;
 
 static HANDLE monitor_thread = NULL;
-static HANDLE wa_process     = NULL;
-static char *wa_cmdline      = NULL;
 
-/* Wait for the WA.exe process to exit and send a WM_WAEXIT message to the
- * progress dialog with the exit code.
+static std::vector<HANDLE> wa_processes;
+static std::vector<char*> wa_cmdlines;
+
+/* Parts of the replay being captured by each WA instance, empty unless the
+ * capture is split between several of them.
+*/
+static std::vector<capture_segment> segments;
+
+/* Wait for every WA.exe process to exit and send a WM_WAEXIT message to the
+ * progress dialog with the first non-zero exit code.
 */
 static DWORD WINAPI wa_monitor(LPVOID lpParameter)
 {
-	WaitForSingleObject(wa_process, INFINITE);
+	WaitForMultipleObjects(wa_processes.size(), &(wa_processes[0]), TRUE, INFINITE);
 	
-	DWORD exit_code;
-	GetExitCodeProcess(wa_process, &exit_code);
+	DWORD exit_code = 0;
+	
+	for(size_t i = 0; i < wa_processes.size() && exit_code == 0; ++i)
+	{
+		GetExitCodeProcess(wa_processes[i], &exit_code);
+	}
 	
 	PostMessage(progress_dialog, WM_WAEXIT, (WPARAM)(exit_code), 0);
 	
 	return 0;
 }
 
+static std::string frame_path(const std::string &prefix, unsigned int frame)
+{
+	char name[32];
+	snprintf(name, sizeof(name), "%06u.png", frame);
+	
+	return config.capture_dir + "\\" + prefix + name;
+}
+
+/* Count on from the frames with a prefix which are already known to exist, so
+ * only the new ones are looked for.
+*/
+static unsigned int count_frames(const std::string &prefix, unsigned int count)
+{
+	while(1)
+	{
+		if(GetFileAttributes(frame_path(prefix, count).c_str()) != INVALID_FILE_ATTRIBUTES)
+		{
+			count++;
+		}
+		else{
+			break;
+		}
+	}
+	
+	return count;
+}
+
 /* Returns the number of frames exported by the current capture. */
 unsigned int get_frame_count()
 {
+	return (frame_count = count_frames(FRAME_PREFIX, frame_count));
+}
+
+/* Returns the number of frames the capture should come to, worked out from
+ * the start and end times when it began, or zero if it isn't known.
+*/
+unsigned int get_expected_frame_count()
+{
+	return track_expected;
+}
+
+static unsigned int update_track_counts()
+{
+	unsigned int total = 0;
+	
+	for(size_t i = 0; i < track_prefixes.size(); ++i)
+	{
+		track_counts[i] = count_frames(track_prefixes[i], track_counts[i]);
+		total += track_counts[i];
+	}
+	
+	return total;
+}
+
+/* Count the frames as WA writes them and post WM_CAPTURE_PROGRESS to the
+ * progress dialog whenever there are more.
+ *
+ * The capture directory is watched for new files, so nothing is looked for
+ * while WA is busy between frames. If it can't be watched, it is polled.
+*/
+static DWORD WINAPI frame_tracker(LPVOID lpParameter)
+{
+	DWORD rate_tick = track_start;
+	unsigned int rate_frames = 0, last_total = 0;
+	
 	while(1)
 	{
-		char path[1024];
+		if(track_change != INVALID_HANDLE_VALUE)
+		{
+			HANDLE events[] = { track_stop, track_change };
+			
+			if(WaitForMultipleObjects(2, events, FALSE, FRAME_POLL_INTERVAL) == WAIT_OBJECT_0)
+			{
+				break;
+			}
+			
+			FindNextChangeNotification(track_change);
+		}
+		else if(WaitForSingleObject(track_stop, FRAME_POLL_INTERVAL) == WAIT_OBJECT_0)
+		{
+			break;
+		}
 		
-		snprintf(path, sizeof(path), "%s\\" FRAME_PREFIX "%06u.png", config.capture_dir.c_str(), frame_count);
+		unsigned int total = update_track_counts();
 		
-		if(GetFileAttributes(path) != INVALID_FILE_ATTRIBUTES)
+		for(size_t i = 0; recompressor && i < track_prefixes.size(); ++i)
 		{
-			frame_count++;
+			while(track_queued[i] + 1 < (unsigned int)(track_counts[i]))
+			{
+				recompressor->queue(frame_path(track_prefixes[i], track_queued[i]++));
+			}
 		}
-		else{
+		
+		DWORD now = GetTickCount();
+		
+		if(now - rate_tick >= FRAME_RATE_WINDOW)
+		{
+			track_rate = (LONG)((uint64_t)(total - rate_frames) * 100000 / (now - rate_tick));
+			
+			rate_tick   = now;
+			rate_frames = total;
+		}
+		
+		if(total != last_total)
+		{
+			PostMessage(progress_dialog, WM_CAPTURE_PROGRESS, 0, 0);
+			last_total = total;
+		}
+		
+		if(WaitForSingleObject(track_stop, FRAME_TRACK_BATCH) == WAIT_OBJECT_0)
+		{
 			break;
 		}
 	}
 	
-	return frame_count;
+	return 0;
+}
+
+static void stop_frame_tracker()
+{
+	if(tracker_thread)
+	{
+		SetEvent(track_stop);
+		WaitForSingleObject(tracker_thread, INFINITE);
+		
+		CloseHandle(tracker_thread);
+		tracker_thread = NULL;
+		
+		track_end = GetTickCount();
+		
+		/* Pick up any frames written since the last check. */
+		
+		unsigned int total = update_track_counts();
+		
+		if(track_prefixes.size() == 1)
+		{
+			frame_count = total;
+		}
+	}
+	
+	if(track_change != INVALID_HANDLE_VALUE)
+	{
+		FindCloseChangeNotification(track_change);
+		track_change = INVALID_HANDLE_VALUE;
+	}
+	
+	/* Any frames still waiting to be recompressed are left as WA wrote
+	 * them rather than holding up the encoder.
+	*/
+	
+	if(recompressor)
+	{
+		char saved[32];
+		snprintf(saved, sizeof(saved), "%.1f", recompressor->saved() / (1024.0 * 1024.0));
+		
+		log_push("Recompressed " + to_string(recompressor->replaced()) + " frames, saving " + saved + " MB\r\n");
+		
+		if(recompressor->failed())
+		{
+			log_push(to_string(recompressor->failed()) + " frames could not be recompressed: " + recompressor->error() + "\r\n");
+		}
+		
+		delete recompressor;
+		recompressor = NULL;
+	}
+}
+
+static void start_frame_tracker(const std::vector<capture_segment> &parts)
+{
+	track_prefixes.clear();
+	track_expected = 0;
+	
+	for(size_t i = 0; i < parts.size(); ++i)
+	{
+		track_prefixes.push_back(parts[i].prefix);
+		track_counts[i] = 0;
+		track_queued[i] = 0;
+		
+		/* The length is only known if the part has an end time. */
+		
+		uint64_t start_ms = 0, end_ms;
+		
+		if(track_expected != UINT_MAX
+			&& parse_replay_time(parts[i].end_time, end_ms)
+			&& (parts[i].start_time.empty() || parse_replay_time(parts[i].start_time, start_ms))
+			&& end_ms > start_ms)
+		{
+			track_expected += (end_ms - start_ms) * config.frame_rate / 1000;
+		}
+		else{
+			track_expected = UINT_MAX;
+		}
+	}
+	
+	if(track_expected == UINT_MAX)
+	{
+		track_expected = 0;
+	}
+	
+	track_start = track_end = GetTickCount();
+	track_rate  = 0;
+	
+	track_change = FindFirstChangeNotification(config.capture_dir.c_str(), FALSE, FILE_NOTIFY_CHANGE_FILE_NAME);
+	
+	if(!track_stop)
+	{
+		assert((track_stop = CreateEvent(NULL, TRUE, FALSE, NULL)));
+	}
+	
+	ResetEvent(track_stop);
+	
+	/* Frames are only converted to QOI when our own decoder is the only
+	 * thing which will read them. ffmpeg reads the PNGs itself otherwise,
+	 * and frames encoded while capturing are emptied as soon as they have
+	 * been read.
+	*/
+	
+	if(config.recompress_threads)
+	{
+		if(ffmpeg_decoding_frames())
+		{
+			recompressor = new frame_recompressor(config.recompress_threads);
+		}
+		else{
+			log_push("Frames are only recompressed when they are decoded by decode threads\r\n");
+		}
+	}
+	
+	assert((tracker_thread = CreateThread(NULL, 0, &frame_tracker, NULL, 0, NULL)));
+}
+
+/* Progress of the capture so far, or of the whole capture once WA has exited.
+ * The rate is the recent rate while WA is running and the average after.
+*/
+capture_stats get_capture_stats()
+{
+	capture_stats stats;
+	
+	stats.frames = 0;
+	
+	for(size_t i = 0; i < track_prefixes.size(); ++i)
+	{
+		stats.frames += track_counts[i];
+	}
+	
+	stats.expected = std::max(track_expected, stats.frames);
+	stats.elapsed  = ((tracker_thread ? GetTickCount() : track_end) - track_start) / 1000.0;
+	
+	if(tracker_thread)
+	{
+		stats.rate = track_rate / 100.0;
+	}
+	else{
+		stats.rate = stats.elapsed > 0 ? stats.frames / stats.elapsed : 0;
+	}
+	
+	return stats;
 }
 
 static void set_option(const char *name, DWORD value, DWORD def_value = 0)
@@ -121,6 +415,56 @@ static bool dll_is_dsound_wrapper(const std::string &path)
 	return ret;
 }
 
+/* Starts WA.exe with the dsound.dll wrapper installed. */
+class wa_launcher: public capture_launcher
+{
+	public:
+		virtual bool launch(const capture_instance &instance, std::string &error);
+};
+
+bool wa_launcher::launch(const capture_instance &instance, std::string &error)
+{
+	/* Build the command line and copy it to a persistent buffer. The
+	 * /getvideo switch goes first and unquoted, the rest are quoted.
+	*/
+	
+	std::string cmdline = "\"" + wa_exe_path + "\"";
+	
+	for(size_t i = 0; i < instance.args.size(); ++i)
+	{
+		cmdline += i ? " \"" + instance.args[i] + "\"" : " " + instance.args[i];
+	}
+	
+	char *wa_cmdline = new char[cmdline.length() + 1];
+	strcpy(wa_cmdline, cmdline.c_str());
+	
+	wa_cmdlines.push_back(wa_cmdline);
+	
+	/* Environment variables used by dsound.dll, each instance inherits
+	 * them as they are when it is started.
+	*/
+	
+	SetEnvironmentVariable("AREC_FRAME_PREFIX",   instance.frame_prefix.c_str());
+	SetEnvironmentVariable("DSOUND_CAPTURE_FILE", instance.audio_log.c_str());
+	
+	STARTUPINFO sinfo;
+	memset(&sinfo, 0, sizeof(sinfo));
+	sinfo.cb = sizeof(sinfo);
+	
+	PROCESS_INFORMATION pinfo;
+	
+	if(!CreateProcess(NULL, wa_cmdline, NULL, NULL, FALSE, 0, NULL, NULL, &sinfo, &pinfo))
+	{
+		error = std::string("Could not execute WA.exe: ") + w32_error(GetLastError());
+		return false;
+	}
+	
+	wa_processes.push_back(pinfo.hProcess);
+	CloseHandle(pinfo.hThread);
+	
+	return true;
+}
+
 bool start_capture()
 {
 	log_push("Preparing to capture " + config.replay_name + "...\r\n");
@@ -161,8 +505,6 @@ bool start_capture()
 	set_option("LargerFonts",      config.wa_bigger_fonts,        0);
 	set_option("InfoTransparency", config.wa_transparent_labels,  0);
 	
-	/* Build the command line and copy it to a persistent buffer. */
-	
 	std::string frame_rate_arg;
 	if(wa_version >= make_version(3, 7, 2, 40))
 	{
@@ -172,48 +514,54 @@ bool start_capture()
 		frame_rate_arg = to_string((double)(50) / config.frame_rate);
 	}
 	
-	std::string cmdline = "\"" + wa_exe_path + "\" /getvideo"
-		" \"" + config.replay_file + "\""
-		" \"" + frame_rate_arg + "\""
-		" \"" + config.start_time + "\" \"" + config.end_time + "\""
-		" \"" + to_string(config.width) + "\" \"" + to_string(config.height) + "\""
-		" \"" + FRAME_PREFIX + "\"";
+	/* WA always writes the frames into the directory named after the
+	 * replay, so each instance capturing part of it is told to use its
+	 * own prefix instead.
+	*/
 	
-	wa_cmdline = new char[cmdline.length() + 1];
-	strcpy(wa_cmdline, cmdline.c_str());
+	bool split;
 	
-	/* Environment variables used by dsound.dll */
+	std::vector<capture_segment> parts = plan_capture(config.start_time, config.end_time, config.frame_rate,
+		std::min(config.capture_instances, (unsigned int)(MAXIMUM_WAIT_OBJECTS)), CAPTURE_LEAD_IN, split);
 	
-	SetEnvironmentVariable("AREC_FRAME_PREFIX",   std::string(config.capture_dir + "\\" FRAME_PREFIX).c_str());
-	SetEnvironmentVariable("DSOUND_CAPTURE_FILE", std::string(config.capture_dir + "\\" FRAME_PREFIX "audio.dat").c_str());
+	if(config.capture_instances > 1 && !split)
+	{
+		log_push("No usable end time, capturing with a single WA instance\r\n");
+	}
+	
+	segments = split ? parts : std::vector<capture_segment>();
 	
 	if(config.load_wormkit_dlls)
 	{
 		SetEnvironmentVariable("AREC_LOAD_WORMKIT", "1");
 	}
 	
-	STARTUPINFO sinfo;
-	memset(&sinfo, 0, sizeof(sinfo));
-	sinfo.cb = sizeof(sinfo);
+	log_push(parts.size() > 1 ? "Starting " + to_string(parts.size()) + " WA instances...\r\n" : "Starting WA...\r\n");
 	
-	PROCESS_INFORMATION pinfo;
+	capture_settings settings;
 	
-	log_push("Starting WA...\r\n");
+	settings.dir            = config.capture_dir;
+	settings.replay_file    = config.replay_file;
+	settings.frame_rate_arg = frame_rate_arg;
+	settings.width          = config.width;
+	settings.height         = config.height;
 	
-	if(!CreateProcess(NULL, wa_cmdline, NULL, NULL, FALSE, 0, NULL, NULL, &sinfo, &pinfo))
+	wa_launcher launcher;
+	std::string error;
+	
+	if(!launch_capture(launcher, settings, parts, error))
 	{
-		log_push(std::string("Could not execute WA.exe: ") + w32_error(GetLastError()) + "\r\n");
+		log_push(error + "\r\n");
 		
 		finish_capture();
 		
 		return false;
 	}
 	
-	wa_process = pinfo.hProcess;
-	CloseHandle(pinfo.hThread);
-	
 	assert((monitor_thread = CreateThread(NULL, 0, &wa_monitor, NULL, 0, NULL)));
 	
+	start_frame_tracker(parts);
+	
 	return true;
 }
 
@@ -234,21 +582,54 @@ void finish_capture()
 		monitor_thread = NULL;
 	}
 	
-	if(wa_process)
+	for(size_t i = 0; i < wa_processes.size(); ++i)
 	{
-		TerminateProcess(wa_process, 1);
-		
-		CloseHandle(wa_process);
-		wa_process = NULL;
+		TerminateProcess(wa_processes[i], 1);
+		CloseHandle(wa_processes[i]);
 	}
 	
-	delete wa_cmdline;
-	wa_cmdline = NULL;
+	stop_frame_tracker();
+	
+	wa_processes.clear();
+	
+	for(size_t i = 0; i < wa_cmdlines.size(); ++i)
+	{
+		delete wa_cmdlines[i];
+	}
+	
+	wa_cmdlines.clear();
 	
 	restore_options();
 	restore_wa_install();
 }
 
+/* Join the frames and audio logs written by each WA instance back into a
+ * single capture. Does nothing unless the capture was split between several.
+*/
+bool stitch_capture()
+{
+	if(segments.empty())
+	{
+		return true;
+	}
+	
+	log_push("Joining " + to_string(segments.size()) + " capture segments...\r\n");
+	
+	std::string error;
+	
+	if(!stitch_frames(config.capture_dir, segments, error) || !stitch_audio_logs(config.capture_dir, segments, config.frame_rate, error))
+	{
+		log_push(error + "\r\n");
+		return false;
+	}
+	
+	/* Every segment but the last was checked to be complete. */
+	
+	frame_count = count_frames(FRAME_PREFIX, segments.back().first_frame);
+	
+	return true;
+}
+
 void delete_capture()
 {
 	WIN32_FIND_DATA file;
@@ -22,9 +22,24 @@
 #define FRAME_PREFIX "arec_"
 
 unsigned int get_frame_count();
+unsigned int get_expected_frame_count();
+
+struct capture_stats
+{
+	unsigned int frames;
+	
+	/* Frames the whole capture should have, zero if not known. */
+	unsigned int expected;
+	
+	double rate;	/* Frames per second */
+	double elapsed;	/* Seconds since WA was started */
+};
+
+capture_stats get_capture_stats();
 
 bool start_capture();
 void finish_capture();
+bool stitch_capture();
 
 void delete_capture();
 
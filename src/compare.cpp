@@ -0,0 +1,311 @@
+/* Armageddon Recorder - Rendered audio comparison tool
+ * Copyright (C) 2013 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <math.h>
+#include <stdint.h>
+#include <vector>
+#include <algorithm>
+#include <sndfile.h>
+
+/* Number of frames read from each file at a time. */
+#define READ_BLOCK_FRAMES 65536
+
+/* Exit statuses, the same as cmp(1). */
+#define CMP_SAME    0
+#define CMP_DIFFER  1
+#define CMP_TROUBLE 2
+
+/* Errors are measured in steps of a 16-bit sample, whatever the format of
+ * the files being compared.
+*/
+#define LSB_SCALE 32768.0
+
+/* 64-bit FNV-1a, used to fingerprint the samples of a file. */
+struct fnv1a
+{
+	uint64_t hash;
+	
+	fnv1a(): hash(0xCBF29CE484222325ULL) {}
+	
+	void add(const void *data, size_t size)
+	{
+		for(size_t i = 0; i < size; ++i)
+		{
+			hash ^= ((const unsigned char*)(data))[i];
+			hash *= 0x100000001B3ULL;
+		}
+	}
+};
+
+/* Add samples to a hash. Every sample format we write converts to a double
+ * exactly, so the hash only changes if a sample does. The bytes are hashed
+ * in little endian order whatever the host.
+*/
+static void hash_samples(fnv1a &hash, const double *samples, size_t count)
+{
+	for(size_t i = 0; i < count; ++i)
+	{
+		uint64_t s;
+		memcpy(&s, &(samples[i]), sizeof(s));
+		
+		unsigned char bytes[8];
+		
+		for(int b = 0; b < 8; ++b)
+		{
+			bytes[b] = s >> (b * 8);
+		}
+		
+		hash.add(bytes, sizeof(bytes));
+	}
+}
+
+static SNDFILE *open_wav(const char *path, SF_INFO &info)
+{
+	memset(&info, 0, sizeof(info));
+	
+	SNDFILE *wav = sf_open(path, SFM_READ, &info);
+	if(!wav)
+	{
+		fprintf(stderr, "Could not open %s: %s\n", path, sf_strerror(NULL));
+	}
+	
+	return wav;
+}
+
+/* Print the hash of the samples in each file, in the style of md5sum. */
+static int hash_files(int argc, char **argv)
+{
+	int status = CMP_SAME;
+	
+	for(int i = 0; i < argc; ++i)
+	{
+		SF_INFO info;
+		
+		SNDFILE *wav = open_wav(argv[i], info);
+		if(!wav)
+		{
+			status = CMP_TROUBLE;
+			continue;
+		}
+		
+		fnv1a hash;
+		std::vector<double> samples(READ_BLOCK_FRAMES * info.channels);
+		
+		sf_count_t frames;
+		while((frames = sf_readf_double(wav, &(samples[0]), READ_BLOCK_FRAMES)) > 0)
+		{
+			hash_samples(hash, &(samples[0]), frames * info.channels);
+		}
+		
+		sf_close(wav);
+		
+		printf("%016llx  %s\n", (unsigned long long)(hash.hash), argv[i]);
+	}
+	
+	return status;
+}
+
+static void usage(const char *argv0)
+{
+	fprintf(stderr, "Usage: %s [options] <reference WAV> <test WAV>\n", argv0);
+	fprintf(stderr, "       %s -H <WAV> [<WAV> ...]\n", argv0);
+	fprintf(stderr, "\n");
+	fprintf(stderr, "  -e <steps>    Largest error allowed in any sample, in 16-bit steps\n");
+	fprintf(stderr, "                (default 0, the files must match exactly)\n");
+	fprintf(stderr, "  -s <dB>       Smallest signal to error ratio allowed\n");
+	fprintf(stderr, "  -q            Only print anything when the files differ\n");
+	fprintf(stderr, "  -H            Print a hash of the samples in each file\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "Exits with status 0 if the files match within the tolerance, 1 if\n");
+	fprintf(stderr, "they don't and 2 if there was an error.\n");
+}
+
+static double get_opt_double(char opt, const char *arg)
+{
+	char *end;
+	
+	errno = 0;
+	double value = strtod(arg, &end);
+	
+	if(*arg == '\0' || *end != '\0' || errno != 0 || value < 0)
+	{
+		fprintf(stderr, "Invalid value for -%c: %s\n", opt, arg);
+		exit(CMP_TROUBLE);
+	}
+	
+	return value;
+}
+
+int main(int argc, char **argv)
+{
+	double max_error = 0;
+	double min_snr   = -1;
+	
+	bool quiet = false;
+	bool hash  = false;
+	
+	int opt;
+	while((opt = getopt(argc, argv, "e:s:qH")) != -1)
+	{
+		switch(opt)
+		{
+			case 'e':
+				max_error = get_opt_double(opt, optarg);
+				break;
+			
+			case 's':
+				min_snr = get_opt_double(opt, optarg);
+				break;
+			
+			case 'q':
+				quiet = true;
+				break;
+			
+			case 'H':
+				hash = true;
+				break;
+			
+			default:
+				usage(argv[0]);
+				return CMP_TROUBLE;
+		}
+	}
+	
+	if(hash)
+	{
+		if(optind == argc)
+		{
+			usage(argv[0]);
+			return CMP_TROUBLE;
+		}
+		
+		return hash_files(argc - optind, argv + optind);
+	}
+	
+	if(argc - optind != 2)
+	{
+		usage(argv[0]);
+		return CMP_TROUBLE;
+	}
+	
+	const char *ref_path  = argv[optind];
+	const char *test_path = argv[optind + 1];
+	
+	SF_INFO ref_info, test_info;
+	
+	SNDFILE *ref  = open_wav(ref_path, ref_info);
+	SNDFILE *test = open_wav(test_path, test_info);
+	
+	if(!ref || !test)
+	{
+		return CMP_TROUBLE;
+	}
+	
+	if(ref_info.samplerate != test_info.samplerate || ref_info.channels != test_info.channels)
+	{
+		printf("Formats differ: %d Hz, %d channels vs %d Hz, %d channels\n",
+			ref_info.samplerate, ref_info.channels,
+			test_info.samplerate, test_info.channels);
+		
+		return CMP_DIFFER;
+	}
+	
+	unsigned int channels = ref_info.channels;
+	
+	std::vector<double> ref_samples(READ_BLOCK_FRAMES * channels);
+	std::vector<double> test_samples(READ_BLOCK_FRAMES * channels);
+	
+	uint64_t samples   = 0;
+	uint64_t differing = 0;
+	
+	double worst = 0;
+	uint64_t worst_at = 0;
+	
+	double signal = 0, noise = 0;
+	
+	while(1)
+	{
+		sf_count_t ref_frames  = sf_readf_double(ref, &(ref_samples[0]), READ_BLOCK_FRAMES);
+		sf_count_t test_frames = sf_readf_double(test, &(test_samples[0]), READ_BLOCK_FRAMES);
+		
+		size_t n = std::min(ref_frames, test_frames) * channels;
+		
+		for(size_t i = 0; i < n; ++i, ++samples)
+		{
+			double r = ref_samples[i] * LSB_SCALE;
+			double e = fabs(test_samples[i] * LSB_SCALE - r);
+			
+			if(e != 0)
+			{
+				++differing;
+			}
+			
+			if(e > worst)
+			{
+				worst    = e;
+				worst_at = samples;
+			}
+			
+			signal += r * r;
+			noise  += e * e;
+		}
+		
+		if(ref_frames != test_frames)
+		{
+			sf_close(ref);
+			sf_close(test);
+			
+			printf("Lengths differ after %llu frames\n", (unsigned long long)(samples / channels));
+			return CMP_DIFFER;
+		}
+		
+		if(ref_frames <= 0)
+		{
+			break;
+		}
+	}
+	
+	sf_close(ref);
+	sf_close(test);
+	
+	double snr = noise > 0 ? 10 * log10(signal / noise) : INFINITY;
+	
+	bool ok = worst <= max_error && (min_snr < 0 || snr >= min_snr);
+	
+	if(!quiet || !ok)
+	{
+		printf("Samples:     %llu\n", (unsigned long long)(samples));
+		printf("Differing:   %llu\n", (unsigned long long)(differing));
+		
+		if(differing)
+		{
+			printf("Max error:   %.3f at frame %llu, channel %u\n", worst,
+				(unsigned long long)(worst_at / channels), (unsigned int)(worst_at % channels));
+			printf("RMS error:   %.3f\n", sqrt(noise / samples));
+			printf("SNR:         %.1f dB\n", snr);
+		}
+		
+		printf("%s\n", ok ? "PASS" : "FAIL");
+	}
+	
+	return ok ? CMP_SAME : CMP_DIFFER;
+}
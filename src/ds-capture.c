@@ -18,6 +18,7 @@
 #include <windows.h>
 #include <dsound.h>
 #include <stdio.h>
+#include <math.h>
 
 #include "ds-capture.h"
 
@@ -86,6 +87,21 @@ typedef HRESULT(__stdcall *DirectSoundCreate_t)(LPCGUID, IDirectSound**, LPUNKNO
 static HMODULE sys_dsound = NULL;
 static FILE *capture_fh   = NULL;
 
+/* Linear gain for each volume level in millibels from DSBVOLUME_MIN to
+ * DSBVOLUME_MAX, filled in by init_gain_table().
+*/
+static double gain_table[DSBVOLUME_MAX - DSBVOLUME_MIN + 1];
+
+static void init_gain_table(void)
+{
+	int mb;
+	
+	for(mb = DSBVOLUME_MIN; mb <= DSBVOLUME_MAX; ++mb)
+	{
+		gain_table[mb - DSBVOLUME_MIN] = pow(10.0, (double)(mb) / 2000);
+	}
+}
+
 /* Get number of frames exported so far */
 unsigned int get_frames(void)
 {
@@ -525,6 +541,21 @@ static HRESULT __stdcall IDirectSoundBuffer_hook_SetVolume(IDirectSoundBuffer_ho
 {
 	if(capture_fh && self->buf_id)
 	{
+		/* Convert the volume from millibels of attenuation to a linear
+		 * gain, clamping to the range DirectSound accepts.
+		*/
+		
+		LONG mb = lVolume;
+		
+		if(mb < DSBVOLUME_MIN)
+		{
+			mb = DSBVOLUME_MIN;
+		}
+		else if(mb > DSBVOLUME_MAX)
+		{
+			mb = DSBVOLUME_MAX;
+		}
+		
 		struct audio_event event;
 		
 		event.check = 0x12345678;
@@ -532,7 +563,7 @@ static HRESULT __stdcall IDirectSoundBuffer_hook_SetVolume(IDirectSoundBuffer_ho
 		event.op    = AUDIO_OP_GAIN;
 		
 		event.e.gain.buf_id = self->buf_id;
-		event.e.gain.gain   = (double)(lVolume + 10000) / 10000;
+		event.e.gain.gain   = gain_table[mb - DSBVOLUME_MIN];
 		
 		fwrite(&event, sizeof(event), 1, capture_fh);
 	}
@@ -599,6 +630,8 @@ BOOL WINAPI DllMain(HINSTANCE me, DWORD why, LPVOID res)
 			abort();
 		}
 		
+		init_gain_table();
+		
 		char *capture_file = getenv("DSOUND_CAPTURE_FILE");
 		if(capture_file)
 		{
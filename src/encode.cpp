@@ -17,11 +17,27 @@
 
 #include <windows.h>
 #include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <algorithm>
 
 #include "encode.hpp"
 #include "capture.hpp"
+#include "frame-decode.hpp"
+#include "static-frames.hpp"
 #include "ui.hpp"
 
+/* Size of the buffer in the audio pipe to ffmpeg. */
+#define AUDIO_PIPE_BUFFER (256 * 1024)
+
+/* Size of the buffer in the frames pipe to ffmpeg and milliseconds to wait
+ * between checks for WA finishing the next frame.
+*/
+#define FRAMES_PIPE_BUFFER (1024 * 1024)
+#define FRAME_POLL_INTERVAL 20
+
 const ffmpeg_format video_formats[] = {
 	{ "None", NULL, NULL },
 	
@@ -119,57 +135,383 @@ static void append_codec(std::string &cmdline, const char *ct, const ffmpeg_form
 	if(format.extra)
 	{
 		cmdline.append(" ");
-		cmdline.append(video_formats[config.video_format].extra);
+		cmdline.append(format.extra);
+	}
+}
+
+/* ffmpeg's name for the raw PCM format of piped audio. */
+static const char *raw_audio_format(int format)
+{
+	switch(format)
+	{
+		case SF_FORMAT_PCM_24:
+			return "s24le";
+		
+		case SF_FORMAT_FLOAT:
+			return "f32le";
+		
+		default:
+			return "s16le";
+	}
+}
+
+std::string ffmpeg_audio_pipe_name()
+{
+	return "\\\\.\\pipe\\" FRAME_PREFIX "audio_" + to_string(GetCurrentProcessId());
+}
+
+/* A video being encoded from the frames. The first one is the video chosen in
+ * the main window, any others are encoded alongside it from the same frames.
+*/
+struct video_output
+{
+	std::string file;
+	const ffmpeg_format *format;
+	
+	/* Size to scale the frames to, zero to leave them at the capture size. */
+	unsigned int width, height;
+};
+
+/* Name of an extra output, beside the main video and in the first container
+ * which can hold its formats.
+*/
+static std::string extra_output_path(unsigned int video_format)
+{
+	std::string path = config.video_file;
+	
+	size_t dot = path.find_last_of('.');
+	if(dot != std::string::npos && path.find_first_of("\\/", dot) == std::string::npos)
+	{
+		path.erase(dot);
+	}
+	
+	std::vector<int> containers = get_valid_containers(video_format, config.audio_format);
+	
+	return path + "-2." + (containers.empty() ? "mkv" : container_formats[containers[0]].ext);
+}
+
+static std::vector<video_output> video_outputs()
+{
+	std::vector<video_output> outputs;
+	
+	video_output main = { config.video_file, &(video_formats[config.video_format]), 0, 0 };
+	outputs.push_back(main);
+	
+	if(config.extra_video_format > 0)
+	{
+		video_output extra = {
+			extra_output_path(config.extra_video_format),
+			&(video_formats[config.extra_video_format]),
+			config.extra_width, config.extra_height
+		};
+		
+		outputs.push_back(extra);
+	}
+	
+	return outputs;
+}
+
+/* Whether the frames have to go through a filter graph to be shared between
+ * the outputs or scaled, rather than straight into the one encoder.
+*/
+static bool split_frames(const std::vector<video_output> &outputs)
+{
+	return outputs.size() > 1 || outputs[0].width;
+}
+
+/* Filter graph splitting the frames from the first input between the outputs
+ * so they are only read once. The video of each output is labelled [vN].
+*/
+static std::string split_filter(const std::vector<video_output> &outputs)
+{
+	std::string graph = "[0:v]split=" + to_string(outputs.size());
+	
+	for(size_t i = 0; i < outputs.size(); ++i)
+	{
+		graph.append("[s" + to_string(i) + "]");
+	}
+	
+	for(size_t i = 0; i < outputs.size(); ++i)
+	{
+		graph.append(";[s" + to_string(i) + "]");
+		
+		if(outputs[i].width)
+		{
+			graph.append("scale=" + to_string(outputs[i].width) + ":" + to_string(outputs[i].height));
+		}
+		else{
+			graph.append("null");
+		}
+		
+		graph.append("[v" + to_string(i) + "]");
+	}
+	
+	return " -filter_complex \"" + graph + "\"";
+}
+
+/* Intermediate file each output's video is encoded to while capturing, before
+ * the audio is added to it. Matroska can hold any of the video formats.
+*/
+static std::string video_tmp_path(unsigned int output)
+{
+	char name[64];
+	snprintf(name, sizeof(name), FRAME_PREFIX "video_%u.mkv", output);
+	
+	return config.capture_dir + "\\" + name;
+}
+
+static std::string segment_path(unsigned int segment, unsigned int output)
+{
+	char name[64];
+	snprintf(name, sizeof(name), FRAME_PREFIX "segment_%03u_%u.mkv", segment, output);
+	
+	return name;
+}
+
+/* List of the segments of an output for the concat demuxer. The segments are
+ * named relative to it, which ffmpeg always considers safe.
+*/
+static std::string segment_list_path(unsigned int output)
+{
+	char name[64];
+	snprintf(name, sizeof(name), FRAME_PREFIX "segments_%u.txt", output);
+	
+	return config.capture_dir + "\\" + name;
+}
+
+/* Concat demuxer list of the frames left once the static ones are collapsed. */
+static std::string static_list_path()
+{
+	return config.capture_dir + "\\" + FRAME_PREFIX + "frames.txt";
+}
+
+static std::string frames_pipe_name()
+{
+	return "\\\\.\\pipe\\" FRAME_PREFIX "frames_" + to_string(GetCurrentProcessId());
+}
+
+/* Input options for the frames when they are passed to ffmpeg through the
+ * frames pipe, either decoded by us or as the PNG files.
+*/
+static std::string frames_pipe_input()
+{
+	std::string input;
+	
+	if(config.decode_threads)
+	{
+		input = " -f rawvideo -pix_fmt bgr24 -s " + to_string(config.width) + "x" + to_string(config.height);
+	}
+	else{
+		input = " -f image2pipe -vcodec png";
 	}
+	
+	return input + " -r " + to_string(config.frame_rate) + " -i \"" + frames_pipe_name() + "\"";
 }
 
 std::string ffmpeg_cmdline()
 {
 	std::string frames_in = escape_filename(config.capture_dir + "\\" + FRAME_PREFIX + "%06d.png");
 	std::string audio_in  = escape_filename(config.capture_dir + "\\" + FRAME_PREFIX + "audio.wav");
-	std::string video_out = escape_filename(config.video_file);
 	
-	std::string cmdline = "ffmpeg.exe -threads " + to_string(config.max_enc_threads) + " -y -r " + to_string(config.frame_rate) + " -i \"" + frames_in + "\"";
+	std::vector<video_output> outputs = video_outputs();
+	
+	std::string cmdline = "ffmpeg.exe -threads " + to_string(config.max_enc_threads) + " -y";
+	
+	/* Whether each output's video has already been encoded and is only
+	 * copied into it along with the audio.
+	*/
+	bool encoded = config.encode_during_capture || ffmpeg_segmented();
+	
+	for(unsigned int i = 0; i < (encoded ? outputs.size() : 1); ++i)
+	{
+		if(config.encode_during_capture)
+		{
+			cmdline.append(std::string(" -i \"") + escape_filename(video_tmp_path(i)) + "\"");
+		}
+		else if(ffmpeg_segmented())
+		{
+			/* The segments only need joining. */
+			
+			cmdline.append(std::string(" -f concat -i \"") + escape_filename(segment_list_path(i)) + "\"");
+		}
+		else if(ffmpeg_collapsing())
+		{
+			/* Each frame is shown for as long as the run of
+			 * identical frames it replaced.
+			*/
+			
+			cmdline.append(std::string(" -f concat -i \"") + escape_filename(static_list_path()) + "\"");
+		}
+		else if(config.decode_threads)
+		{
+			cmdline.append(frames_pipe_input());
+		}
+		else{
+			cmdline.append(" -r " + to_string(config.frame_rate) + " -i \"" + frames_in + "\"");
+		}
+	}
+	
+	if(config.pipe_audio)
+	{
+		/* Raw PCM has no header, so ffmpeg has to be told what it
+		 * will be getting.
+		*/
+		
+		cmdline.append(std::string(" -f ") + raw_audio_format(wav_formats[config.wav_format].format)
+			+ " -ar " + to_string(config.audio_rate)
+			+ " -ac " + to_string(CHANNELS)
+			+ " -i \"" + ffmpeg_audio_pipe_name() + "\"");
+	}
+	else{
+		cmdline.append(std::string(" -i \"") + audio_in + "\"");
+	}
+	
+	bool split = !encoded && split_frames(outputs);
+	
+	if(split)
+	{
+		cmdline.append(split_filter(outputs));
+	}
 	
-	cmdline.append(std::string(" -i \"") + audio_in + "\"");
+	/* Every output needs its streams picking out once there is more than
+	 * one video to choose from.
+	*/
 	
-	append_codec(cmdline, " -vcodec ", video_formats[config.video_format]);
-	append_codec(cmdline, " -acodec ", audio_formats[config.audio_format]);
+	std::string audio_map = " -map " + to_string(encoded ? outputs.size() : 1) + ":a";
 	
-	cmdline.append(std::string(" \"") + video_out + "\"");
+	for(unsigned int i = 0; i < outputs.size(); ++i)
+	{
+		if(split)
+		{
+			cmdline.append(" -map [v" + to_string(i) + "]" + audio_map);
+		}
+		else if(outputs.size() > 1)
+		{
+			cmdline.append(" -map " + to_string(i) + ":v" + audio_map);
+		}
+		
+		if(encoded)
+		{
+			cmdline.append(" -vcodec copy");
+		}
+		else{
+			append_codec(cmdline, " -vcodec ", *(outputs[i].format));
+		}
+		
+		append_codec(cmdline, " -acodec ", audio_formats[config.audio_format]);
+		
+		cmdline.append(std::string(" \"") + escape_filename(outputs[i].file) + "\"");
+	}
 	
 	return cmdline;
 }
 
-static char *ffmpeg_cmdline_buf = NULL;
+/* Append the video encoding options and file of each output, leaving out the
+ * audio. extra is added to the options of every output.
+*/
+static void append_video_outputs(std::string &cmdline, const std::vector<video_output> &outputs,
+	const std::vector<std::string> &paths, const std::string &extra)
+{
+	bool split = split_frames(outputs);
+	
+	if(split)
+	{
+		cmdline.append(split_filter(outputs));
+	}
+	
+	for(unsigned int i = 0; i < outputs.size(); ++i)
+	{
+		if(split)
+		{
+			cmdline.append(" -map [v" + to_string(i) + "]");
+		}
+		
+		cmdline.append(extra);
+		
+		append_codec(cmdline, " -vcodec ", *(outputs[i].format));
+		
+		cmdline.append(std::string(" -an \"") + escape_filename(paths[i]) + "\"");
+	}
+}
+
+/* Command line for encoding the video alone from the frames fed through the
+ * frames pipe while WA is capturing.
+*/
+std::string ffmpeg_video_cmdline()
+{
+	std::string cmdline = "ffmpeg.exe -threads " + to_string(config.max_enc_threads) + " -y" + frames_pipe_input();
+	
+	std::vector<video_output> outputs = video_outputs();
+	std::vector<std::string> paths;
+	
+	for(unsigned int i = 0; i < outputs.size(); ++i)
+	{
+		paths.push_back(video_tmp_path(i));
+	}
+	
+	append_video_outputs(cmdline, outputs, paths, "");
+	
+	return cmdline;
+}
 
-static HANDLE ffmpeg_proc    = NULL;
-static HANDLE ffmpeg_watcher = NULL;
+/* Command line for encoding frames first to first + frames - 1 into one
+ * segment of each output.
+*/
+static std::string ffmpeg_segment_cmdline(unsigned int segment, unsigned int first, unsigned int frames, unsigned int threads)
+{
+	std::string frames_in = escape_filename(config.capture_dir + "\\" + FRAME_PREFIX + "%06d.png");
+	
+	std::string cmdline = "ffmpeg.exe -threads " + to_string(threads) + " -y"
+		" -start_number " + to_string(first) + " -r " + to_string(config.frame_rate) + " -i \"" + frames_in + "\"";
+	
+	std::vector<video_output> outputs = video_outputs();
+	std::vector<std::string> paths;
+	
+	for(unsigned int i = 0; i < outputs.size(); ++i)
+	{
+		paths.push_back(config.capture_dir + "\\" + segment_path(segment, i));
+	}
+	
+	append_video_outputs(cmdline, outputs, paths, " -frames:v " + to_string(frames));
+	
+	return cmdline;
+}
 
-/* Wait for the ffmpeg process to exit and post WM_ENC_EXIT to the progress
- * dialog when it does.
+/* A running ffmpeg process and the thread waiting for it to exit, which posts
+ * exit_msg to the progress dialog with the exit code when it does. Processes
+ * without an exit_msg are waited on by their owner instead.
 */
+struct ffmpeg_process
+{
+	UINT exit_msg;
+	
+	char *cmdline;
+	
+	HANDLE proc;
+	HANDLE watcher;
+};
+
+static ffmpeg_process encoder       = { WM_ENC_EXIT, NULL, NULL, NULL };
+static ffmpeg_process video_encoder = { WM_VIDEO_DONE, NULL, NULL, NULL };
+
 static WINAPI DWORD ffmpeg_watcher_main(LPVOID lpParameter)
 {
-	WaitForSingleObject(ffmpeg_proc, INFINITE);
+	ffmpeg_process *ff = (ffmpeg_process*)(lpParameter);
+	
+	WaitForSingleObject(ff->proc, INFINITE);
 	
 	DWORD exit_code;
-	GetExitCodeProcess(ffmpeg_proc, &exit_code);
+	GetExitCodeProcess(ff->proc, &exit_code);
 	
-	PostMessage(progress_dialog, WM_ENC_EXIT, (WPARAM)(exit_code), 0);
+	PostMessage(progress_dialog, ff->exit_msg, (WPARAM)(exit_code), 0);
 	
 	return 0;
 }
 
-/* Cleanup from any previous ffmpeg_run() call and then run ffmpeg. */
-bool ffmpeg_run()
+static bool start_ffmpeg(ffmpeg_process &ff, const std::string &cmdline)
 {
-	ffmpeg_cleanup();
-	
-	std::string cmdline = ffmpeg_cmdline();
-	
-	ffmpeg_cmdline_buf = new char[cmdline.length() + 1];
-	strcpy(ffmpeg_cmdline_buf, cmdline.c_str());
+	ff.cmdline = new char[cmdline.length() + 1];
+	strcpy(ff.cmdline, cmdline.c_str());
 	
 	STARTUPINFO sinfo;
 	memset(&sinfo, 0, sizeof(sinfo));
@@ -177,39 +519,794 @@ bool ffmpeg_run()
 	
 	PROCESS_INFORMATION pinfo;
 	
-	if(!CreateProcess(NULL, ffmpeg_cmdline_buf, NULL, NULL, FALSE, 0, NULL, NULL, &sinfo, &pinfo))
+	if(!CreateProcess(NULL, ff.cmdline, NULL, NULL, FALSE, 0, NULL, NULL, &sinfo, &pinfo))
 	{
 		log_push(std::string("Cannot run ffmpeg.exe: ") + w32_error(GetLastError()) + "\r\n");
 		return false;
 	}
 	
-	ffmpeg_proc = pinfo.hProcess;
+	ff.proc = pinfo.hProcess;
 	CloseHandle(pinfo.hThread);
 	
-	assert((ffmpeg_watcher = CreateThread(NULL, 0, &ffmpeg_watcher_main, NULL, 0, NULL)));
+	if(ff.exit_msg)
+	{
+		assert((ff.watcher = CreateThread(NULL, 0, &ffmpeg_watcher_main, &ff, 0, NULL)));
+	}
 	
 	return true;
 }
 
-/* Terminate any running ffmpeg and release any associated memory. */
-void ffmpeg_cleanup()
+static void stop_ffmpeg(ffmpeg_process &ff)
+{
+	if(ff.watcher)
+	{
+		TerminateThread(ff.watcher, 1);
+		
+		CloseHandle(ff.watcher);
+		ff.watcher = NULL;
+	}
+	
+	if(ff.proc)
+	{
+		TerminateProcess(ff.proc, 1);
+		
+		CloseHandle(ff.proc);
+		ff.proc = NULL;
+	}
+	
+	delete ff.cmdline;
+	ff.cmdline = NULL;
+}
+
+static HANDLE frames_pipe   = INVALID_HANDLE_VALUE;
+static HANDLE frame_feeder  = NULL;
+static HANDLE capture_done  = NULL;
+
+static frame_decoder *decoder = NULL;
+
+static std::string frame_path(unsigned int frame)
+{
+	char path[1024];
+	snprintf(path, sizeof(path), "%s\\" FRAME_PREFIX "%06u.png", config.capture_dir.c_str(), frame);
+	
+	return path;
+}
+
+static bool frame_exists(unsigned int frame)
+{
+	return GetFileAttributes(frame_path(frame).c_str()) != INVALID_FILE_ATTRIBUTES;
+}
+
+/* Check if WA has finished writing a frame, which it has once it has started
+ * on the next one or exited.
+*/
+static bool frame_finished(unsigned int frame, bool wa_done)
+{
+	return frame_exists(frame + 1) || (wa_done && frame_exists(frame));
+}
+
+static bool read_frame(unsigned int frame, std::vector<unsigned char> &data)
+{
+	std::string path = frame_path(frame);
+	
+	HANDLE file = CreateFile(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if(file == INVALID_HANDLE_VALUE)
+	{
+		log_push("Cannot open " + path + ": " + w32_error(GetLastError()) + "\r\n");
+		return false;
+	}
+	
+	DWORD size = GetFileSize(file, NULL);
+	data.resize(size);
+	
+	DWORD got = 0;
+	
+	if(size > 0 && (!ReadFile(file, &(data[0]), size, &got, NULL) || got != size))
+	{
+		log_push("Cannot read " + path + ": " + w32_error(GetLastError()) + "\r\n");
+		
+		CloseHandle(file);
+		return false;
+	}
+	
+	CloseHandle(file);
+	
+	return true;
+}
+
+/* Empty a frame which has been passed to the video encoder to free up the
+ * space.
+ *
+ * dsound.dll and get_frame_count() count the frames by which files exist, so
+ * the file is left behind, empty, until the capture is cleaned up.
+*/
+static bool empty_frame(unsigned int frame)
+{
+	std::string path = frame_path(frame);
+	
+	HANDLE file = CreateFile(path.c_str(), GENERIC_WRITE, 0, NULL, TRUNCATE_EXISTING, 0, NULL);
+	if(file == INVALID_HANDLE_VALUE)
+	{
+		log_push("Cannot empty " + path + ": " + w32_error(GetLastError()) + "\r\n");
+		return false;
+	}
+	
+	CloseHandle(file);
+	
+	return true;
+}
+
+/* Pass the next frame to ffmpeg, decoded if there is a decoder or as the PNG
+ * file otherwise.
+*/
+static bool feed_frame(unsigned int frame, std::vector<unsigned char> &data)
 {
-	if(ffmpeg_watcher)
+	if(decoder)
+	{
+		if(!decoder->collect(data))
+		{
+			log_push(decoder->error() + "\r\n");
+			return false;
+		}
+	}
+	else if(!read_frame(frame, data))
+	{
+		return false;
+	}
+	
+	for(size_t done = 0; done < data.size();)
 	{
-		TerminateThread(ffmpeg_watcher, 1);
+		DWORD wrote;
+		
+		if(!WriteFile(frames_pipe, &(data[done]), data.size() - done, &wrote, NULL))
+		{
+			log_push(std::string("Cannot pass frame to ffmpeg: ") + w32_error(GetLastError()) + "\r\n");
+			return false;
+		}
 		
-		CloseHandle(ffmpeg_watcher);
-		ffmpeg_watcher = NULL;
+		done += wrote;
 	}
 	
-	if(ffmpeg_proc)
+	/* After capturing, the frames are left for do_cleanup to delete with
+	 * the rest of the capture.
+	*/
+	
+	return !capture_done || empty_frame(frame);
+}
+
+/* Feed each frame to ffmpeg as soon as WA has finished it, or every frame if
+ * there is no capture_done and the capture has already finished.
+ *
+ * Up to the depth of the decoder, frames are queued for decoding ahead of the
+ * one being written, so that all of the decoder's workers are kept busy.
+*/
+static WINAPI DWORD frame_feeder_main(LPVOID lpParameter)
+{
+	if(!ConnectNamedPipe(frames_pipe, NULL) && GetLastError() != ERROR_PIPE_CONNECTED)
 	{
-		TerminateProcess(ffmpeg_proc, 1);
+		log_push(std::string("ffmpeg did not connect to the frames pipe: ") + w32_error(GetLastError()) + "\r\n");
 		
-		CloseHandle(ffmpeg_proc);
-		ffmpeg_proc = NULL;
+		PostMessage(progress_dialog, WM_ABORTED, 0, 0);
+		return 0;
 	}
 	
-	delete ffmpeg_cmdline_buf;
-	ffmpeg_cmdline_buf = NULL;
+	unsigned int depth = decoder ? decoder->depth() : 1;
+	
+	std::vector<unsigned char> data;
+	
+	for(unsigned int frame = 0, queued = 0;;)
+	{
+		bool wa_done = !capture_done || WaitForSingleObject(capture_done, 0) != WAIT_TIMEOUT;
+		
+		while(queued - frame < depth && frame_finished(queued, wa_done))
+		{
+			if(decoder)
+			{
+				decoder->queue(frame_path(queued));
+			}
+			
+			++queued;
+		}
+		
+		if(frame == queued)
+		{
+			if(wa_done)
+			{
+				break;
+			}
+			
+			WaitForSingleObject(capture_done, FRAME_POLL_INTERVAL);
+			continue;
+		}
+		
+		if(!feed_frame(frame++, data))
+		{
+			/* ffmpeg would otherwise finish successfully with
+			 * only some of the frames.
+			*/
+			
+			PostMessage(progress_dialog, WM_ABORTED, 0, 0);
+			return 0;
+		}
+	}
+	
+	/* Wait for ffmpeg to read everything before disconnecting it, so
+	 * that it sees the end of the frames.
+	*/
+	
+	FlushFileBuffers(frames_pipe);
+	DisconnectNamedPipe(frames_pipe);
+	
+	return 0;
+}
+
+/* Create the frames pipe, ffmpeg must be started to read from it before the
+ * feeder is.
+*/
+static bool create_frames_pipe()
+{
+	frames_pipe = CreateNamedPipe(frames_pipe_name().c_str(), PIPE_ACCESS_OUTBOUND,
+		PIPE_TYPE_BYTE | PIPE_WAIT, 1, FRAMES_PIPE_BUFFER, 0, 0, NULL);
+	
+	if(frames_pipe == INVALID_HANDLE_VALUE)
+	{
+		log_push(std::string("Cannot create frames pipe: ") + w32_error(GetLastError()) + "\r\n");
+		return false;
+	}
+	
+	return true;
+}
+
+static void start_frame_feeder(HANDLE capture_done)
+{
+	::capture_done = capture_done;
+	
+	if(config.decode_threads)
+	{
+		decoder = new frame_decoder(config.decode_threads, config.width, config.height);
+	}
+	
+	assert((frame_feeder = CreateThread(NULL, 0, &frame_feeder_main, NULL, 0, NULL)));
+}
+
+static void stop_frame_feeder()
+{
+	if(frame_feeder)
+	{
+		TerminateThread(frame_feeder, 1);
+		
+		CloseHandle(frame_feeder);
+		frame_feeder = NULL;
+	}
+	
+	/* The feeder never holds the decoder's lock, so the workers can still
+	 * be stopped if it was terminated while queueing or collecting.
+	*/
+	
+	delete decoder;
+	decoder = NULL;
+	
+	if(frames_pipe != INVALID_HANDLE_VALUE)
+	{
+		CloseHandle(frames_pipe);
+		frames_pipe = INVALID_HANDLE_VALUE;
+	}
+}
+
+/* Cleanup from any previous ffmpeg_run() call and then run ffmpeg. */
+bool ffmpeg_run()
+{
+	stop_ffmpeg(encoder);
+	
+	bool feed_frames = ffmpeg_decoding_frames();
+	
+	if(feed_frames)
+	{
+		stop_frame_feeder();
+		
+		if(!create_frames_pipe())
+		{
+			return false;
+		}
+	}
+	
+	if(!start_ffmpeg(encoder, ffmpeg_cmdline()))
+	{
+		if(feed_frames)
+		{
+			stop_frame_feeder();
+		}
+		
+		return false;
+	}
+	
+	if(feed_frames)
+	{
+		start_frame_feeder(NULL);
+	}
+	
+	return true;
+}
+
+/* Start encoding the video alone while WA is capturing it, finishing once
+ * capture_done is signalled. WM_VIDEO_DONE is posted to the progress dialog
+ * when the video encoder exits.
+*/
+bool ffmpeg_video_start(HANDLE capture_done)
+{
+	ffmpeg_video_cleanup();
+	
+	if(!create_frames_pipe())
+	{
+		return false;
+	}
+	
+	if(!start_ffmpeg(video_encoder, ffmpeg_video_cmdline()))
+	{
+		stop_frame_feeder();
+		return false;
+	}
+	
+	start_frame_feeder(capture_done);
+	
+	return true;
+}
+
+void ffmpeg_video_cleanup()
+{
+	stop_frame_feeder();
+	stop_ffmpeg(video_encoder);
+}
+
+/* Whether ffmpeg_run() decodes the frames and passes them through the frames
+ * pipe, in which case they are never read by anything else. They are read by
+ * ffmpeg itself if the video was already encoded while capturing or in
+ * segments.
+*/
+bool ffmpeg_decoding_frames()
+{
+	return config.decode_threads && !config.encode_during_capture && !ffmpeg_segmented();
+}
+
+/* Whether the video is encoded in parallel segments once the capture has
+ * finished, leaving ffmpeg_run() to join them and add the audio.
+*/
+bool ffmpeg_segmented()
+{
+	return config.encode_segments > 1 && !config.encode_during_capture;
+}
+
+/* Whether runs of identical frames are collapsed into one before encoding,
+ * leaving ffmpeg_run() to encode them from the list at a variable frame rate.
+ *
+ * The frames have to be read by ffmpeg itself from the files, since the other
+ * ways of encoding them pass every frame at a fixed rate.
+*/
+bool ffmpeg_collapsing()
+{
+	return config.collapse_static_frames && !config.encode_during_capture && !ffmpeg_segmented() && !config.decode_threads;
+}
+
+static HANDLE collapse_thread = NULL;
+
+/* Collapse the static frames and post WM_VIDEO_DONE to the progress dialog
+ * with zero if it succeeded.
+*/
+static WINAPI DWORD collapse_main(LPVOID lpParameter)
+{
+	unsigned int frames = get_frame_count();
+	
+	SYSTEM_INFO sys;
+	GetSystemInfo(&sys);
+	
+	std::string error;
+	unsigned int listed = collapse_static_frames(config.capture_dir, static_list_path(),
+		frames, config.frame_rate, sys.dwNumberOfProcessors, !config.do_cleanup, error);
+	
+	if(listed)
+	{
+		log_push("Collapsed " + to_string(frames) + " frames into " + to_string(listed) + "\r\n");
+	}
+	else{
+		log_push((frames ? error : "No frames were captured") + "\r\n");
+	}
+	
+	PostMessage(progress_dialog, WM_VIDEO_DONE, (WPARAM)(listed ? 0 : 1), 0);
+	
+	return 0;
+}
+
+/* Start collapsing the static frames once the capture has finished, posting
+ * WM_VIDEO_DONE to the progress dialog when it has.
+*/
+bool ffmpeg_collapse_start()
+{
+	ffmpeg_collapse_cleanup();
+	
+	log_push("Finding static frames...\r\n");
+	
+	assert((collapse_thread = CreateThread(NULL, 0, &collapse_main, NULL, 0, NULL)));
+	
+	return true;
+}
+
+void ffmpeg_collapse_cleanup()
+{
+	if(collapse_thread)
+	{
+		TerminateThread(collapse_thread, 1);
+		
+		CloseHandle(collapse_thread);
+		collapse_thread = NULL;
+	}
+}
+
+/* Frames between keyframes set by the keyint option of a format, or 1 if it
+ * has none and a segment may start at any frame.
+*/
+static unsigned int keyframe_interval(const ffmpeg_format &format)
+{
+	for(const char *k = format.extra; k && (k = strstr(k, "keyint=")); k += strlen("keyint="))
+	{
+		/* Skip over min-keyint and the like. */
+		
+		if(k != format.extra && k[-1] != ':' && k[-1] != ' ')
+		{
+			continue;
+		}
+		
+		return std::max(atoi(k + strlen("keyint=")), 1);
+	}
+	
+	return 1;
+}
+
+static unsigned int gcd(unsigned int a, unsigned int b)
+{
+	while(b)
+	{
+		unsigned int t = a % b;
+		
+		a = b;
+		b = t;
+	}
+	
+	return a;
+}
+
+static std::vector<ffmpeg_process> segments;
+static HANDLE segments_watcher = NULL;
+
+/* Wait for every segment to be encoded and post WM_VIDEO_DONE to the progress
+ * dialog with the exit code of the first one to fail, or zero once they have
+ * all succeeded.
+*/
+static WINAPI DWORD segments_watcher_main(LPVOID lpParameter)
+{
+	std::vector<HANDLE> procs;
+	
+	for(size_t i = 0; i < segments.size(); ++i)
+	{
+		procs.push_back(segments[i].proc);
+	}
+	
+	while(!procs.empty())
+	{
+		DWORD which = WaitForMultipleObjects(procs.size(), &(procs[0]), FALSE, INFINITE) - WAIT_OBJECT_0;
+		
+		DWORD exit_code;
+		GetExitCodeProcess(procs[which], &exit_code);
+		
+		if(exit_code != 0)
+		{
+			PostMessage(progress_dialog, WM_VIDEO_DONE, (WPARAM)(exit_code), 0);
+			return 0;
+		}
+		
+		procs.erase(procs.begin() + which);
+	}
+	
+	PostMessage(progress_dialog, WM_VIDEO_DONE, 0, 0);
+	
+	return 0;
+}
+
+/* Split the captured frames into up to encode_segments segments and encode
+ * them all at once, posting WM_VIDEO_DONE to the progress dialog when they
+ * have finished.
+ *
+ * The segments are rounded up to whole keyframe intervals, so the keyframes
+ * fall in the same places as if the video was encoded in one go and the
+ * segments can be joined without re-encoding them.
+*/
+bool ffmpeg_segments_start()
+{
+	ffmpeg_segments_cleanup();
+	
+	unsigned int frames = get_frame_count();
+	
+	if(frames == 0)
+	{
+		log_push("No frames were captured\r\n");
+		return false;
+	}
+	
+	std::vector<video_output> outputs = video_outputs();
+	
+	/* The keyframes of every output have to fall on the segment
+	 * boundaries.
+	*/
+	
+	unsigned int keyint = 1;
+	
+	for(size_t i = 0; i < outputs.size(); ++i)
+	{
+		unsigned int k = keyframe_interval(*(outputs[i].format));
+		keyint = keyint / gcd(keyint, k) * k;
+	}
+	
+	unsigned int wanted = std::min(config.encode_segments, (unsigned int)(MAXIMUM_WAIT_OBJECTS));
+	
+	unsigned int seg_len = (frames + wanted - 1) / wanted;
+	seg_len = ((seg_len + keyint - 1) / keyint) * keyint;
+	
+	unsigned int count = (frames + seg_len - 1) / seg_len;
+	
+	/* Share the threads out between the segments, rather than leaving
+	 * each one to use every core.
+	*/
+	
+	unsigned int threads = config.max_enc_threads ? std::max(config.max_enc_threads / count, 1U) : 0;
+	
+	for(unsigned int o = 0; o < outputs.size(); ++o)
+	{
+		FILE *list = fopen(segment_list_path(o).c_str(), "w");
+		if(!list)
+		{
+			log_push("Cannot create " + segment_list_path(o) + ": " + strerror(errno) + "\r\n");
+			return false;
+		}
+		
+		for(unsigned int i = 0; i < count; ++i)
+		{
+			fprintf(list, "file '%s'\n", segment_path(i, o).c_str());
+		}
+		
+		if(fclose(list) != 0)
+		{
+			log_push("Cannot write " + segment_list_path(o) + ": " + strerror(errno) + "\r\n");
+			return false;
+		}
+	}
+	
+	log_push("Encoding " + to_string(frames) + " frames in " + to_string(count) + " segments...\r\n");
+	
+	ffmpeg_process segment = { 0, NULL, NULL, NULL };
+	segments.resize(count, segment);
+	
+	for(unsigned int i = 0; i < count; ++i)
+	{
+		unsigned int first = i * seg_len;
+		
+		if(!start_ffmpeg(segments[i], ffmpeg_segment_cmdline(i, first, std::min(seg_len, frames - first), threads)))
+		{
+			ffmpeg_segments_cleanup();
+			return false;
+		}
+	}
+	
+	assert((segments_watcher = CreateThread(NULL, 0, &segments_watcher_main, NULL, 0, NULL)));
+	
+	return true;
+}
+
+void ffmpeg_segments_cleanup()
+{
+	if(segments_watcher)
+	{
+		TerminateThread(segments_watcher, 1);
+		
+		CloseHandle(segments_watcher);
+		segments_watcher = NULL;
+	}
+	
+	for(size_t i = 0; i < segments.size(); ++i)
+	{
+		stop_ffmpeg(segments[i]);
+	}
+	
+	segments.clear();
+}
+
+/* Terminate any running ffmpeg and release any associated memory. */
+void ffmpeg_cleanup()
+{
+	stop_ffmpeg(encoder);
+	ffmpeg_video_cleanup();
+	ffmpeg_segments_cleanup();
+	ffmpeg_collapse_cleanup();
+}
+
+ffmpeg_audio_pipe::ffmpeg_audio_pipe(HANDLE cancel)
+{
+	this->cancel = cancel;
+	
+	pipe = CreateNamedPipe(ffmpeg_audio_pipe_name().c_str(),
+		PIPE_ACCESS_OUTBOUND | FILE_FLAG_OVERLAPPED,
+		PIPE_TYPE_BYTE | PIPE_WAIT, 1, AUDIO_PIPE_BUFFER, 0, 0, NULL);
+	
+	if(pipe == INVALID_HANDLE_VALUE)
+	{
+		last_error = std::string("audio pipe: ") + w32_error(GetLastError());
+	}
+	
+	io_done = CreateEvent(NULL, TRUE, FALSE, NULL);
+	assert(io_done);
+}
+
+ffmpeg_audio_pipe::~ffmpeg_audio_pipe()
+{
+	cleanup();
+	CloseHandle(io_done);
+}
+
+void ffmpeg_audio_pipe::cleanup()
+{
+	if(pipe != INVALID_HANDLE_VALUE)
+	{
+		CloseHandle(pipe);
+		pipe = INVALID_HANDLE_VALUE;
+	}
+}
+
+/* Wait for an overlapped operation started on the pipe to finish, cancelling
+ * it if cancel is signalled first. Returns false with the error code set if
+ * it failed or was cancelled.
+*/
+bool ffmpeg_audio_pipe::wait_io(OVERLAPPED &ov, BOOL started, DWORD *transferred)
+{
+	if(!started && GetLastError() != ERROR_IO_PENDING)
+	{
+		return false;
+	}
+	
+	HANDLE events[] = { io_done, cancel };
+	
+	if(WaitForMultipleObjects(2, events, FALSE, INFINITE) != WAIT_OBJECT_0)
+	{
+		CancelIo(pipe);
+		GetOverlappedResult(pipe, &ov, transferred, TRUE);
+		
+		SetLastError(ERROR_OPERATION_ABORTED);
+		return false;
+	}
+	
+	return GetOverlappedResult(pipe, &ov, transferred, FALSE);
+}
+
+bool ffmpeg_audio_pipe::open(unsigned int sample_rate, unsigned int channels, int format, uint64_t frames)
+{
+	if(pipe == INVALID_HANDLE_VALUE)
+	{
+		return false;
+	}
+	
+	switch(format)
+	{
+		case SF_FORMAT_PCM_16:
+			sample_size = 2;
+			break;
+		
+		case SF_FORMAT_PCM_24:
+			sample_size = 3;
+			break;
+		
+		case SF_FORMAT_FLOAT:
+			sample_size = 4;
+			break;
+		
+		default:
+			last_error = "audio pipe: Unsupported sample format";
+			return false;
+	}
+	
+	/* ffmpeg may have connected already if it was quick off the mark. */
+	
+	OVERLAPPED ov;
+	memset(&ov, 0, sizeof(ov));
+	ov.hEvent = io_done;
+	
+	DWORD unused;
+	
+	BOOL connected = ConnectNamedPipe(pipe, &ov);
+	
+	if(!connected && GetLastError() == ERROR_PIPE_CONNECTED)
+	{
+		return true;
+	}
+	
+	if(!wait_io(ov, connected, &unused))
+	{
+		last_error = std::string("audio pipe: ffmpeg did not connect: ") + w32_error(GetLastError());
+		return false;
+	}
+	
+	return true;
+}
+
+template <typename Sample> bool ffmpeg_audio_pipe::write_samples(const Sample *samples, size_t count, unsigned int size)
+{
+	if(size != sample_size)
+	{
+		last_error = "audio pipe: Samples don't match the output format";
+		return false;
+	}
+	
+	if(count == 0)
+	{
+		return true;
+	}
+	
+	buffer.resize(count * sample_size);
+	pack_samples(&(buffer[0]), samples, count);
+	
+	for(size_t done = 0; done < buffer.size();)
+	{
+		OVERLAPPED ov;
+		memset(&ov, 0, sizeof(ov));
+		ov.hEvent = io_done;
+		
+		DWORD wrote = 0;
+		
+		BOOL ok = WriteFile(pipe, &(buffer[done]), buffer.size() - done, NULL, &ov);
+		
+		if(!wait_io(ov, ok, &wrote))
+		{
+			last_error = std::string("audio pipe: ") + w32_error(GetLastError());
+			return false;
+		}
+		
+		done += wrote;
+	}
+	
+	return true;
+}
+
+bool ffmpeg_audio_pipe::write(const int16_t *samples, size_t count)
+{
+	return write_samples(samples, count, 2);
+}
+
+bool ffmpeg_audio_pipe::write(const int32_t *samples, size_t count)
+{
+	return write_samples(samples, count, 3);
+}
+
+bool ffmpeg_audio_pipe::write(const float *samples, size_t count)
+{
+	return write_samples(samples, count, 4);
+}
+
+bool ffmpeg_audio_pipe::close()
+{
+	/* Anything ffmpeg hasn't read yet would be thrown away along with the
+	 * pipe, so wait for it to catch up first.
+	*/
+	
+	bool ok = true;
+	
+	if(!FlushFileBuffers(pipe))
+	{
+		last_error = std::string("audio pipe: ") + w32_error(GetLastError());
+		ok = false;
+	}
+	
+	cleanup();
+	
+	return ok;
+}
+
+std::string ffmpeg_audio_pipe::error()
+{
+	return last_error;
 }
@@ -18,10 +18,12 @@
 #ifndef AREC_ENCODE_H
 #define AREC_ENCODE_H
 
+#include <windows.h>
 #include <string>
 #include <vector>
 
 #include "main.hpp"
+#include "audio.hpp"
 
 struct ffmpeg_format
 {
@@ -50,8 +52,62 @@ int get_ffmpeg_index(const ffmpeg_format formats[], const std::string &name);
 std::vector<int> get_valid_containers(int video_format, int audio_format);
 
 std::string ffmpeg_cmdline();
+std::string ffmpeg_video_cmdline();
+std::string ffmpeg_audio_pipe_name();
 
 bool ffmpeg_run();
 void ffmpeg_cleanup();
 
+bool ffmpeg_video_start(HANDLE capture_done);
+void ffmpeg_video_cleanup();
+
+bool ffmpeg_decoding_frames();
+
+bool ffmpeg_segmented();
+bool ffmpeg_segments_start();
+void ffmpeg_segments_cleanup();
+
+bool ffmpeg_collapsing();
+bool ffmpeg_collapse_start();
+void ffmpeg_collapse_cleanup();
+
+/* Streams the mixed audio into ffmpeg through a named pipe instead of writing
+ * it to arec_audio.wav. The pipe is created along with the object, so ffmpeg
+ * may be started any time before open() is called, which waits for it to
+ * connect. Waiting on ffmpeg is given up once cancel is signalled.
+*/
+class ffmpeg_audio_pipe: public audio_output
+{
+	public:
+		ffmpeg_audio_pipe(HANDLE cancel);
+		virtual ~ffmpeg_audio_pipe();
+		
+		virtual bool open(unsigned int sample_rate, unsigned int channels, int format, uint64_t frames);
+		
+		virtual bool write(const int16_t *samples, size_t count);
+		virtual bool write(const int32_t *samples, size_t count);
+		virtual bool write(const float *samples, size_t count);
+		
+		virtual bool close();
+		
+		virtual std::string error();
+	
+	private:
+		HANDLE pipe;
+		HANDLE cancel;
+		
+		/* Signalled when an overlapped operation on the pipe ends. */
+		HANDLE io_done;
+		
+		unsigned int sample_size;
+		std::vector<unsigned char> buffer;
+		
+		std::string last_error;
+		
+		bool wait_io(OVERLAPPED &ov, BOOL started, DWORD *transferred);
+		template <typename Sample> bool write_samples(const Sample *samples, size_t count, unsigned int size);
+		
+		void cleanup();
+};
+
 #endif /* !AREC_ENCODE_H */
@@ -0,0 +1,145 @@
+/* Armageddon Recorder - Stand-in for WA capturing a replay
+ * Copyright (C) 2013 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <string>
+#include <algorithm>
+
+#include "capture-segments.hpp"
+#include "synth-log.hpp"
+
+/* Takes the same arguments and environment as WA.exe started to capture a
+ * replay with dsound.dll installed, and writes frames and an audio log the
+ * way they would.
+ *
+ * The replay file holds nothing but the length of the replay. Each frame holds
+ * the number of the frame of the replay it shows, counted from its start,
+ * rather than an image. The audio log is a synthetic one seeded by the start
+ * time, so every instance plays its own sounds and starts the music afresh
+ * like WA does.
+*/
+
+static uint64_t get_arg_time(const char *arg, uint64_t def)
+{
+	uint64_t ms;
+	
+	if(*arg == '\0')
+	{
+		return def;
+	}
+	
+	if(!parse_replay_time(arg, ms))
+	{
+		fprintf(stderr, "Invalid replay time: %s\n", arg);
+		exit(1);
+	}
+	
+	return ms;
+}
+
+int main(int argc, char **argv)
+{
+	if(argc != 9 || strcmp(argv[1], "/getvideo") != 0)
+	{
+		fprintf(stderr, "Usage: %s /getvideo <replay> <frame rate> <start> <end> <width> <height> <prefix>\n", argv[0]);
+		return 1;
+	}
+	
+	const char *frame_prefix = getenv("AREC_FRAME_PREFIX");
+	const char *log_path     = getenv("DSOUND_CAPTURE_FILE");
+	
+	if(!frame_prefix || !log_path)
+	{
+		fprintf(stderr, "AREC_FRAME_PREFIX and DSOUND_CAPTURE_FILE must be set\n");
+		return 1;
+	}
+	
+	FILE *replay = fopen(argv[2], "r");
+	if(!replay)
+	{
+		fprintf(stderr, "Could not open %s: %s\n", argv[2], strerror(errno));
+		return 1;
+	}
+	
+	char length[64] = "";
+	
+	if(!fgets(length, sizeof(length), replay))
+	{
+		fprintf(stderr, "Could not read %s\n", argv[2]);
+		return 1;
+	}
+	
+	fclose(replay);
+	
+	length[strcspn(length, "\r\n")] = '\0';
+	
+	/* Only the frame rate taken by WA 3.7.2.40 and later is supported. */
+	
+	unsigned int frame_rate = atoi(argv[3]);
+	if(frame_rate == 0)
+	{
+		fprintf(stderr, "Invalid frame rate: %s\n", argv[3]);
+		return 1;
+	}
+	
+	uint64_t length_ms = get_arg_time(length, 0);
+	uint64_t start_ms  = get_arg_time(argv[4], 0);
+	uint64_t end_ms    = std::min(get_arg_time(argv[5], length_ms), length_ms);
+	
+	uint64_t first = start_ms * frame_rate / 1000;
+	unsigned int frames = end_ms > start_ms ? (end_ms - start_ms) * frame_rate / 1000 : 0;
+	
+	for(unsigned int f = 0; f < frames; ++f)
+	{
+		char path[1024];
+		snprintf(path, sizeof(path), "%s%06u.png", frame_prefix, f);
+		
+		FILE *frame = fopen(path, "w");
+		if(!frame || fprintf(frame, "%llu\n", (unsigned long long)(first + f)) < 0 || fclose(frame) != 0)
+		{
+			fprintf(stderr, "Could not write %s: %s\n", path, strerror(errno));
+			return 1;
+		}
+	}
+	
+	FILE *log = fopen(log_path, "wb");
+	if(!log)
+	{
+		fprintf(stderr, "Could not create %s: %s\n", log_path, strerror(errno));
+		return 1;
+	}
+	
+	synth_log_options options;
+	
+	options.frame_rate = frame_rate;
+	options.frames     = frames;
+	options.seed       = start_ms + 1;
+	
+	synth_log_stats stats;
+	
+	if(!synth_log_write(log, options, stats) || fclose(log) != 0)
+	{
+		fprintf(stderr, "Could not write %s: %s\n", log_path, strerror(errno));
+		return 1;
+	}
+	
+	return 0;
+}
@@ -0,0 +1,282 @@
+/* Armageddon Recorder - Parallel frame decoder
+ * Copyright (C) 2013 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <windows.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <setjmp.h>
+#include <png.h>
+
+#include "frame-decode.hpp"
+#include "frame-recompress.hpp"
+#include "qoi.hpp"
+
+/* Frames held in the reorder buffer for each worker, so that one slow frame
+ * doesn't leave the other workers idle.
+*/
+#define SLOTS_PER_WORKER 2
+
+frame_decoder::frame_decoder(unsigned int threads, unsigned int width, unsigned int height):
+	width(width), height(height), slots(threads * SLOTS_PER_WORKER)
+{
+	for(size_t i = 0; i < slots.size(); ++i)
+	{
+		assert((slots[i].ready = CreateEvent(NULL, FALSE, FALSE, NULL)));
+	}
+	
+	assert((free_slots = CreateSemaphore(NULL, slots.size(), slots.size(), NULL)));
+	/* Room is left for the destructor to wake every worker with jobs still
+	 * queued in every slot.
+	*/
+	
+	assert((jobs = CreateSemaphore(NULL, 0, slots.size() + threads, NULL)));
+	
+	next_queue   = 0;
+	next_job     = 0;
+	next_collect = 0;
+	
+	InitializeCriticalSection(&job_lock);
+	
+	stopping = false;
+	
+	for(unsigned int i = 0; i < threads; ++i)
+	{
+		HANDLE worker = CreateThread(NULL, 0, &worker_main, this, 0, NULL);
+		assert(worker);
+		
+		workers.push_back(worker);
+	}
+}
+
+frame_decoder::~frame_decoder()
+{
+	/* Any frame being decoded is finished, the rest are abandoned. */
+	
+	stopping = true;
+	ReleaseSemaphore(jobs, workers.size(), NULL);
+	
+	for(size_t i = 0; i < workers.size(); ++i)
+	{
+		WaitForSingleObject(workers[i], INFINITE);
+		CloseHandle(workers[i]);
+	}
+	
+	DeleteCriticalSection(&job_lock);
+	
+	CloseHandle(jobs);
+	CloseHandle(free_slots);
+	
+	for(size_t i = 0; i < slots.size(); ++i)
+	{
+		CloseHandle(slots[i].ready);
+	}
+}
+
+unsigned int frame_decoder::depth() const
+{
+	return slots.size();
+}
+
+void frame_decoder::queue(const std::string &path)
+{
+	WaitForSingleObject(free_slots, INFINITE);
+	
+	slots[next_queue++ % slots.size()].path = path;
+	
+	ReleaseSemaphore(jobs, 1, NULL);
+}
+
+bool frame_decoder::collect(std::vector<unsigned char> &pixels)
+{
+	assert(next_collect != next_queue);
+	
+	slot &s = slots[next_collect++ % slots.size()];
+	
+	WaitForSingleObject(s.ready, INFINITE);
+	
+	bool ok = s.error.empty();
+	
+	if(ok)
+	{
+		pixels.swap(s.pixels);
+	}
+	else{
+		last_error = s.error;
+	}
+	
+	ReleaseSemaphore(free_slots, 1, NULL);
+	
+	return ok;
+}
+
+std::string frame_decoder::error()
+{
+	return last_error;
+}
+
+WINAPI DWORD frame_decoder::worker_main(LPVOID lpParameter)
+{
+	frame_decoder *fd = (frame_decoder*)(lpParameter);
+	
+	while(1)
+	{
+		WaitForSingleObject(fd->jobs, INFINITE);
+		
+		if(fd->stopping)
+		{
+			break;
+		}
+		
+		EnterCriticalSection(&(fd->job_lock));
+		slot &s = fd->slots[fd->next_job++ % fd->slots.size()];
+		LeaveCriticalSection(&(fd->job_lock));
+		
+		s.error.clear();
+		fd->decode(s);
+		
+		SetEvent(s.ready);
+	}
+	
+	return 0;
+}
+
+/* libpng reports errors by longjmp()ing back out of the decode, the message
+ * is copied into the string passed as the error pointer first.
+*/
+static void png_error_fn(png_structp png, png_const_charp msg)
+{
+	std::string *error = (std::string*)(png_get_error_ptr(png));
+	error->assign(msg);
+	
+	longjmp(png_jmpbuf(png), 1);
+}
+
+static void png_warning_fn(png_structp png, png_const_charp msg) {}
+
+bool frame_decoder::decode(slot &s)
+{
+	FILE *fh = fopen(qoi_frame_path(s.path).c_str(), "rb");
+	if(fh)
+	{
+		return decode_qoi(s, fh);
+	}
+	
+	fh = fopen(s.path.c_str(), "rb");
+	if(!fh)
+	{
+		s.error = "Cannot open " + s.path + ": " + strerror(errno);
+		return false;
+	}
+	
+	png_structp png = png_create_read_struct(PNG_LIBPNG_VER_STRING, &(s.error), &png_error_fn, &png_warning_fn);
+	png_infop info  = png ? png_create_info_struct(png) : NULL;
+	
+	if(!info)
+	{
+		png_destroy_read_struct(&png, NULL, NULL);
+		fclose(fh);
+		
+		s.error = "Cannot decode " + s.path + ": Out of memory";
+		return false;
+	}
+	
+	s.pixels.resize(width * height * 3);
+	std::vector<png_bytep> rows(height);
+	
+	for(unsigned int y = 0; y < height; ++y)
+	{
+		rows[y] = &(s.pixels[y * width * 3]);
+	}
+	
+	/* Nothing may be constructed from here to the end of the decode,
+	 * since a longjmp() back out of libpng wouldn't destroy it.
+	*/
+	
+	if(setjmp(png_jmpbuf(png)))
+	{
+		png_destroy_read_struct(&png, &info, NULL);
+		fclose(fh);
+		
+		s.error = "Cannot decode " + s.path + ": " + s.error;
+		return false;
+	}
+	
+	png_init_io(png, fh);
+	png_read_info(png, info);
+	
+	if(png_get_image_width(png, info) != width || png_get_image_height(png, info) != height)
+	{
+		char msg[128];
+		snprintf(msg, sizeof(msg), "Frame is %ux%u, expected %ux%u",
+			(unsigned int)(png_get_image_width(png, info)), (unsigned int)(png_get_image_height(png, info)),
+			width, height);
+		
+		png_error(png, msg);
+	}
+	
+	/* Convert whatever format the frame was written in to 8-bit BGR. */
+	
+	png_set_expand(png);
+	png_set_strip_16(png);
+	png_set_strip_alpha(png);
+	png_set_gray_to_rgb(png);
+	png_set_bgr(png);
+	png_set_interlace_handling(png);
+	
+	png_read_update_info(png, info);
+	
+	png_read_image(png, &(rows[0]));
+	png_read_end(png, NULL);
+	
+	png_destroy_read_struct(&png, &info, NULL);
+	fclose(fh);
+	
+	return true;
+}
+
+bool frame_decoder::decode_qoi(slot &s, FILE *fh)
+{
+	std::string path = qoi_frame_path(s.path);
+	
+	fseek(fh, 0, SEEK_END);
+	long size = ftell(fh);
+	fseek(fh, 0, SEEK_SET);
+	
+	std::vector<unsigned char> image(size > 0 ? size : 1);
+	
+	if(size < 0 || fread(&(image[0]), 1, size, fh) != (size_t)(size))
+	{
+		s.error = "Cannot read " + path + ": " + strerror(ferror(fh) ? errno : EIO);
+		
+		fclose(fh);
+		return false;
+	}
+	
+	fclose(fh);
+	
+	s.pixels.resize(width * height * 3);
+	
+	if(!qoi_decode(&(image[0]), size, width, height, &(s.pixels[0]), s.error))
+	{
+		s.error = "Cannot decode " + path + ": " + s.error;
+		return false;
+	}
+	
+	return true;
+}
@@ -0,0 +1,92 @@
+/* Armageddon Recorder - Parallel frame decoder
+ * Copyright (C) 2013 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef AREC_FRAME_DECODE_HPP
+#define AREC_FRAME_DECODE_HPP
+
+#include <windows.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+/* Decodes PNG frames to packed 24-bit BGR on a pool of worker threads. Frames
+ * which frame_recompressor has converted to QOI are decoded from that instead.
+ *
+ * Frames are handed back by collect() in the order they were queued, however
+ * long each one takes to decode. At most depth() frames are held at once, so
+ * queue() blocks until the oldest one has been collected if there are more.
+ *
+ * Only one thread may queue and collect frames.
+*/
+class frame_decoder
+{
+	public:
+		frame_decoder(unsigned int threads, unsigned int width, unsigned int height);
+		~frame_decoder();
+		
+		unsigned int depth() const;
+		
+		void queue(const std::string &path);
+		
+		/* Wait for the oldest queued frame to be decoded and swap its
+		 * pixels into pixels. Returns false if it couldn't be decoded.
+		*/
+		bool collect(std::vector<unsigned char> &pixels);
+		
+		std::string error();
+	
+	private:
+		struct slot
+		{
+			std::string path;
+			
+			std::vector<unsigned char> pixels;
+			std::string error;
+			
+			/* Signalled when the frame has been decoded. */
+			HANDLE ready;
+		};
+		
+		unsigned int width, height;
+		
+		std::vector<slot> slots;
+		std::vector<HANDLE> workers;
+		
+		/* Slots free to be queued into and frames waiting for a worker. */
+		HANDLE free_slots;
+		HANDLE jobs;
+		
+		/* Sequence numbers of the next frame to be queued, started by a
+		 * worker and collected. next_job is shared by the workers.
+		*/
+		unsigned int next_queue;
+		unsigned int next_job;
+		unsigned int next_collect;
+		
+		CRITICAL_SECTION job_lock;
+		
+		bool stopping;
+		
+		std::string last_error;
+		
+		static WINAPI DWORD worker_main(LPVOID lpParameter);
+		
+		bool decode(slot &s);
+		bool decode_qoi(slot &s, FILE *fh);
+};
+
+#endif /* !AREC_FRAME_DECODE_HPP */
@@ -0,0 +1,331 @@
+/* Armageddon Recorder - Background frame recompression
+ * Copyright (C) 2013 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <windows.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <limits.h>
+#include <setjmp.h>
+#include <png.h>
+
+#include "frame-recompress.hpp"
+#include "qoi.hpp"
+#include "main.hpp"
+
+std::string qoi_frame_path(const std::string &path)
+{
+	return path.substr(0, path.find_last_of('.')) + ".qoi";
+}
+
+frame_recompressor::frame_recompressor(unsigned int threads)
+{
+	assert((jobs = CreateSemaphore(NULL, 0, LONG_MAX, NULL)));
+	
+	InitializeCriticalSection(&lock);
+	
+	stopping = false;
+	
+	replaced_frames = 0;
+	saved_bytes     = 0;
+	failed_frames   = 0;
+	
+	for(unsigned int i = 0; i < threads; ++i)
+	{
+		HANDLE worker = CreateThread(NULL, 0, &worker_main, this, 0, NULL);
+		assert(worker);
+		
+		/* The workers only use whatever time WA leaves spare. */
+		
+		SetThreadPriority(worker, THREAD_PRIORITY_LOWEST);
+		
+		workers.push_back(worker);
+	}
+}
+
+frame_recompressor::~frame_recompressor()
+{
+	EnterCriticalSection(&lock);
+	
+	stopping = true;
+	pending.clear();
+	
+	LeaveCriticalSection(&lock);
+	
+	ReleaseSemaphore(jobs, workers.size(), NULL);
+	
+	for(size_t i = 0; i < workers.size(); ++i)
+	{
+		WaitForSingleObject(workers[i], INFINITE);
+		CloseHandle(workers[i]);
+	}
+	
+	DeleteCriticalSection(&lock);
+	CloseHandle(jobs);
+}
+
+void frame_recompressor::queue(const std::string &path)
+{
+	EnterCriticalSection(&lock);
+	pending.push_back(path);
+	LeaveCriticalSection(&lock);
+	
+	ReleaseSemaphore(jobs, 1, NULL);
+}
+
+unsigned int frame_recompressor::replaced()
+{
+	EnterCriticalSection(&lock);
+	unsigned int r = replaced_frames;
+	LeaveCriticalSection(&lock);
+	
+	return r;
+}
+
+uint64_t frame_recompressor::saved()
+{
+	EnterCriticalSection(&lock);
+	uint64_t s = saved_bytes;
+	LeaveCriticalSection(&lock);
+	
+	return s;
+}
+
+unsigned int frame_recompressor::failed()
+{
+	EnterCriticalSection(&lock);
+	unsigned int f = failed_frames;
+	LeaveCriticalSection(&lock);
+	
+	return f;
+}
+
+std::string frame_recompressor::error()
+{
+	EnterCriticalSection(&lock);
+	std::string e = last_error;
+	LeaveCriticalSection(&lock);
+	
+	return e;
+}
+
+WINAPI DWORD frame_recompressor::worker_main(LPVOID lpParameter)
+{
+	frame_recompressor *fr = (frame_recompressor*)(lpParameter);
+	
+	while(1)
+	{
+		WaitForSingleObject(fr->jobs, INFINITE);
+		
+		EnterCriticalSection(&(fr->lock));
+		
+		if(fr->stopping)
+		{
+			LeaveCriticalSection(&(fr->lock));
+			break;
+		}
+		
+		std::string path = fr->pending.front();
+		fr->pending.pop_front();
+		
+		LeaveCriticalSection(&(fr->lock));
+		
+		uint64_t saved = 0;
+		std::string error;
+		
+		bool ok = fr->recompress(path, saved, error);
+		
+		EnterCriticalSection(&(fr->lock));
+		
+		if(!ok)
+		{
+			fr->failed_frames++;
+			fr->last_error = error;
+		}
+		else if(saved)
+		{
+			fr->replaced_frames++;
+			fr->saved_bytes += saved;
+		}
+		
+		LeaveCriticalSection(&(fr->lock));
+	}
+	
+	return 0;
+}
+
+/* libpng reports errors by longjmp()ing back out of the read or write, the
+ * message is copied into the string passed as the error pointer first.
+*/
+static void png_error_fn(png_structp png, png_const_charp msg)
+{
+	std::string *error = (std::string*)(png_get_error_ptr(png));
+	error->assign(msg);
+	
+	longjmp(png_jmpbuf(png), 1);
+}
+
+static void png_warning_fn(png_structp png, png_const_charp msg) {}
+
+/* Write the frame read by png/info as 8-bit BGR to out as a QOI image. Returns
+ * the size of the new file, or zero with error set on failure.
+*/
+static long write_qoi(FILE *out, png_structp png, png_infop info, std::string &error)
+{
+	unsigned int width  = png_get_image_width(png, info);
+	unsigned int height = png_get_image_height(png, info);
+	
+	if(png_get_channels(png, info) != 3 || png_get_bit_depth(png, info) != 8)
+	{
+		error = "Unexpected pixel format";
+		return 0;
+	}
+	
+	png_bytepp rows = png_get_rows(png, info);
+	std::vector<unsigned char> pixels(width * height * 3);
+	
+	for(unsigned int y = 0; y < height; ++y)
+	{
+		memcpy(&(pixels[y * width * 3]), rows[y], width * 3);
+	}
+	
+	std::vector<unsigned char> image;
+	qoi_encode(&(pixels[0]), width, height, image);
+	
+	if(fwrite(&(image[0]), image.size(), 1, out) != 1)
+	{
+		error = strerror(errno);
+		return 0;
+	}
+	
+	return image.size();
+}
+
+/* Convert the frame at path to QOI, if that makes it smaller. saved is set to
+ * the number of bytes saved, zero if the frame was left alone.
+*/
+bool frame_recompressor::recompress(const std::string &path, uint64_t &saved, std::string &error)
+{
+	std::string new_path = qoi_frame_path(path);
+	std::string tmp_path = new_path + ".tmp";
+	
+	FILE *in = fopen(path.c_str(), "rb");
+	if(!in)
+	{
+		error = "Cannot open " + path + ": " + strerror(errno);
+		return false;
+	}
+	
+	png_structp png = png_create_read_struct(PNG_LIBPNG_VER_STRING, &error, &png_error_fn, &png_warning_fn);
+	png_infop info  = png ? png_create_info_struct(png) : NULL;
+	
+	if(!info)
+	{
+		png_destroy_read_struct(&png, NULL, NULL);
+		fclose(in);
+		
+		error = "Cannot decode " + path + ": Out of memory";
+		return false;
+	}
+	
+	if(setjmp(png_jmpbuf(png)))
+	{
+		png_destroy_read_struct(&png, &info, NULL);
+		fclose(in);
+		
+		error = "Cannot decode " + path + ": " + error;
+		return false;
+	}
+	
+	/* A QOI frame holds the pixels frame_decoder would have decoded
+	 * from the PNG, anything else it would have thrown away is dropped.
+	*/
+	
+	int transforms = PNG_TRANSFORM_EXPAND | PNG_TRANSFORM_STRIP_16 | PNG_TRANSFORM_STRIP_ALPHA
+		| PNG_TRANSFORM_GRAY_TO_RGB | PNG_TRANSFORM_BGR;
+	
+	png_init_io(png, in);
+	png_read_png(png, info, transforms, NULL);
+	
+	fseek(in, 0, SEEK_END);
+	long old_size = ftell(in);
+	
+	fclose(in);
+	
+	FILE *out = fopen(tmp_path.c_str(), "wb");
+	if(!out)
+	{
+		png_destroy_read_struct(&png, &info, NULL);
+		
+		error = "Cannot create " + tmp_path + ": " + strerror(errno);
+		return false;
+	}
+	
+	long new_size = write_qoi(out, png, info, error);
+	
+	png_destroy_read_struct(&png, &info, NULL);
+	
+	if(fclose(out) != 0 && new_size)
+	{
+		error    = strerror(errno);
+		new_size = 0;
+	}
+	
+	if(!new_size)
+	{
+		DeleteFile(tmp_path.c_str());
+		
+		error = "Cannot write " + tmp_path + ": " + error;
+		return false;
+	}
+	
+	if(new_size >= old_size)
+	{
+		DeleteFile(tmp_path.c_str());
+		
+		saved = 0;
+		return true;
+	}
+	
+	if(!MoveFileEx(tmp_path.c_str(), new_path.c_str(), MOVEFILE_REPLACE_EXISTING))
+	{
+		error = "Cannot create " + new_path + ": " + w32_error(GetLastError());
+		
+		DeleteFile(tmp_path.c_str());
+		return false;
+	}
+	
+	/* The frame is read from the QOI image once it exists, the PNG only
+	 * has to be there for it to be counted.
+	*/
+	
+	HANDLE file = CreateFile(path.c_str(), GENERIC_WRITE, 0, NULL, TRUNCATE_EXISTING, 0, NULL);
+	if(file == INVALID_HANDLE_VALUE)
+	{
+		error = "Cannot empty " + path + ": " + w32_error(GetLastError());
+		
+		DeleteFile(new_path.c_str());
+		return false;
+	}
+	
+	CloseHandle(file);
+	
+	saved = old_size - new_size;
+	
+	return true;
+}
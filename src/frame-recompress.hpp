@@ -0,0 +1,81 @@
+/* Armageddon Recorder - Background frame recompression
+ * Copyright (C) 2013 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef AREC_FRAME_RECOMPRESS_HPP
+#define AREC_FRAME_RECOMPRESS_HPP
+
+#include <windows.h>
+#include <stdint.h>
+#include <string>
+#include <deque>
+#include <vector>
+
+/* Converts finished PNG frames to QOI on a pool of low priority worker threads
+ * while WA carries on capturing. Only used when the frames are going to be
+ * read by frame_decoder, which decodes QOI faster than PNG.
+ *
+ * Each frame is converted to a QOI image of the pixels frame_decoder decodes
+ * from it, which is written to qoi_frame_path() and the PNG emptied. The empty
+ * PNG is left for the frame to be counted by, like the ones emptied by the
+ * encoder.
+ *
+ * Frames which wouldn't be made any smaller or can't be read are left alone.
+ * Frames still queued when the object is destroyed are abandoned, the ones
+ * being recompressed are finished first.
+*/
+class frame_recompressor
+{
+	public:
+		frame_recompressor(unsigned int threads);
+		~frame_recompressor();
+		
+		void queue(const std::string &path);
+		
+		/* Frames replaced, bytes saved and frames which couldn't be
+		 * recompressed so far, along with the reason the last one
+		 * couldn't be.
+		*/
+		unsigned int replaced();
+		uint64_t saved();
+		unsigned int failed();
+		std::string error();
+	
+	private:
+		std::deque<std::string> pending;
+		std::vector<HANDLE> workers;
+		
+		/* Counts the frames in pending. */
+		HANDLE jobs;
+		
+		CRITICAL_SECTION lock;
+		
+		bool stopping;
+		
+		unsigned int replaced_frames;
+		uint64_t saved_bytes;
+		unsigned int failed_frames;
+		std::string last_error;
+		
+		static WINAPI DWORD worker_main(LPVOID lpParameter);
+		
+		bool recompress(const std::string &path, uint64_t &saved, std::string &error);
+};
+
+/* Path a frame converted to QOI is moved to from its PNG path. */
+std::string qoi_frame_path(const std::string &path);
+
+#endif /* !AREC_FRAME_RECOMPRESS_HPP */
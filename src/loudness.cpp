@@ -0,0 +1,358 @@
+/* Armageddon Recorder - EBU R128 loudness meter
+ * Copyright (C) 2013 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <math.h>
+#include <string.h>
+#include <algorithm>
+
+#include "loudness.hpp"
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+/* Sub-blocks making up the 400ms gating blocks and the 3s short-term
+ * blocks used for the loudness range.
+*/
+#define MOMENTARY_SUB_BLOCKS  4
+#define SHORT_TERM_SUB_BLOCKS 30
+
+#define ABSOLUTE_GATE       -70.0
+#define RELATIVE_GATE       -10.0
+#define RANGE_RELATIVE_GATE -20.0
+
+#define RANGE_LOW_PERCENTILE  0.10
+#define RANGE_HIGH_PERCENTILE 0.95
+
+/* Polyphase FIR from ITU-R BS.1770-4 Annex 2, interpolating by 4 to find
+ * the peaks between samples.
+*/
+static const double true_peak_fir[TRUE_PEAK_PHASES][TRUE_PEAK_TAPS] = {
+	{  0.0017089843750,  0.0109863281250, -0.0196533203125,  0.0332031250000,
+	  -0.0594482421875,  0.1373291015625,  0.9721679687500, -0.1022949218750,
+	   0.0476074218750, -0.0266113281250,  0.0148925781250, -0.0083007812500 },
+	{ -0.0291748046875,  0.0292968750000, -0.0517578125000,  0.0891113281250,
+	  -0.1665039062500,  0.4650878906250,  0.7797851562500, -0.2003173828125,
+	   0.1015625000000, -0.0582275390625,  0.0330810546875, -0.0189208984375 },
+	{ -0.0189208984375,  0.0330810546875, -0.0582275390625,  0.1015625000000,
+	  -0.2003173828125,  0.7797851562500,  0.4650878906250, -0.1665039062500,
+	   0.0891113281250, -0.0517578125000,  0.0292968750000, -0.0291748046875 },
+	{ -0.0083007812500,  0.0148925781250, -0.0266113281250,  0.0476074218750,
+	  -0.1022949218750,  0.9721679687500,  0.1373291015625, -0.0594482421875,
+	   0.0332031250000, -0.0196533203125,  0.0109863281250,  0.0017089843750 }
+};
+
+/* Loudness in LUFS of a mean square summed over the channels. */
+static double energy_to_lufs(double energy)
+{
+	return -0.691 + 10 * log10(energy);
+}
+
+static double lufs_to_energy(double lufs)
+{
+	return pow(10, (lufs + 0.691) / 10);
+}
+
+loudness_stats::loudness_stats()
+{
+	valid = false;
+	
+	integrated = -HUGE_VAL;
+	range      = 0;
+	true_peak  = -HUGE_VAL;
+}
+
+loudness_meter::channel_state::channel_state()
+{
+	memset(x1, 0, sizeof(x1));
+	memset(x2, 0, sizeof(x2));
+	memset(y1, 0, sizeof(y1));
+	memset(y2, 0, sizeof(y2));
+	
+	memset(history, 0, sizeof(history));
+	history_pos = 0;
+}
+
+loudness_meter::loudness_meter(unsigned int sample_rate, unsigned int channels):
+	channels(channels), state(channels), frame(channels)
+{
+	/* The K-weighting filters are specified as coefficients at 48kHz,
+	 * these are the analog prototypes they were derived from so that any
+	 * sample rate can be measured.
+	*/
+	
+	{
+		/* Stage 1: high shelf modelling the acoustic effect of the head. */
+		
+		double f0 = 1681.974450955533;
+		double G  = 3.999843853973347;
+		double Q  = 0.7071752369554196;
+		
+		double K  = tan(M_PI * f0 / sample_rate);
+		double Vh = pow(10, G / 20);
+		double Vb = pow(Vh, 0.4996667741545416);
+		
+		double a0 = 1 + K / Q + K * K;
+		
+		k_filter[0].b0 = (Vh + Vb * K / Q + K * K) / a0;
+		k_filter[0].b1 = 2 * (K * K - Vh) / a0;
+		k_filter[0].b2 = (Vh - Vb * K / Q + K * K) / a0;
+		k_filter[0].a1 = 2 * (K * K - 1) / a0;
+		k_filter[0].a2 = (1 - K / Q + K * K) / a0;
+	}
+	
+	{
+		/* Stage 2: the RLB high pass. */
+		
+		double f0 = 38.13547087602444;
+		double Q  = 0.5003270373238773;
+		
+		double K  = tan(M_PI * f0 / sample_rate);
+		double a0 = 1 + K / Q + K * K;
+		
+		k_filter[1].b0 = 1;
+		k_filter[1].b1 = -2;
+		k_filter[1].b2 = 1;
+		k_filter[1].a1 = 2 * (K * K - 1) / a0;
+		k_filter[1].a2 = (1 - K / Q + K * K) / a0;
+	}
+	
+	sub_block_frames = std::max(sample_rate / 10, 1U);
+	sub_block_pos    = 0;
+	sub_block_sum    = 0;
+	
+	recent_sub_blocks.resize(SHORT_TERM_SUB_BLOCKS);
+	sub_blocks = 0;
+	
+	peak = 0;
+	
+	true_peak_gain = 0;
+	
+	for(int p = 0; p < TRUE_PEAK_PHASES; ++p)
+	{
+		double gain = 0;
+		
+		for(int t = 0; t < TRUE_PEAK_TAPS; ++t)
+		{
+			gain += fabs(true_peak_fir[p][t]);
+		}
+		
+		true_peak_gain = std::max(true_peak_gain, gain);
+	}
+}
+
+/* Pass a sample through both K-weighting stages. */
+double loudness_meter::filter_sample(channel_state &cs, double x)
+{
+	for(int s = 0; s < 2; ++s)
+	{
+		const biquad &bq = k_filter[s];
+		
+		double y = bq.b0 * x + bq.b1 * cs.x1[s] + bq.b2 * cs.x2[s]
+			- bq.a1 * cs.y1[s] - bq.a2 * cs.y2[s];
+		
+		cs.x2[s] = cs.x1[s];
+		cs.x1[s] = x;
+		
+		cs.y2[s] = cs.y1[s];
+		cs.y1[s] = y;
+		
+		x = y;
+	}
+	
+	return x;
+}
+
+/* Add a sample to the interpolation history and return the highest absolute
+ * value of it and the points interpolated before it.
+*/
+double loudness_meter::true_peak_sample(channel_state &cs, double x)
+{
+	/* The history is stored twice over so the newest TRUE_PEAK_TAPS samples
+	 * can always be read in one run, newest first.
+	*/
+	
+	cs.history_pos = (cs.history_pos + TRUE_PEAK_TAPS - 1) % TRUE_PEAK_TAPS;
+	
+	cs.history[cs.history_pos] = x;
+	cs.history[cs.history_pos + TRUE_PEAK_TAPS] = x;
+	
+	const double *h = cs.history + cs.history_pos;
+	
+	double max = fabs(x);
+	
+	/* No interpolated point can be larger than the largest sample around
+	 * it times the gain of the filter, so most of the time there is no
+	 * need to interpolate at all.
+	*/
+	
+	double window_max = 0;
+	
+	for(int t = 0; t < TRUE_PEAK_TAPS; ++t)
+	{
+		window_max = std::max(window_max, fabs(h[t]));
+	}
+	
+	if(window_max * true_peak_gain <= peak)
+	{
+		return max;
+	}
+	
+	for(int p = 0; p < TRUE_PEAK_PHASES; ++p)
+	{
+		double y = 0;
+		
+		for(int t = 0; t < TRUE_PEAK_TAPS; ++t)
+		{
+			y += true_peak_fir[p][t] * h[t];
+		}
+		
+		max = std::max(max, fabs(y));
+	}
+	
+	return max;
+}
+
+void loudness_meter::add_frame()
+{
+	for(unsigned int c = 0; c < channels; ++c)
+	{
+		channel_state &cs = state[c];
+		
+		double y = filter_sample(cs, frame[c]);
+		sub_block_sum += y * y;
+		
+		peak = std::max(peak, true_peak_sample(cs, frame[c]));
+	}
+	
+	if(++sub_block_pos == sub_block_frames)
+	{
+		end_sub_block();
+	}
+}
+
+/* Finish a 100ms sub-block and record the gating blocks which end with it. */
+void loudness_meter::end_sub_block()
+{
+	recent_sub_blocks[sub_blocks++ % SHORT_TERM_SUB_BLOCKS] = sub_block_sum / sub_block_frames;
+	
+	sub_block_pos = 0;
+	sub_block_sum = 0;
+	
+	if(sub_blocks >= MOMENTARY_SUB_BLOCKS)
+	{
+		double sum = 0;
+		
+		for(size_t i = sub_blocks - MOMENTARY_SUB_BLOCKS; i < sub_blocks; ++i)
+		{
+			sum += recent_sub_blocks[i % SHORT_TERM_SUB_BLOCKS];
+		}
+		
+		momentary_blocks.push_back(sum / MOMENTARY_SUB_BLOCKS);
+	}
+	
+	if(sub_blocks >= SHORT_TERM_SUB_BLOCKS)
+	{
+		double sum = 0;
+		
+		for(size_t i = 0; i < SHORT_TERM_SUB_BLOCKS; ++i)
+		{
+			sum += recent_sub_blocks[i];
+		}
+		
+		short_term_blocks.push_back(sum / SHORT_TERM_SUB_BLOCKS);
+	}
+}
+
+/* Mean energy of the blocks above the absolute gate and a gate relative to
+ * their own loudness. Returns zero if no blocks pass.
+*/
+static double gated_energy(const std::vector<double> &blocks, double relative_gate, std::vector<double> *passed = NULL)
+{
+	double abs_threshold = lufs_to_energy(ABSOLUTE_GATE);
+	
+	double sum = 0;
+	size_t count = 0;
+	
+	for(auto b = blocks.begin(); b != blocks.end(); ++b)
+	{
+		if(*b > abs_threshold)
+		{
+			sum += *b;
+			++count;
+		}
+	}
+	
+	if(count == 0)
+	{
+		return 0;
+	}
+	
+	double rel_threshold = lufs_to_energy(energy_to_lufs(sum / count) + relative_gate);
+	
+	sum   = 0;
+	count = 0;
+	
+	for(auto b = blocks.begin(); b != blocks.end(); ++b)
+	{
+		if(*b > abs_threshold && *b > rel_threshold)
+		{
+			sum += *b;
+			++count;
+			
+			if(passed)
+			{
+				passed->push_back(energy_to_lufs(*b));
+			}
+		}
+	}
+	
+	return count ? sum / count : 0;
+}
+
+loudness_stats loudness_meter::stats() const
+{
+	loudness_stats stats;
+	
+	if(peak > 0)
+	{
+		stats.true_peak = 20 * log10(peak);
+	}
+	
+	double energy = gated_energy(momentary_blocks, RELATIVE_GATE);
+	
+	if(energy > 0)
+	{
+		stats.valid      = true;
+		stats.integrated = energy_to_lufs(energy);
+	}
+	
+	std::vector<double> short_term;
+	gated_energy(short_term_blocks, RANGE_RELATIVE_GATE, &short_term);
+	
+	if(!short_term.empty())
+	{
+		std::sort(short_term.begin(), short_term.end());
+		
+		size_t low  = (size_t)((short_term.size() - 1) * RANGE_LOW_PERCENTILE + 0.5);
+		size_t high = (size_t)((short_term.size() - 1) * RANGE_HIGH_PERCENTILE + 0.5);
+		
+		stats.range = short_term[high] - short_term[low];
+	}
+	
+	return stats;
+}
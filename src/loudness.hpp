@@ -0,0 +1,126 @@
+/* Armageddon Recorder - EBU R128 loudness meter
+ * Copyright (C) 2013 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef AREC_LOUDNESS_HPP
+#define AREC_LOUDNESS_HPP
+
+#include <stddef.h>
+#include <vector>
+
+/* Phases and taps per phase of the true peak interpolator. */
+#define TRUE_PEAK_PHASES 4
+#define TRUE_PEAK_TAPS   12
+
+/* Loudness of a whole programme, as defined by EBU R128. */
+struct loudness_stats
+{
+	/* False if the programme was too short or too quiet to measure, in
+	 * which case the other members are meaningless.
+	*/
+	bool valid;
+	
+	double integrated;	/* Integrated loudness in LUFS */
+	double range;		/* Loudness range in LU */
+	double true_peak;	/* Highest true peak in dBTP */
+	
+	loudness_stats();
+};
+
+/* Measures the loudness of audio as it is fed in, following ITU-R BS.1770
+ * for the integrated loudness and true peak and EBU Tech 3342 for the
+ * loudness range.
+ *
+ * Only the gated block loudnesses are kept, so any length of audio can be
+ * measured in a single pass.
+*/
+class loudness_meter
+{
+	public:
+		loudness_meter(unsigned int sample_rate, unsigned int channels);
+		
+		/* Add interleaved frames, scaling each sample by scale to bring
+		 * full scale to 1.0.
+		*/
+		template <typename Sample> void add(const Sample *samples, size_t frames, double scale)
+		{
+			for(size_t f = 0; f < frames; ++f)
+			{
+				for(unsigned int c = 0; c < channels; ++c)
+				{
+					frame[c] = *(samples++) * scale;
+				}
+				
+				add_frame();
+			}
+		}
+		
+		loudness_stats stats() const;
+	
+	private:
+		/* Second order IIR filter, used in pairs to K-weight the input. */
+		struct biquad
+		{
+			double b0, b1, b2, a1, a2;
+		};
+		
+		struct channel_state
+		{
+			/* Last two inputs and outputs of each K-weighting stage. */
+			double x1[2], x2[2], y1[2], y2[2];
+			
+			/* Recent input samples for true peak interpolation. */
+			double history[TRUE_PEAK_TAPS * 2];
+			size_t history_pos;
+			
+			channel_state();
+		};
+		
+		unsigned int channels;
+		
+		biquad k_filter[2];
+		std::vector<channel_state> state;
+		
+		/* Frame being added. */
+		std::vector<double> frame;
+		
+		/* Mean square of the K-weighted input is summed over 100ms
+		 * sub-blocks, which are combined into the overlapping 400ms
+		 * and 3s blocks used by the gating.
+		*/
+		size_t sub_block_frames;
+		size_t sub_block_pos;
+		double sub_block_sum;
+		
+		std::vector<double> recent_sub_blocks;
+		size_t sub_blocks;
+		
+		std::vector<double> momentary_blocks;
+		std::vector<double> short_term_blocks;
+		
+		double peak;
+		
+		/* Largest possible gain of the interpolator. */
+		double true_peak_gain;
+		
+		void add_frame();
+		void end_sub_block();
+		
+		double filter_sample(channel_state &cs, double x);
+		double true_peak_sample(channel_state &cs, double x);
+};
+
+#endif /* !AREC_LOUDNESS_HPP */
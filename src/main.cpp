@@ -745,6 +745,64 @@ INT_PTR CALLBACK options_dproc(HWND hwnd, UINT msg, WPARAM wp, LPARAM lp)
 		case WM_INITDIALOG:
 		{
 			SetWindowText(GetDlgItem(hwnd, MAX_ENC_THREADS), to_string(config.max_enc_threads).c_str());
+			SetWindowText(GetDlgItem(hwnd, DECODE_THREADS), to_string(config.decode_threads).c_str());
+			SetWindowText(GetDlgItem(hwnd, ENCODE_SEGMENTS), to_string(config.encode_segments).c_str());
+			checkbox_set(GetDlgItem(hwnd, PIPE_AUDIO), config.pipe_audio);
+			checkbox_set(GetDlgItem(hwnd, ENCODE_DURING_CAPTURE), config.encode_during_capture);
+			checkbox_set(GetDlgItem(hwnd, COLLAPSE_STATIC_FRAMES), config.collapse_static_frames);
+			SetWindowText(GetDlgItem(hwnd, CAPTURE_INSTANCES), to_string(config.capture_instances).c_str());
+			SetWindowText(GetDlgItem(hwnd, RECOMPRESS_THREADS), to_string(config.recompress_threads).c_str());
+			
+			HWND bus_list = GetDlgItem(hwnd, MIX_BUS);
+			
+			for(unsigned int i = 0; mix_buses[i]; i++)
+			{
+				ComboBox_AddString(bus_list, mix_buses[i]);
+			}
+			
+			ComboBox_SetCurSel(bus_list, config.mix_bus);
+			set_combo_height(bus_list);
+			
+			HWND wav_list = GetDlgItem(hwnd, WAV_FORMAT);
+			
+			for(unsigned int i = 0; wav_formats[i].name; i++)
+			{
+				ComboBox_AddString(wav_list, wav_formats[i].name);
+			}
+			
+			ComboBox_SetCurSel(wav_list, config.wav_format);
+			set_combo_height(wav_list);
+			
+			HWND rate_list = GetDlgItem(hwnd, AUDIO_RATE);
+			
+			for(unsigned int i = 0; sample_rates[i]; i++)
+			{
+				ComboBox_AddString(rate_list, std::string(to_string(sample_rates[i]) + " Hz").c_str());
+				
+				if(sample_rates[i] == config.audio_rate)
+				{
+					ComboBox_SetCurSel(rate_list, i);
+				}
+			}
+			
+			set_combo_height(rate_list);
+			
+			checkbox_set(GetDlgItem(hwnd, AUDIO_STEMS), config.audio_stems);
+			checkbox_set(GetDlgItem(hwnd, NORMALISE_LOUDNESS), config.normalise_loudness);
+			
+			HWND extra_list = GetDlgItem(hwnd, EXTRA_VIDEO_FORMAT);
+			
+			for(unsigned int i = 0; video_formats[i].name; i++)
+			{
+				ComboBox_AddString(extra_list, video_formats[i].name);
+			}
+			
+			ComboBox_SetCurSel(extra_list, config.extra_video_format);
+			set_combo_height(extra_list);
+			
+			SetWindowText(GetDlgItem(hwnd, EXTRA_RES_X), to_string(config.extra_width).c_str());
+			SetWindowText(GetDlgItem(hwnd, EXTRA_RES_Y), to_string(config.extra_height).c_str());
+			
 			return TRUE;
 		}
 		
@@ -763,6 +821,70 @@ INT_PTR CALLBACK options_dproc(HWND hwnd, UINT msg, WPARAM wp, LPARAM lp)
 						break;
 					}
 					
+					try {
+						config.decode_threads = get_window_int(GetDlgItem(hwnd, DECODE_THREADS), 0);
+					}
+					catch(const bad_input &e)
+					{
+						MessageBox(hwnd, "Decoders must be an integer", NULL, MB_OK | MB_ICONERROR);
+						break;
+					}
+					
+					try {
+						config.encode_segments = get_window_int(GetDlgItem(hwnd, ENCODE_SEGMENTS), 0);
+					}
+					catch(const bad_input &e)
+					{
+						MessageBox(hwnd, "Segments must be an integer", NULL, MB_OK | MB_ICONERROR);
+						break;
+					}
+					
+					try {
+						config.capture_instances = get_window_int(GetDlgItem(hwnd, CAPTURE_INSTANCES), 0);
+					}
+					catch(const bad_input &e)
+					{
+						MessageBox(hwnd, "WA instances must be an integer", NULL, MB_OK | MB_ICONERROR);
+						break;
+					}
+					
+					try {
+						config.recompress_threads = get_window_int(GetDlgItem(hwnd, RECOMPRESS_THREADS), 0);
+					}
+					catch(const bad_input &e)
+					{
+						MessageBox(hwnd, "Recompressors must be an integer", NULL, MB_OK | MB_ICONERROR);
+						break;
+					}
+					
+					try {
+						config.extra_width  = get_window_int(GetDlgItem(hwnd, EXTRA_RES_X), 0);
+						config.extra_height = get_window_int(GetDlgItem(hwnd, EXTRA_RES_Y), 0);
+						
+						if(!config.extra_width != !config.extra_height)
+						{
+							throw bad_input();
+						}
+					}
+					catch(const bad_input &e)
+					{
+						MessageBox(hwnd, "Second video size must be a width and height, or zero to keep the capture size", NULL, MB_OK | MB_ICONERROR);
+						break;
+					}
+					
+					config.extra_video_format = ComboBox_GetCurSel(GetDlgItem(hwnd, EXTRA_VIDEO_FORMAT));
+					
+					config.pipe_audio            = checkbox_get(GetDlgItem(hwnd, PIPE_AUDIO));
+					config.encode_during_capture = checkbox_get(GetDlgItem(hwnd, ENCODE_DURING_CAPTURE));
+					config.collapse_static_frames = checkbox_get(GetDlgItem(hwnd, COLLAPSE_STATIC_FRAMES));
+					
+					config.mix_bus    = ComboBox_GetCurSel(GetDlgItem(hwnd, MIX_BUS));
+					config.wav_format = ComboBox_GetCurSel(GetDlgItem(hwnd, WAV_FORMAT));
+					config.audio_rate = sample_rates[ComboBox_GetCurSel(GetDlgItem(hwnd, AUDIO_RATE))];
+					
+					config.audio_stems        = checkbox_get(GetDlgItem(hwnd, AUDIO_STEMS));
+					config.normalise_loudness = checkbox_get(GetDlgItem(hwnd, NORMALISE_LOUDNESS));
+					
 					EndDialog(hwnd, 1);
 				}
 				else if(LOWORD(wp) == IDCANCEL)
@@ -830,6 +952,17 @@ int main(int argc, char **argv)
 	config.frame_rate = reg.get_dword("frame_rate", 50);
 	
 	config.max_enc_threads = reg.get_dword("max_enc_threads", 0);
+	config.decode_threads = reg.get_dword("decode_threads", 0);
+	config.pipe_audio = reg.get_dword("pipe_audio", false);
+	config.encode_during_capture = reg.get_dword("encode_during_capture", false);
+	config.encode_segments = reg.get_dword("encode_segments", 1);
+	config.collapse_static_frames = reg.get_dword("collapse_static_frames", false);
+	config.capture_instances = reg.get_dword("capture_instances", 1);
+	config.recompress_threads = reg.get_dword("recompress_threads", 0);
+	
+	config.extra_video_format = std::max(get_ffmpeg_index(video_formats, reg.get_string("extra_encoder", "None")), 0);
+	config.extra_width = reg.get_dword("extra_res_x", 0);
+	config.extra_height = reg.get_dword("extra_res_y", 0);
 	
 	config.wa_detail_level = reg.get_dword("wa_detail_level", 0);
 	config.wa_chat_behaviour = reg.get_dword("wa_chat_behaviour", 0);
@@ -844,6 +977,34 @@ int main(int argc, char **argv)
 	config.fix_clipping = reg.get_dword("fix_clipping", true);
 	config.min_vol      = reg.get_dword("min_vol", 40);
 	
+	config.audio_rate = reg.get_dword("audio_rate", 44100);
+	
+	/* The list ends with a zero, which mustn't be taken for a valid
+	 * rate if the registry holds one.
+	*/
+	
+	bool valid_rate = false;
+	
+	for(unsigned int i = 0; sample_rates[i]; i++)
+	{
+		if(sample_rates[i] == config.audio_rate)
+		{
+			valid_rate = true;
+			break;
+		}
+	}
+	
+	if(!valid_rate)
+	{
+		config.audio_rate = sample_rates[0];
+	}
+	
+	config.mix_bus    = std::min(reg.get_dword("mix_bus", MIX_BUS_INT32), (DWORD)(MIX_BUS_FLOAT));
+	config.wav_format = std::max(get_wav_format_index(reg.get_string("wav_format")), 0);
+	
+	config.audio_stems        = reg.get_dword("audio_stems", false);
+	config.normalise_loudness = reg.get_dword("normalise_loudness", false);
+	
 	config.replay_dir = reg.get_string("replay_dir");
 	config.video_dir = reg.get_string("video_dir");
 	
@@ -858,6 +1019,17 @@ int main(int argc, char **argv)
 		reg.set_dword("frame_rate", config.frame_rate);
 		
 		reg.set_dword("max_enc_threads", config.max_enc_threads);
+		reg.set_dword("decode_threads", config.decode_threads);
+		reg.set_dword("pipe_audio", config.pipe_audio);
+		reg.set_dword("encode_during_capture", config.encode_during_capture);
+		reg.set_dword("encode_segments", config.encode_segments);
+		reg.set_dword("collapse_static_frames", config.collapse_static_frames);
+		reg.set_dword("capture_instances", config.capture_instances);
+		reg.set_dword("recompress_threads", config.recompress_threads);
+		
+		reg.set_string("extra_encoder", video_formats[config.extra_video_format].name);
+		reg.set_dword("extra_res_x", config.extra_width);
+		reg.set_dword("extra_res_y", config.extra_height);
 		
 		reg.set_dword("wa_detail_level", config.wa_detail_level);
 		reg.set_dword("wa_chat_behaviour", config.wa_chat_behaviour);
@@ -872,6 +1044,14 @@ int main(int argc, char **argv)
 		reg.set_dword("fix_clipping", config.fix_clipping);
 		reg.set_dword("min_vol", config.min_vol);
 		
+		reg.set_dword("audio_rate", config.audio_rate);
+		
+		reg.set_dword("mix_bus", config.mix_bus);
+		reg.set_string("wav_format", wav_formats[config.wav_format].name);
+		
+		reg.set_dword("audio_stems", config.audio_stems);
+		reg.set_dword("normalise_loudness", config.normalise_loudness);
+		
 		reg.set_string("replay_dir", config.replay_dir);
 		reg.set_string("video_dir", config.video_dir);
 		
@@ -68,6 +68,33 @@ struct arec_config {
 	
 	unsigned int max_enc_threads;
 	
+	/* Threads decoding the frames for ffmpeg, zero to let ffmpeg read them */
+	unsigned int decode_threads;
+	
+	/* Stream the audio into ffmpeg rather than writing arec_audio.wav */
+	bool pipe_audio;
+	
+	/* Encode the frames as WA writes them rather than after capturing */
+	bool encode_during_capture;
+	
+	/* Split the video into this many segments to encode in parallel */
+	unsigned int encode_segments;
+	
+	/* Encode runs of identical frames as one frame shown for longer */
+	bool collapse_static_frames;
+	
+	/* WA instances capturing parts of the replay at once */
+	unsigned int capture_instances;
+	
+	/* Threads compressing the frames again while capturing, zero for none */
+	unsigned int recompress_threads;
+	
+	/* Second video encoded from the same frames, and the size to scale it
+	 * to or zero to leave it at the capture size.
+	*/
+	unsigned int extra_video_format;
+	unsigned int extra_width, extra_height;
+	
 	unsigned int wa_detail_level;
 	unsigned int wa_chat_behaviour;
 	bool wa_lock_camera;
@@ -84,6 +111,17 @@ struct arec_config {
 	
 	bool fix_clipping;
 	int min_vol;
+	
+	unsigned int audio_rate;
+	
+	unsigned int mix_bus;
+	unsigned int wav_format;
+	
+	/* Write the music and sound effects to their own WAV files too */
+	bool audio_stems;
+	
+	/* Set the volume from the EBU R128 loudness rather than init_vol */
+	bool normalise_loudness;
 };
 
 extern arec_config config;
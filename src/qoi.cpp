@@ -0,0 +1,260 @@
+/* Armageddon Recorder - QOI image encoder and decoder
+ * Copyright (C) 2013 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "qoi.hpp"
+
+#define QOI_OP_INDEX 0x00
+#define QOI_OP_DIFF  0x40
+#define QOI_OP_LUMA  0x80
+#define QOI_OP_RUN   0xC0
+#define QOI_OP_RGB   0xFE
+#define QOI_OP_RGBA  0xFF
+
+#define QOI_OP_MASK  0xC0
+
+#define QOI_HEADER_SIZE 14
+#define QOI_MAX_RUN     62
+
+static const unsigned char qoi_end[] = { 0, 0, 0, 0, 0, 0, 0, 1 };
+
+struct qoi_pixel
+{
+	unsigned char r, g, b, a;
+	
+	bool operator==(const qoi_pixel &rhs) const
+	{
+		return r == rhs.r && g == rhs.g && b == rhs.b && a == rhs.a;
+	}
+};
+
+static unsigned int qoi_hash(const qoi_pixel &p)
+{
+	return (p.r * 3 + p.g * 5 + p.b * 7 + p.a * 11) % 64;
+}
+
+static void put_u32(std::vector<unsigned char> &out, uint32_t value)
+{
+	out.push_back(value >> 24);
+	out.push_back(value >> 16);
+	out.push_back(value >> 8);
+	out.push_back(value);
+}
+
+static uint32_t get_u32(const unsigned char *p)
+{
+	return ((uint32_t)(p[0]) << 24) | ((uint32_t)(p[1]) << 16) | ((uint32_t)(p[2]) << 8) | p[3];
+}
+
+void qoi_encode(const unsigned char *bgr, unsigned int width, unsigned int height, std::vector<unsigned char> &out)
+{
+	size_t pixels = (size_t)(width) * height;
+	
+	/* Enough for the header, the end marker and every pixel as an
+	 * QOI_OP_RGB, so nothing is ever reallocated.
+	*/
+	
+	out.clear();
+	out.reserve(QOI_HEADER_SIZE + pixels * 4 + sizeof(qoi_end));
+	
+	out.push_back('q');
+	out.push_back('o');
+	out.push_back('i');
+	out.push_back('f');
+	
+	put_u32(out, width);
+	put_u32(out, height);
+	
+	out.push_back(3);	/* Channels */
+	out.push_back(0);	/* sRGB with linear alpha */
+	
+	qoi_pixel index[64];
+	memset(index, 0, sizeof(index));
+	
+	qoi_pixel prev = { 0, 0, 0, 255 };
+	unsigned int run = 0;
+	
+	for(size_t i = 0; i < pixels; ++i, bgr += 3)
+	{
+		qoi_pixel px = { bgr[2], bgr[1], bgr[0], 255 };
+		
+		if(px == prev)
+		{
+			if(++run == QOI_MAX_RUN || i + 1 == pixels)
+			{
+				out.push_back(QOI_OP_RUN | (run - 1));
+				run = 0;
+			}
+			
+			continue;
+		}
+		
+		if(run > 0)
+		{
+			out.push_back(QOI_OP_RUN | (run - 1));
+			run = 0;
+		}
+		
+		unsigned int hash = qoi_hash(px);
+		
+		if(index[hash] == px)
+		{
+			out.push_back(QOI_OP_INDEX | hash);
+		}
+		else{
+			index[hash] = px;
+			
+			signed char vr = px.r - prev.r;
+			signed char vg = px.g - prev.g;
+			signed char vb = px.b - prev.b;
+			
+			signed char vg_r = vr - vg;
+			signed char vg_b = vb - vg;
+			
+			if(vr >= -2 && vr <= 1 && vg >= -2 && vg <= 1 && vb >= -2 && vb <= 1)
+			{
+				out.push_back(QOI_OP_DIFF | (vr + 2) << 4 | (vg + 2) << 2 | (vb + 2));
+			}
+			else if(vg_r >= -8 && vg_r <= 7 && vg >= -32 && vg <= 31 && vg_b >= -8 && vg_b <= 7)
+			{
+				out.push_back(QOI_OP_LUMA | (vg + 32));
+				out.push_back((vg_r + 8) << 4 | (vg_b + 8));
+			}
+			else{
+				out.push_back(QOI_OP_RGB);
+				out.push_back(px.r);
+				out.push_back(px.g);
+				out.push_back(px.b);
+			}
+		}
+		
+		prev = px;
+	}
+	
+	out.insert(out.end(), qoi_end, qoi_end + sizeof(qoi_end));
+}
+
+bool qoi_decode(const unsigned char *data, size_t size, unsigned int width, unsigned int height,
+	unsigned char *bgr, std::string &error)
+{
+	if(size < QOI_HEADER_SIZE + sizeof(qoi_end) || memcmp(data, "qoif", 4) != 0)
+	{
+		error = "Not a QOI image";
+		return false;
+	}
+	
+	if(get_u32(data + 4) != width || get_u32(data + 8) != height)
+	{
+		char msg[128];
+		snprintf(msg, sizeof(msg), "Frame is %ux%u, expected %ux%u",
+			(unsigned int)(get_u32(data + 4)), (unsigned int)(get_u32(data + 8)), width, height);
+		
+		error = msg;
+		return false;
+	}
+	
+	/* The end marker is never read as pixels, so only the position has to
+	 * be checked against end before each op is read.
+	*/
+	
+	const unsigned char *p   = data + QOI_HEADER_SIZE;
+	const unsigned char *end = data + size - sizeof(qoi_end);
+	
+	size_t pixels = (size_t)(width) * height;
+	
+	qoi_pixel index[64];
+	memset(index, 0, sizeof(index));
+	
+	qoi_pixel px = { 0, 0, 0, 255 };
+	unsigned int run = 0;
+	
+	for(size_t i = 0; i < pixels; ++i, bgr += 3)
+	{
+		if(run > 0)
+		{
+			--run;
+		}
+		else if(p >= end)
+		{
+			error = "QOI image is truncated";
+			return false;
+		}
+		else{
+			unsigned char op = *(p++);
+			
+			/* Every op but QOI_OP_INDEX and QOI_OP_DIFF needs more
+			 * bytes, which all have to be before the end marker.
+			*/
+			
+			size_t need = (op == QOI_OP_RGBA) ? 4 : (op == QOI_OP_RGB) ? 3 : ((op & QOI_OP_MASK) == QOI_OP_LUMA) ? 1 : 0;
+			
+			if((size_t)(end - p) < need)
+			{
+				error = "QOI image is truncated";
+				return false;
+			}
+			
+			if(op == QOI_OP_RGB)
+			{
+				px.r = p[0];
+				px.g = p[1];
+				px.b = p[2];
+			}
+			else if(op == QOI_OP_RGBA)
+			{
+				px.r = p[0];
+				px.g = p[1];
+				px.b = p[2];
+				px.a = p[3];
+			}
+			else if((op & QOI_OP_MASK) == QOI_OP_INDEX)
+			{
+				px = index[op];
+			}
+			else if((op & QOI_OP_MASK) == QOI_OP_DIFF)
+			{
+				px.r += ((op >> 4) & 0x03) - 2;
+				px.g += ((op >> 2) & 0x03) - 2;
+				px.b += (op & 0x03) - 2;
+			}
+			else if((op & QOI_OP_MASK) == QOI_OP_LUMA)
+			{
+				int vg = (op & 0x3F) - 32;
+				
+				px.r += vg - 8 + ((p[0] >> 4) & 0x0F);
+				px.g += vg;
+				px.b += vg - 8 + (p[0] & 0x0F);
+			}
+			else{
+				run = op & 0x3F;
+			}
+			
+			p += need;
+			
+			index[qoi_hash(px)] = px;
+		}
+		
+		bgr[0] = px.b;
+		bgr[1] = px.g;
+		bgr[2] = px.r;
+	}
+	
+	return true;
+}
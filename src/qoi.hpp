@@ -0,0 +1,41 @@
+/* Armageddon Recorder - QOI image encoder and decoder
+ * Copyright (C) 2013 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef AREC_QOI_HPP
+#define AREC_QOI_HPP
+
+#include <stddef.h>
+#include <string>
+#include <vector>
+
+/* Frames are stored as 3 channel sRGB QOI images, which decode several times
+ * faster than PNG. Pixels are passed in and out as packed 24-bit BGR, the same
+ * as frame_decoder hands them to ffmpeg.
+ *
+ * See https://qoiformat.org/qoi-specification.pdf
+*/
+
+/* Encode a width x height image, replacing the contents of out. */
+void qoi_encode(const unsigned char *bgr, unsigned int width, unsigned int height, std::vector<unsigned char> &out);
+
+/* Decode an image which must be width x height into bgr. Returns false with
+ * error set if it is a different size, or isn't a valid QOI image.
+*/
+bool qoi_decode(const unsigned char *data, size_t size, unsigned int width, unsigned int height,
+	unsigned char *bgr, std::string &error);
+
+#endif /* !AREC_QOI_HPP */
@@ -0,0 +1,246 @@
+/* Armageddon Recorder - Command line audio renderer
+ * Copyright (C) 2013 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <string>
+#include <sndfile.h>
+
+#include "audio.hpp"
+
+struct stderr_listener: public audio_render_listener
+{
+	virtual void log(const std::string &msg)
+	{
+		fprintf(stderr, "%s\n", msg.c_str());
+	}
+};
+
+static void usage(const char *argv0)
+{
+	fprintf(stderr, "Usage: %s [options] <log path> <output WAV>\n", argv0);
+	fprintf(stderr, "\n");
+	fprintf(stderr, "  -r <rate>     Frame rate the log was captured at (default 50)\n");
+	fprintf(stderr, "  -s <rate>     Output sample rate (default 44100)\n");
+	fprintf(stderr, "  -b <bus>      Mix bus, int32 or float (default int32)\n");
+	fprintf(stderr, "  -f <format>   Output format, 16, 24 or float (default 16)\n");
+	fprintf(stderr, "  -v <volume>   Volume in percent (default 100)\n");
+	fprintf(stderr, "  -m <volume>   Minimum volume when fixing clipping (default 40)\n");
+	fprintf(stderr, "  -c            Don't reduce the volume to fix clipping\n");
+	fprintf(stderr, "  -L <LUFS>     Normalise the integrated loudness to LUFS instead of\n");
+	fprintf(stderr, "                using a fixed volume, e.g. -23 for EBU R128\n");
+	fprintf(stderr, "  -T <dBTP>     Highest true peak allowed when normalising (default -1)\n");
+	fprintf(stderr, "  -n <frames>   Number of frames captured, if known\n");
+	fprintf(stderr, "  -a <frames>   Only search for background music this far ahead of the\n");
+	fprintf(stderr, "                mix, as when mixing during a capture\n");
+	fprintf(stderr, "  -S <path>     Cache the mix in path, or reuse it if it is up to date\n");
+	fprintf(stderr, "  -M <path>     Also write the background music alone to a WAV file\n");
+	fprintf(stderr, "  -E <path>     Also write the sound effects alone to a WAV file\n");
+}
+
+/* Parse an unsigned integer option, exiting with an error if it isn't one or
+ * falls outside of min and max.
+*/
+static unsigned int get_opt_uint(char opt, const char *arg, unsigned int min, unsigned int max)
+{
+	char *end;
+	
+	errno = 0;
+	unsigned long value = strtoul(arg, &end, 10);
+	
+	if(*arg == '\0' || *end != '\0' || errno != 0 || value < min || value > max)
+	{
+		fprintf(stderr, "Invalid value for -%c: %s\n", opt, arg);
+		exit(1);
+	}
+	
+	return value;
+}
+
+static double get_opt_double(char opt, const char *arg, double min, double max)
+{
+	char *end;
+	
+	errno = 0;
+	double value = strtod(arg, &end);
+	
+	if(*arg == '\0' || *end != '\0' || errno != 0 || value < min || value > max)
+	{
+		fprintf(stderr, "Invalid value for -%c: %s\n", opt, arg);
+		exit(1);
+	}
+	
+	return value;
+}
+
+int main(int argc, char **argv)
+{
+	audio_render_options options;
+	
+	const char *music_path   = NULL;
+	const char *effects_path = NULL;
+	
+	int opt;
+	while((opt = getopt(argc, argv, "r:s:b:f:v:m:cL:T:n:a:S:M:E:")) != -1)
+	{
+		switch(opt)
+		{
+			case 'r':
+				options.frame_rate = get_opt_uint(opt, optarg, 1, 1000);
+				break;
+			
+			case 's':
+				options.sample_rate = get_opt_uint(opt, optarg, 1000, 384000);
+				break;
+			
+			case 'b':
+			{
+				if(strcmp(optarg, "int32") == 0)
+				{
+					options.mix_bus = MIX_BUS_INT32;
+				}
+				else if(strcmp(optarg, "float") == 0)
+				{
+					options.mix_bus = MIX_BUS_FLOAT;
+				}
+				else{
+					fprintf(stderr, "Unknown mix bus: %s\n", optarg);
+					return 1;
+				}
+				
+				break;
+			}
+			
+			case 'f':
+			{
+				if(strcmp(optarg, "16") == 0)
+				{
+					options.format = SF_FORMAT_PCM_16;
+				}
+				else if(strcmp(optarg, "24") == 0)
+				{
+					options.format = SF_FORMAT_PCM_24;
+				}
+				else if(strcmp(optarg, "float") == 0)
+				{
+					options.format = SF_FORMAT_FLOAT;
+				}
+				else{
+					fprintf(stderr, "Unknown output format: %s\n", optarg);
+					return 1;
+				}
+				
+				break;
+			}
+			
+			case 'v':
+				options.init_vol = get_opt_uint(opt, optarg, 0, 100);
+				break;
+			
+			case 'm':
+				options.min_vol = get_opt_uint(opt, optarg, 0, 100);
+				break;
+			
+			case 'c':
+				options.fix_clipping = false;
+				break;
+			
+			case 'L':
+				options.normalise   = true;
+				options.target_lufs = get_opt_double(opt, optarg, -70, 0);
+				break;
+			
+			case 'T':
+				options.max_true_peak = get_opt_double(opt, optarg, -70, 0);
+				break;
+			
+			case 'n':
+				options.frame_count = get_opt_uint(opt, optarg, 0, 0xFFFFFFFF);
+				break;
+			
+			case 'a':
+				options.scan_ahead = get_opt_uint(opt, optarg, 0, 0xFFFFFF);
+				break;
+			
+			case 'S':
+				options.stem_path = optarg;
+				break;
+			
+			case 'M':
+				music_path = optarg;
+				break;
+			
+			case 'E':
+				effects_path = optarg;
+				break;
+			
+			default:
+				usage(argv[0]);
+				return 1;
+		}
+	}
+	
+	if(argc - optind != 2)
+	{
+		usage(argv[0]);
+		return 1;
+	}
+	
+	if(options.sample_rate < options.frame_rate)
+	{
+		fprintf(stderr, "The sample rate must be at least the frame rate\n");
+		return 1;
+	}
+	
+	const char *log_path = argv[optind];
+	const char *wav_path = argv[optind + 1];
+	
+	FILE *log = fopen(log_path, "rb");
+	if(!log)
+	{
+		fprintf(stderr, "Could not open %s: %s\n", log_path, strerror(errno));
+		return 1;
+	}
+	
+	audio_log_file log_source(log);
+	audio_wav_output output(wav_path);
+	stderr_listener listener;
+	
+	audio_wav_output music(music_path ? music_path : "");
+	audio_wav_output effects(effects_path ? effects_path : "");
+	
+	audio_renderer renderer(options, log_source, output, listener);
+	
+	if(music_path)
+	{
+		renderer.set_stem_output(STEM_MUSIC, &music);
+	}
+	
+	if(effects_path)
+	{
+		renderer.set_stem_output(STEM_EFFECTS, &effects);
+	}
+	
+	bool ok = renderer.render();
+	
+	fclose(log);
+	
+	return ok ? 0 : 1;
+}
@@ -38,8 +38,31 @@
 #include <limits>
 #include <algorithm>
 #include <stdexcept>
+#include <thread>
 
-template <typename InSample, typename OutSample, typename InputIterator> std::vector<OutSample> pcm_resample(const InputIterator begin, const InputIterator end, unsigned int channels, unsigned int rate_in, unsigned int rate_out)
+/* Returns the number of frames pcm_resample() will produce from in_samples
+ * samples of input.
+*/
+inline size_t pcm_resample_frames(size_t in_samples, unsigned int channels, unsigned int rate_in, unsigned int rate_out)
+{
+	if((in_samples % channels) != 0)
+	{
+		throw std::invalid_argument("number of samples must be a multiple of channels");
+	}
+	
+	size_t out_samples = in_samples * ((double)(rate_out) / rate_in);
+	
+	return out_samples / channels;
+}
+
+/* Write frames first_frame to first_frame + num_frames of the output which
+ * pcm_resample() would produce to out and return the advanced iterator.
+ *
+ * Each output frame is calculated independently from the input, so the full
+ * output may be produced in pieces (or out of order) and will be identical to
+ * what pcm_resample() returns in one go.
+*/
+template <typename InSample, typename OutSample, typename InputIterator, typename OutputIterator> OutputIterator pcm_resample_range(const InputIterator begin, const InputIterator end, unsigned int channels, unsigned int rate_in, unsigned int rate_out, size_t first_frame, size_t num_frames, OutputIterator out)
 {
 	/* Determine the values used for silence in the sample types. */
 	
@@ -63,50 +86,44 @@ template <typename InSample, typename OutSample, typename InputIterator> std::ve
 		? (std::numeric_limits<OutSample>::max() - out_zero)
 		: 1.0;
 	
-	/* Determine the number of input/output samples and frames. */
-	
-	size_t in_samples  = end - begin;
-	size_t out_samples = in_samples * ((double)(rate_out) / rate_in);
+	const double ratio = (double)(rate_out) / rate_in;
 	
-	size_t in_frames  = in_samples / channels;
-	size_t out_frames = out_samples / channels;
+	size_t in_frames  = (end - begin) / channels;
+	size_t out_frames = pcm_resample_frames(end - begin, channels, rate_in, rate_out);
 	
-	if((in_samples % channels) != 0)
+	if(first_frame + num_frames > out_frames)
 	{
-		throw std::invalid_argument("number of samples must be a multiple of channels");
+		throw std::out_of_range("requested frames are past the end of the output");
 	}
 	
-	/* Fill the out vector with resampled samples. We iterate and address
-	 * the input samples by frame/channel rather than sample to ensure any
+	/* Fill the output with resampled samples. We iterate and address the
+	 * input samples by frame/channel rather than sample to ensure any
 	 * rounding errors cannot cause samples to slip between channels.
 	*/
 	
-	std::vector<OutSample> out;
-	out.reserve(out_samples);
-	
-	for(size_t f = 0; f < out_frames; ++f)
+	for(size_t f = first_frame; f < first_frame + num_frames; ++f)
 	{
+		/* Calculate our position in the input buffer. */
+		
+		double in_frame = f / ratio;
+		
+		/* Get the frames from the input to contribute to this frame
+		 * in the output.
+		 *
+		 * If rate_in is a multiple of rate_out, each sample in
+		 * the output will fall directly on one in the input and
+		 * if1/if2 will have the same value.
+		 *
+		 * Resampling may create a frame which exists beyond the
+		 * end of the input, for this case if1/if2 are clamped
+		 * to the last frame of the input, extending it.
+		*/
+		
+		size_t if1 = std::min((size_t)(floor(in_frame)), in_frames - 1);
+		size_t if2 = std::min((size_t)(ceil(in_frame)), in_frames - 1);
+		
 		for(unsigned int c = 0; c < channels; ++c)
 		{
-			/* Calculate our position in the input buffer. */
-			
-			double in_frame = f / ((double)(rate_out) / rate_in);
-			
-			/* Get the samples from the input to contribute to this
-			 * sample in the output.
-			 *
-			 * If rate_in is a multiple of rate_out, each sample in
-			 * the output will fall directly on one in the input and
-			 * if1/if2 will have the same value.
-			 *
-			 * Resampling may create a frame which exists beyond the
-			 * end of the input, for this case if1/if2 are clamped
-			 * to the last frame of the input, extending it.
-			*/
-			
-			size_t if1 = std::min((size_t)(floor(in_frame)), in_frames - 1);
-			size_t if2 = std::min((size_t)(ceil(in_frame)), in_frames - 1);
-			
 			InSample is1 = *(begin + ((channels * if1) + c));
 			InSample is2 = *(begin + ((channels * if2) + c));
 			
@@ -120,15 +137,91 @@ template <typename InSample, typename OutSample, typename InputIterator> std::ve
 			InSample isc = is1 - ((is1 - is2) * (in_frame - if1));
 			
 			/* Convert the input sample to the output format and
-			 * push it onto the output sample buffer.
+			 * write it to the output.
 			*/
 			
 			long double cs = isc - in_zero;
 			
 			cs *= (double)(out_peak) / in_peak;
 			
-			out.push_back((OutSample)(cs) + out_zero);
+			*out++ = (OutSample)(cs) + out_zero;
+		}
+	}
+	
+	return out;
+}
+
+template <typename InSample, typename OutSample, typename InputIterator> std::vector<OutSample> pcm_resample(const InputIterator begin, const InputIterator end, unsigned int channels, unsigned int rate_in, unsigned int rate_out)
+{
+	size_t out_frames = pcm_resample_frames(end - begin, channels, rate_in, rate_out);
+	
+	std::vector<OutSample> out(out_frames * channels);
+	
+	if(out_frames > 0)
+	{
+		pcm_resample_range<InSample, OutSample>(begin, end, channels, rate_in, rate_out, 0, out_frames, out.begin());
+	}
+	
+	return out;
+}
+
+/* Inputs shorter than this many output frames are not worth splitting
+ * between threads.
+*/
+#define PCM_RESAMPLE_PARALLEL_MIN 262144
+
+/* Same as pcm_resample(), but large inputs are split into ranges of output
+ * frames which are resampled on up to max_threads threads at once.
+ *
+ * If max_threads is zero, one thread per CPU is used. The output is identical
+ * to that of pcm_resample().
+*/
+template <typename InSample, typename OutSample, typename InputIterator> std::vector<OutSample> pcm_resample_parallel(const InputIterator begin, const InputIterator end, unsigned int channels, unsigned int rate_in, unsigned int rate_out, unsigned int max_threads = 0)
+{
+	size_t out_frames = pcm_resample_frames(end - begin, channels, rate_in, rate_out);
+	
+	if(max_threads == 0)
+	{
+		max_threads = std::max(std::thread::hardware_concurrency(), 1U);
+	}
+	
+	size_t n_threads = std::min((size_t)(max_threads), out_frames / PCM_RESAMPLE_PARALLEL_MIN);
+	
+	if(n_threads < 2)
+	{
+		return pcm_resample<InSample, OutSample>(begin, end, channels, rate_in, rate_out);
+	}
+	
+	std::vector<OutSample> out(out_frames * channels);
+	
+	/* Each thread gets a contiguous range of the output. The calling
+	 * thread does the last range itself.
+	*/
+	
+	size_t chunk_frames = (out_frames + n_threads - 1) / n_threads;
+	
+	std::vector<std::thread> threads;
+	
+	for(size_t first = 0; first < out_frames; first += chunk_frames)
+	{
+		size_t num = std::min(chunk_frames, out_frames - first);
+		typename std::vector<OutSample>::iterator chunk_out = out.begin() + (first * channels);
+		
+		if(first + num < out_frames)
+		{
+			threads.push_back(std::thread([=]()
+			{
+				pcm_resample_range<InSample, OutSample>(begin, end, channels, rate_in, rate_out, first, num, chunk_out);
+			}));
 		}
+		else{
+			pcm_resample_range<InSample, OutSample>(begin, end, channels, rate_in, rate_out, first, num, chunk_out);
+		}
+	}
+	
+	for(auto t = threads.begin(); t != threads.end(); ++t)
+	{
+		t->join();
 	}
 	
 	return out;
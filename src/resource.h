@@ -36,3 +36,19 @@
 #define MIN_VOL_SLIDER                          40015
 #define MIN_VOL_EDIT                            40016
 #define FIX_CLIPPING                            40017
+#define MIX_BUS                                 40018
+#define WAV_FORMAT                              40019
+#define AUDIO_RATE                              40020
+#define AUDIO_STEMS                             40021
+#define NORMALISE_LOUDNESS                      40022
+#define PIPE_AUDIO                              40023
+#define ENCODE_DURING_CAPTURE                   40024
+#define DECODE_THREADS                          40025
+#define ENCODE_SEGMENTS                         40026
+#define CAPTURE_INSTANCES                       40027
+#define EXTRA_VIDEO_FORMAT                      40028
+#define EXTRA_RES_X                             40029
+#define EXTRA_RES_Y                             40030
+#define COLLAPSE_STATIC_FRAMES                  40031
+#define CAPTURE_STATUS                          40032
+#define RECOMPRESS_THREADS                      40033
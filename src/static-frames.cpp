@@ -0,0 +1,257 @@
+/* Armageddon Recorder - Static frame detection
+ * Copyright (C) 2013 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <windows.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <stdint.h>
+#include <vector>
+#include <algorithm>
+
+#include "static-frames.hpp"
+#include "capture.hpp"
+#include "main.hpp"
+
+/* WA writes identical frames to identical files, so the files are compared
+ * rather than the pixels and nothing has to be decoded.
+*/
+struct frame_hash
+{
+	uint64_t hash;
+	uint64_t size;
+	
+	/* errno from reading the frame, zero if it was hashed. */
+	int error;
+};
+
+struct hash_job
+{
+	std::string dir;
+	
+	std::vector<frame_hash> hashes;
+	
+	/* Next frame to be hashed by any worker. */
+	volatile LONG next;
+};
+
+static std::string frame_name(unsigned int frame)
+{
+	char name[32];
+	snprintf(name, sizeof(name), FRAME_PREFIX "%06u.png", frame);
+	
+	return name;
+}
+
+/* 64-bit FNV-1a of a file. */
+static bool hash_file(const std::string &path, frame_hash &fh)
+{
+	FILE *file = fopen(path.c_str(), "rb");
+	if(!file)
+	{
+		fh.error = errno;
+		return false;
+	}
+	
+	fh.hash = 14695981039346656037ULL;
+	fh.size = 0;
+	
+	unsigned char buf[64 * 1024];
+	size_t len;
+	
+	while((len = fread(buf, 1, sizeof(buf), file)) > 0)
+	{
+		for(size_t i = 0; i < len; ++i)
+		{
+			fh.hash = (fh.hash ^ buf[i]) * 1099511628211ULL;
+		}
+		
+		fh.size += len;
+	}
+	
+	fh.error = ferror(file) ? EIO : 0;
+	fclose(file);
+	
+	return fh.error == 0;
+}
+
+/* Compare the contents of two files, the hash only says they might match. */
+static bool same_file(const std::string &a_path, const std::string &b_path, bool &same, std::string &error)
+{
+	FILE *a = fopen(a_path.c_str(), "rb");
+	if(!a)
+	{
+		error = "Cannot open " + a_path + ": " + strerror(errno);
+		return false;
+	}
+	
+	FILE *b = fopen(b_path.c_str(), "rb");
+	if(!b)
+	{
+		error = "Cannot open " + b_path + ": " + strerror(errno);
+		
+		fclose(a);
+		return false;
+	}
+	
+	std::vector<unsigned char> a_buf(64 * 1024), b_buf(64 * 1024);
+	size_t a_len, b_len;
+	
+	same = true;
+	
+	do {
+		a_len = fread(&(a_buf[0]), 1, a_buf.size(), a);
+		b_len = fread(&(b_buf[0]), 1, b_buf.size(), b);
+		
+		if(a_len != b_len || memcmp(&(a_buf[0]), &(b_buf[0]), a_len) != 0)
+		{
+			same = false;
+		}
+	} while(same && a_len > 0);
+	
+	bool ok = !ferror(a) && !ferror(b);
+	
+	if(!ok)
+	{
+		error = "Cannot read " + std::string(ferror(a) ? a_path : b_path);
+	}
+	
+	fclose(a);
+	fclose(b);
+	
+	return ok;
+}
+
+static WINAPI DWORD hash_worker_main(LPVOID lpParameter)
+{
+	hash_job *job = (hash_job*)(lpParameter);
+	
+	LONG frame;
+	
+	while((frame = InterlockedIncrement(&(job->next)) - 1) < (LONG)(job->hashes.size()))
+	{
+		hash_file(job->dir + "\\" + frame_name(frame), job->hashes[frame]);
+	}
+	
+	return 0;
+}
+
+unsigned int collapse_static_frames(const std::string &dir, const std::string &list_path,
+	unsigned int frames, unsigned int frame_rate, unsigned int threads, bool keep, std::string &error)
+{
+	hash_job job;
+	
+	job.dir = dir;
+	job.hashes.resize(frames);
+	job.next = 0;
+	
+	std::vector<HANDLE> workers;
+	
+	for(unsigned int i = 0; i < std::max(threads, 1U); ++i)
+	{
+		HANDLE worker = CreateThread(NULL, 0, &hash_worker_main, &job, 0, NULL);
+		assert(worker);
+		
+		workers.push_back(worker);
+	}
+	
+	for(size_t i = 0; i < workers.size(); ++i)
+	{
+		WaitForSingleObject(workers[i], INFINITE);
+		CloseHandle(workers[i]);
+	}
+	
+	for(unsigned int i = 0; i < frames; ++i)
+	{
+		if(job.hashes[i].error)
+		{
+			error = "Cannot read " + frame_name(i) + ": " + strerror(job.hashes[i].error);
+			return 0;
+		}
+	}
+	
+	FILE *list = fopen(list_path.c_str(), "w");
+	if(!list)
+	{
+		error = "Cannot create " + list_path + ": " + strerror(errno);
+		return 0;
+	}
+	
+	unsigned int listed = 0;
+	
+	for(unsigned int first = 0, end; first < frames; first = end)
+	{
+		for(end = first + 1; end < frames
+			&& job.hashes[end].hash == job.hashes[first].hash
+			&& job.hashes[end].size == job.hashes[first].size; ++end)
+		{
+			std::string dup   = dir + "\\" + frame_name(end);
+			std::string frame = dir + "\\" + frame_name(first);
+			
+			/* Only a frame identical to the first of the run is
+			 * dropped, one which merely hashes the same starts the
+			 * next run.
+			*/
+			
+			bool same;
+			
+			if(!same_file(frame, dup, same, error))
+			{
+				fclose(list);
+				return 0;
+			}
+			
+			if(!same)
+			{
+				break;
+			}
+			
+			if(!DeleteFile(dup.c_str()) || (keep && !CreateHardLink(dup.c_str(), frame.c_str(), NULL)))
+			{
+				error = "Cannot replace " + frame_name(end) + ": " + w32_error(GetLastError());
+				
+				fclose(list);
+				return 0;
+			}
+		}
+		
+		/* The frames are named relative to the list, which ffmpeg
+		 * always considers safe.
+		*/
+		
+		fprintf(list, "file '%s'\nduration %.6f\n", frame_name(first).c_str(), (double)(end - first) / frame_rate);
+		++listed;
+		
+		/* The duration of the last file is only honoured if it isn't
+		 * the last one in the list.
+		*/
+		
+		if(end == frames)
+		{
+			fprintf(list, "file '%s'\n", frame_name(first).c_str());
+		}
+	}
+	
+	if(fclose(list) != 0)
+	{
+		error = "Cannot write " + list_path + ": " + strerror(errno);
+		return 0;
+	}
+	
+	return listed;
+}
@@ -0,0 +1,38 @@
+/* Armageddon Recorder - Static frame detection
+ * Copyright (C) 2013 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef AREC_STATIC_FRAMES_HPP
+#define AREC_STATIC_FRAMES_HPP
+
+#include <string>
+
+/* Find the runs of identical frames among the first frames frames in dir,
+ * hashing them on threads worker threads.
+ *
+ * A list for ffmpeg's concat demuxer is written to list_path which shows the
+ * first frame of each run for as long as the whole run lasts. The rest of each
+ * run are deleted, or replaced by hard links to its first frame if keep is
+ * true. Frames are only treated as identical if their contents match byte for
+ * byte, not just their hashes.
+ *
+ * Returns the number of frames left in the list, or zero with error set if
+ * something failed.
+*/
+unsigned int collapse_static_frames(const std::string &dir, const std::string &list_path,
+	unsigned int frames, unsigned int frame_rate, unsigned int threads, bool keep, std::string &error);
+
+#endif /* !AREC_STATIC_FRAMES_HPP */
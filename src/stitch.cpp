@@ -0,0 +1,150 @@
+/* Armageddon Recorder - Parallel capture stitching tool
+ * Copyright (C) 2013 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <string>
+
+#include "capture-segments.hpp"
+
+static void usage(const char *argv0)
+{
+	fprintf(stderr, "Usage: %s [options] -e <end time> <capture directory>\n", argv0);
+	fprintf(stderr, "\n");
+	fprintf(stderr, "Joins the frames and audio logs captured by several WA instances, each\n");
+	fprintf(stderr, "capturing one segment of a replay, back into a single capture.\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "  -r <rate>     Frame rate of the capture (default 50)\n");
+	fprintf(stderr, "  -s <time>     Replay time the capture starts at (default 0)\n");
+	fprintf(stderr, "  -e <time>     Replay time the capture ends at\n");
+	fprintf(stderr, "  -n <count>    Number of segments (default 2)\n");
+	fprintf(stderr, "  -l <seconds>  Lead in captured before each segment (default 5)\n");
+	fprintf(stderr, "  -p            Only print the segments, one per line, as the prefix,\n");
+	fprintf(stderr, "                start and end times passed to WA\n");
+}
+
+/* Parse an unsigned integer option, exiting with an error if it isn't one or
+ * falls outside of min and max.
+*/
+static unsigned int get_opt_uint(char opt, const char *arg, unsigned int min, unsigned int max)
+{
+	char *end;
+	
+	errno = 0;
+	unsigned long value = strtoul(arg, &end, 10);
+	
+	if(*arg == '\0' || *end != '\0' || errno != 0 || value < min || value > max)
+	{
+		fprintf(stderr, "Invalid value for -%c: %s\n", opt, arg);
+		exit(1);
+	}
+	
+	return value;
+}
+
+static uint64_t get_opt_time(char opt, const char *arg)
+{
+	uint64_t ms;
+	
+	if(!parse_replay_time(arg, ms))
+	{
+		fprintf(stderr, "Invalid value for -%c: %s\n", opt, arg);
+		exit(1);
+	}
+	
+	return ms;
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int frame_rate = 50;
+	unsigned int count      = 2;
+	unsigned int lead_in    = 5;
+	
+	uint64_t start_ms = 0, end_ms = 0;
+	bool have_end = false;
+	
+	bool print_only = false;
+	
+	int opt;
+	while((opt = getopt(argc, argv, "r:s:e:n:l:p")) != -1)
+	{
+		switch(opt)
+		{
+			case 'r':
+				frame_rate = get_opt_uint(opt, optarg, 1, 1000);
+				break;
+			
+			case 's':
+				start_ms = get_opt_time(opt, optarg);
+				break;
+			
+			case 'e':
+				end_ms   = get_opt_time(opt, optarg);
+				have_end = true;
+				break;
+			
+			case 'n':
+				count = get_opt_uint(opt, optarg, 1, 64);
+				break;
+			
+			case 'l':
+				lead_in = get_opt_uint(opt, optarg, 0, 3600);
+				break;
+			
+			case 'p':
+				print_only = true;
+				break;
+			
+			default:
+				usage(argv[0]);
+				return 1;
+		}
+	}
+	
+	if(argc - optind != 1 || !have_end)
+	{
+		usage(argv[0]);
+		return 1;
+	}
+	
+	std::string dir = argv[optind];
+	
+	std::vector<capture_segment> segments = plan_capture_segments(start_ms, end_ms, frame_rate, count, lead_in);
+	
+	if(print_only)
+	{
+		for(auto s = segments.begin(); s != segments.end(); ++s)
+		{
+			printf("%s %s %s\n", s->prefix.c_str(), s->start_time.c_str(), s->end_time.c_str());
+		}
+		
+		return 0;
+	}
+	
+	std::string error;
+	
+	if(!stitch_frames(dir, segments, error) || !stitch_audio_logs(dir, segments, frame_rate, error))
+	{
+		fprintf(stderr, "%s\n", error.c_str());
+		return 1;
+	}
+	
+	return 0;
+}
@@ -0,0 +1,392 @@
+/* Armageddon Recorder - Synthetic audio log generator
+ * Copyright (C) 2013 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <vector>
+#include <algorithm>
+
+#include "synth-log.hpp"
+#include "ds-capture.h"
+
+/* Number of sounds loaded at the start of the game, which the voices are
+ * cloned from.
+*/
+#define BANK_SIZE 48
+
+/* Format of the music track, which is streamed into a looping buffer made up
+ * of MUSIC_BLOCKS half-second blocks.
+*/
+#define MUSIC_RATE   22050
+#define MUSIC_BLOCKS 4
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+synth_log_options::synth_log_options()
+{
+	frame_rate  = 50;
+	frames      = 5 * 60 * 50;
+	voices      = 16;
+	clone_storm = 32;
+	music       = true;
+	seed        = 1;
+}
+
+/* xorshift generator, so that logs don't depend on the C library's rand(). */
+struct synth_rng
+{
+	uint32_t state;
+	
+	synth_rng(uint32_t seed)
+	{
+		state = seed ? seed : 1;
+	}
+	
+	uint32_t next()
+	{
+		state ^= state << 13;
+		state ^= state >> 17;
+		state ^= state << 5;
+		
+		return state;
+	}
+	
+	/* Random integer between min and max inclusive. */
+	unsigned int range(unsigned int min, unsigned int max)
+	{
+		return min + next() % (max - min + 1);
+	}
+	
+	/* Random number in the range [0,1). */
+	double real()
+	{
+		return next() / 4294967296.0;
+	}
+};
+
+struct synth_sound
+{
+	unsigned int buf_id;
+	unsigned int sample_rate;
+	unsigned int frames;	/* Length in video frames */
+};
+
+struct synth_voice
+{
+	unsigned int buf_id;
+	unsigned int end_frame;
+	bool looping;
+};
+
+struct synth_writer
+{
+	FILE *log;
+	synth_log_stats &stats;
+	
+	bool ok;
+	
+	synth_writer(FILE *log, synth_log_stats &stats): log(log), stats(stats), ok(true) {}
+	
+	void event(audio_event &event, unsigned int frame, unsigned int op, const void *data = NULL, size_t size = 0)
+	{
+		event.check = 0x12345678;
+		event.frame = frame;
+		event.op    = op;
+		
+		if(fwrite(&event, sizeof(event), 1, log) != 1 || (size && fwrite(data, 1, size, log) != size))
+		{
+			ok = false;
+		}
+		
+		++(stats.events);
+		stats.bytes += sizeof(event) + size;
+	}
+};
+
+/* Generate a sound effect: a decaying tone mixed with noise, like most of the
+ * explosions, shots and speech in the game.
+*/
+static std::vector<unsigned char> make_sound(synth_rng &rng, unsigned int samples, unsigned int bits, unsigned int channels)
+{
+	std::vector<unsigned char> data(samples * channels * (bits / 8));
+	
+	double amplitude = 0.1 + rng.real() * 0.4;
+	double tone      = 0.01 + rng.real() * 0.1;
+	double noise     = rng.real();
+	
+	for(unsigned int i = 0; i < samples; ++i)
+	{
+		double envelope = exp(-3.0 * i / samples);
+		
+		for(unsigned int c = 0; c < channels; ++c)
+		{
+			double v = envelope * amplitude * ((1.0 - noise) * sin(i * tone) + noise * (rng.real() * 2 - 1));
+			size_t s = i * channels + c;
+			
+			if(bits == 8)
+			{
+				data[s] = 128 + (int)(v * 127);
+			}
+			else{
+				int16_t v16 = v * 32767;
+				memcpy(&(data[s * 2]), &v16, 2);
+			}
+		}
+	}
+	
+	return data;
+}
+
+/* Generate the next block of music, a pair of slowly wandering tones. */
+static void make_music_block(std::vector<int16_t> &block, uint64_t &position)
+{
+	for(size_t i = 0; i < block.size(); i += 2, ++position)
+	{
+		double t = (double)(position) / MUSIC_RATE;
+		
+		block[i]     = 6000 * sin(t * 2 * M_PI * (220 + 20 * sin(t * 0.5)));
+		block[i + 1] = 6000 * sin(t * 2 * M_PI * (330 + 30 * sin(t * 0.3)));
+	}
+}
+
+bool synth_log_write(FILE *log, const synth_log_options &options, synth_log_stats &stats)
+{
+	synth_rng rng(options.seed);
+	synth_writer w(log, stats);
+	
+	stats.frames = options.frames;
+	stats.events = 0;
+	stats.bytes  = 0;
+	
+	unsigned int next_id = 1;
+	
+	audio_event event;
+	memset(&event, 0, sizeof(event));
+	
+	/* Load the sound bank. */
+	
+	std::vector<synth_sound> bank;
+	
+	for(unsigned int i = 0; i < BANK_SIZE; ++i)
+	{
+		static const unsigned int rates[] = { 11025, 22050, 22050, 44100 };
+		
+		synth_sound sound;
+		sound.buf_id      = next_id++;
+		sound.sample_rate = rates[rng.range(0, 3)];
+		
+		unsigned int bits     = rng.range(0, 2) ? 16 : 8;
+		unsigned int channels = rng.range(0, 5) ? 1 : 2;
+		unsigned int samples  = sound.sample_rate * rng.range(10, 250) / 100;
+		
+		sound.frames = (uint64_t)(samples) * options.frame_rate / sound.sample_rate;
+		
+		std::vector<unsigned char> data = make_sound(rng, samples, bits, channels);
+		
+		event.e.init.buf_id      = sound.buf_id;
+		event.e.init.size        = data.size();
+		event.e.init.sample_rate = sound.sample_rate;
+		event.e.init.sample_bits = bits;
+		event.e.init.channels    = channels;
+		w.event(event, 0, AUDIO_OP_INIT);
+		
+		event.e.load.buf_id = sound.buf_id;
+		event.e.load.offset = 0;
+		event.e.load.size   = data.size();
+		w.event(event, 0, AUDIO_OP_LOAD, &(data[0]), data.size());
+		
+		bank.push_back(sound);
+	}
+	
+	/* Start the music, filling the whole buffer before it plays. */
+	
+	unsigned int music_id     = next_id++;
+	unsigned int music_period = std::max(options.frame_rate / 2, 1u);
+	unsigned int music_block  = 0;
+	
+	std::vector<int16_t> block((MUSIC_RATE / 2) * 2);
+	uint64_t music_pos = 0;
+	
+	if(options.music)
+	{
+		size_t block_size = block.size() * sizeof(int16_t);
+		
+		event.e.init.buf_id      = music_id;
+		event.e.init.size        = block_size * MUSIC_BLOCKS;
+		event.e.init.sample_rate = MUSIC_RATE;
+		event.e.init.sample_bits = 16;
+		event.e.init.channels    = 2;
+		w.event(event, 0, AUDIO_OP_INIT);
+		
+		for(unsigned int b = 0; b < MUSIC_BLOCKS; ++b)
+		{
+			make_music_block(block, music_pos);
+			
+			event.e.load.buf_id = music_id;
+			event.e.load.offset = b * block_size;
+			event.e.load.size   = block_size;
+			w.event(event, 0, AUDIO_OP_LOAD, &(block[0]), block_size);
+		}
+		
+		event.e.gain.buf_id = music_id;
+		event.e.gain.gain   = 0.8;
+		w.event(event, 0, AUDIO_OP_GAIN);
+		
+		event.e.start.buf_id = music_id;
+		event.e.start.loop   = 1;
+		w.event(event, 0, AUDIO_OP_START);
+	}
+	
+	std::vector<synth_voice> active;
+	
+	unsigned int next_storm = options.frame_rate * rng.range(10, 30);
+	
+	for(unsigned int frame = 1; frame < stats.frames && w.ok; ++frame)
+	{
+		/* Refill the block of the music buffer which has just played. */
+		
+		if(options.music && frame % music_period == 0)
+		{
+			size_t block_size = block.size() * sizeof(int16_t);
+			
+			make_music_block(block, music_pos);
+			
+			event.e.load.buf_id = music_id;
+			event.e.load.offset = (music_block++ % MUSIC_BLOCKS) * block_size;
+			event.e.load.size   = block_size;
+			w.event(event, frame, AUDIO_OP_LOAD, &(block[0]), block_size);
+			
+			if(rng.range(0, 60) == 0)
+			{
+				event.e.gain.buf_id = music_id;
+				event.e.gain.gain   = 0.2 + rng.real() * 0.8;
+				w.event(event, frame, AUDIO_OP_GAIN);
+			}
+		}
+		
+		/* Release voices which have finished playing. */
+		
+		for(size_t i = 0; i < active.size();)
+		{
+			if(active[i].end_frame > frame)
+			{
+				++i;
+				continue;
+			}
+			
+			if(active[i].looping)
+			{
+				event.e.stop.buf_id = active[i].buf_id;
+				w.event(event, frame, AUDIO_OP_STOP);
+			}
+			
+			event.e.free.buf_id = active[i].buf_id;
+			w.event(event, frame, AUDIO_OP_FREE);
+			
+			active[i] = active.back();
+			active.pop_back();
+		}
+		
+		/* Start new voices, usually one at a time but every so often a
+		 * whole storm of clones of the same sound at once.
+		*/
+		
+		unsigned int start = 0;
+		const synth_sound *storm = NULL;
+		
+		if(options.clone_storm && frame >= next_storm)
+		{
+			start = options.clone_storm;
+			storm = &(bank[rng.range(0, BANK_SIZE - 1)]);
+			
+			next_storm = frame + options.frame_rate * rng.range(10, 30);
+		}
+		else if(active.size() < options.voices && rng.real() < 0.3)
+		{
+			start = 1;
+		}
+		
+		for(unsigned int i = 0; i < start; ++i)
+		{
+			const synth_sound &sound = storm ? *storm : bank[rng.range(0, BANK_SIZE - 1)];
+			
+			synth_voice voice;
+			voice.buf_id    = next_id++;
+			voice.looping   = (!storm && rng.range(0, 19) == 0);
+			voice.end_frame = frame + (voice.looping
+				? options.frame_rate * rng.range(2, 10)
+				: sound.frames + 1);
+			
+			event.e.clone.src_buf_id = sound.buf_id;
+			event.e.clone.new_buf_id = voice.buf_id;
+			w.event(event, frame, AUDIO_OP_CLONE);
+			
+			if(rng.range(0, 2) == 0)
+			{
+				event.e.freq.buf_id      = voice.buf_id;
+				event.e.freq.sample_rate = sound.sample_rate * rng.range(80, 120) / 100;
+				w.event(event, frame, AUDIO_OP_FREQ);
+			}
+			
+			event.e.gain.buf_id = voice.buf_id;
+			event.e.gain.gain   = rng.range(0, 19) ? 0.05 + rng.real() * 0.95 : 0.0;
+			w.event(event, frame, AUDIO_OP_GAIN);
+			
+			event.e.start.buf_id = voice.buf_id;
+			event.e.start.loop   = voice.looping;
+			w.event(event, frame, AUDIO_OP_START);
+			
+			active.push_back(voice);
+		}
+		
+		/* Fade voices which are already playing now and then. */
+		
+		if(!active.empty() && rng.range(0, 49) == 0)
+		{
+			event.e.gain.buf_id = active[rng.range(0, active.size() - 1)].buf_id;
+			event.e.gain.gain   = rng.real();
+			w.event(event, frame, AUDIO_OP_GAIN);
+		}
+	}
+	
+	/* Stop and release everything on the last frame, which also marks
+	 * where the log ends when it is mixed.
+	*/
+	
+	if(options.music)
+	{
+		event.e.stop.buf_id = music_id;
+		w.event(event, stats.frames, AUDIO_OP_STOP);
+	}
+	
+	for(size_t i = 0; i < active.size(); ++i)
+	{
+		event.e.free.buf_id = active[i].buf_id;
+		w.event(event, stats.frames, AUDIO_OP_FREE);
+	}
+	
+	for(size_t i = 0; i < bank.size(); ++i)
+	{
+		event.e.free.buf_id = bank[i].buf_id;
+		w.event(event, stats.frames, AUDIO_OP_FREE);
+	}
+	
+	return w.ok;
+}
@@ -0,0 +1,61 @@
+/* Armageddon Recorder - Synthetic audio log generator
+ * Copyright (C) 2013 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef AREC_SYNTH_LOG_HPP
+#define AREC_SYNTH_LOG_HPP
+
+#include <stdio.h>
+#include <stdint.h>
+
+/* Shape of a generated audio log. */
+struct synth_log_options
+{
+	unsigned int frame_rate;
+	
+	/* Length of the game. */
+	unsigned int frames;
+	
+	/* Number of sound effects playing at once, on average. */
+	unsigned int voices;
+	
+	/* Number of voices cloned at once by each explosion, 0 for none. */
+	unsigned int clone_storm;
+	
+	/* Stream a background music track through a looping buffer. */
+	bool music;
+	
+	uint32_t seed;
+	
+	synth_log_options();
+};
+
+struct synth_log_stats
+{
+	unsigned int frames;
+	uint64_t events;
+	uint64_t bytes;
+};
+
+/* Write an audio log which resembles one captured from a game of the given
+ * length, using the same record layout as ds-capture. The same options and
+ * seed always produce the same log.
+ *
+ * Returns false if the log could not be written.
+*/
+bool synth_log_write(FILE *log, const synth_log_options &options, synth_log_stats &stats);
+
+#endif /* !AREC_SYNTH_LOG_HPP */
@@ -0,0 +1,468 @@
+/* Armageddon Recorder - Parallel capture test
+ * Copyright (C) 2013 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include <sstream>
+
+#ifdef _WIN32
+#include <process.h>
+#include <direct.h>
+#else
+#include <unistd.h>
+#include <sys/wait.h>
+#endif
+
+#include "capture-segments.hpp"
+#include "capture.hpp"
+#include "ds-capture.h"
+
+#ifdef _WIN32
+#define PATH_SEP "\\"
+#else
+#define PATH_SEP "/"
+#endif
+
+/* Runs a whole capture through the same planning, launching and stitching as
+ * the real one, with the stand-in given on the command line in place of WA,
+ * and checks the frames and audio log it ends up with.
+*/
+
+struct capture_test
+{
+	const char *name;
+	
+	const char *start_time, *end_time;
+	unsigned int frame_rate;
+	unsigned int instances;
+	
+	/* Length of the replay. */
+	const char *length;
+	
+	bool split;
+};
+
+static const capture_test tests[] = {
+	{ "split-3",       "",     "1:10",    50, 3, "2:00", true  },
+	{ "split-4-start", "0:20", "2:05.50", 25, 4, "3:00", true  },
+	{ "split-short",   "",     "0:03",    50, 4, "1:00", true  },
+	{ "split-past-end", "0:10", "1:30",   50, 3, "1:00", true  },
+	{ "no-end-time",   "",     "",        50, 3, "0:40", false },
+	{ "one-instance",  "0:10", "0:50",    50, 1, "1:00", false },
+};
+
+#define LEAD_IN_SECS 5
+
+/* Runs the stand-in for each instance and waits for them all to finish. */
+class test_launcher: public capture_launcher
+{
+	public:
+		test_launcher(const std::string &stand_in): stand_in(stand_in) {}
+		
+		virtual bool launch(const capture_instance &instance, std::string &error);
+		bool wait(std::string &error);
+	
+	private:
+		std::string stand_in;
+		
+		#ifdef _WIN32
+		std::vector<intptr_t> children;
+		#else
+		std::vector<pid_t> children;
+		#endif
+};
+
+bool test_launcher::launch(const capture_instance &instance, std::string &error)
+{
+	/* Each instance inherits the environment as it is when it starts, the
+	 * same as WA.
+	*/
+	
+	#ifdef _WIN32
+	_putenv(("AREC_FRAME_PREFIX=" + instance.frame_prefix).c_str());
+	_putenv(("DSOUND_CAPTURE_FILE=" + instance.audio_log).c_str());
+	#else
+	setenv("AREC_FRAME_PREFIX", instance.frame_prefix.c_str(), 1);
+	setenv("DSOUND_CAPTURE_FILE", instance.audio_log.c_str(), 1);
+	#endif
+	
+	/* _spawnv() joins the arguments into a command line as they are, so
+	 * they are quoted to keep the empty ones.
+	*/
+	
+	std::vector<std::string> args;
+	args.push_back(stand_in);
+	
+	for(size_t i = 0; i < instance.args.size(); ++i)
+	{
+		#ifdef _WIN32
+		args.push_back("\"" + instance.args[i] + "\"");
+		#else
+		args.push_back(instance.args[i]);
+		#endif
+	}
+	
+	std::vector<char*> argv;
+	
+	for(size_t i = 0; i < args.size(); ++i)
+	{
+		argv.push_back((char*)(args[i].c_str()));
+	}
+	
+	argv.push_back(NULL);
+	
+	#ifdef _WIN32
+	intptr_t child = _spawnv(_P_NOWAIT, stand_in.c_str(), &(argv[0]));
+	if(child == -1)
+	{
+		error = "Could not execute " + stand_in + ": " + strerror(errno);
+		return false;
+	}
+	#else
+	pid_t child = fork();
+	if(child == -1)
+	{
+		error = std::string("Could not fork: ") + strerror(errno);
+		return false;
+	}
+	else if(child == 0)
+	{
+		execv(stand_in.c_str(), &(argv[0]));
+		
+		fprintf(stderr, "Could not execute %s: %s\n", stand_in.c_str(), strerror(errno));
+		_exit(1);
+	}
+	#endif
+	
+	children.push_back(child);
+	
+	return true;
+}
+
+bool test_launcher::wait(std::string &error)
+{
+	bool ok = true;
+	
+	for(size_t i = 0; i < children.size(); ++i)
+	{
+		#ifdef _WIN32
+		int status;
+		ok = _cwait(&status, children[i], 0) != -1 && status == 0 && ok;
+		#else
+		int status;
+		ok = waitpid(children[i], &status, 0) == children[i] && WIFEXITED(status) && WEXITSTATUS(status) == 0 && ok;
+		#endif
+	}
+	
+	children.clear();
+	
+	if(!ok)
+	{
+		error = "The stand-in for WA failed";
+	}
+	
+	return ok;
+}
+
+static std::string frame_path(const std::string &dir, const std::string &prefix, unsigned int frame)
+{
+	char name[32];
+	snprintf(name, sizeof(name), "%06u.png", frame);
+	
+	return dir + PATH_SEP + prefix + name;
+}
+
+static bool file_exists(const std::string &path)
+{
+	struct stat st;
+	return stat(path.c_str(), &st) == 0;
+}
+
+/* Check the stitched frames run from the first frame of the capture to the
+ * last without any missing, repeated or out of order.
+*/
+static bool check_frames(const std::string &dir, uint64_t first, unsigned int expect, std::string &error)
+{
+	unsigned int frame = 0;
+	
+	for(;; ++frame)
+	{
+		FILE *f = fopen(frame_path(dir, FRAME_PREFIX, frame).c_str(), "r");
+		if(!f)
+		{
+			break;
+		}
+		
+		unsigned long long shows;
+		int got = fscanf(f, "%llu", &shows);
+		
+		fclose(f);
+		
+		if(got != 1 || shows != first + frame)
+		{
+			std::ostringstream msg;
+			msg << "Frame " << frame << " shows replay frame " << shows << ", expected " << (first + frame);
+			
+			error = msg.str();
+			return false;
+		}
+	}
+	
+	if(frame != expect)
+	{
+		std::ostringstream msg;
+		msg << "Captured " << frame << " frames, expected " << expect;
+		
+		error = msg.str();
+		return false;
+	}
+	
+	return true;
+}
+
+/* Check every event in the stitched audio log refers to a buffer which exists
+ * at that point, stays within it and comes in order, and that the log has a
+ * single background music track like a capture by one instance.
+*/
+static bool check_audio_log(const std::string &dir, unsigned int frames, std::string &error)
+{
+	std::string path = dir + PATH_SEP FRAME_PREFIX "audio.dat";
+	
+	FILE *log = fopen(path.c_str(), "rb");
+	if(!log)
+	{
+		error = "Cannot open " + path + ": " + strerror(errno);
+		return false;
+	}
+	
+	std::map<unsigned int, unsigned int> sizes;
+	std::set<unsigned int> background;
+	
+	unsigned int last_frame = 0;
+	uint64_t events = 0;
+	
+	audio_event event;
+	
+	std::ostringstream msg;
+	
+	while(error.empty() && fread(&event, sizeof(event), 1, log) == 1)
+	{
+		msg << "Event " << events++ << " at frame " << event.frame << ": ";
+		
+		unsigned int id = 0;
+		
+		switch(event.op)
+		{
+			case AUDIO_OP_FREE:  id = event.e.free.buf_id;  break;
+			case AUDIO_OP_LOAD:  id = event.e.load.buf_id;  break;
+			case AUDIO_OP_START: id = event.e.start.buf_id; break;
+			case AUDIO_OP_STOP:  id = event.e.stop.buf_id;  break;
+			case AUDIO_OP_JMP:   id = event.e.jmp.buf_id;   break;
+			case AUDIO_OP_FREQ:  id = event.e.freq.buf_id;  break;
+			case AUDIO_OP_GAIN:  id = event.e.gain.buf_id;  break;
+			case AUDIO_OP_CLONE: id = event.e.clone.src_buf_id; break;
+		}
+		
+		if(event.check != 0x12345678)
+		{
+			error = msg.str() + "invalid check";
+		}
+		else if(event.frame < last_frame || event.frame > frames)
+		{
+			error = msg.str() + "out of order";
+		}
+		else if(event.op == AUDIO_OP_INIT)
+		{
+			if(!sizes.insert(std::make_pair(event.e.init.buf_id, event.e.init.size)).second)
+			{
+				error = msg.str() + "buffer created twice";
+			}
+		}
+		else if(id && sizes.find(id) == sizes.end())
+		{
+			error = msg.str() + "unknown buffer";
+		}
+		else if(event.op == AUDIO_OP_CLONE)
+		{
+			if(!sizes.insert(std::make_pair(event.e.clone.new_buf_id, sizes[id])).second)
+			{
+				error = msg.str() + "buffer created twice";
+			}
+		}
+		else if(event.op == AUDIO_OP_FREE)
+		{
+			sizes.erase(id);
+		}
+		else if(event.op == AUDIO_OP_LOAD)
+		{
+			if((uint64_t)(event.e.load.offset) + event.e.load.size > sizes[id])
+			{
+				error = msg.str() + "load past the end of the buffer";
+			}
+			
+			if(event.e.load.offset)
+			{
+				background.insert(id);
+			}
+			
+			fseek(log, event.e.load.size, SEEK_CUR);
+		}
+		
+		last_frame = event.frame;
+		
+		msg.str("");
+	}
+	
+	fclose(log);
+	
+	if(error.empty() && background.size() != 1)
+	{
+		std::ostringstream found;
+		found << "Found " << background.size() << " background music tracks, expected 1";
+		
+		error = found.str();
+	}
+	
+	return error.empty();
+}
+
+static bool run_test(const capture_test &test, const std::string &stand_in, const std::string &work_dir, std::string &error)
+{
+	std::string dir = work_dir + PATH_SEP + test.name;
+	
+	#ifdef _WIN32
+	_mkdir(dir.c_str());
+	#else
+	mkdir(dir.c_str(), 0777);
+	#endif
+	
+	capture_settings settings;
+	
+	settings.dir            = dir;
+	settings.replay_file    = dir + PATH_SEP "replay.txt";
+	settings.width          = 640;
+	settings.height         = 480;
+	
+	std::ostringstream rate;
+	rate << test.frame_rate;
+	
+	settings.frame_rate_arg = rate.str();
+	
+	FILE *replay = fopen(settings.replay_file.c_str(), "w");
+	if(!replay || fprintf(replay, "%s\n", test.length) < 0 || fclose(replay) != 0)
+	{
+		error = "Cannot write " + settings.replay_file + ": " + strerror(errno);
+		return false;
+	}
+	
+	bool split;
+	
+	std::vector<capture_segment> parts = plan_capture(test.start_time, test.end_time,
+		test.frame_rate, test.instances, LEAD_IN_SECS, split);
+	
+	if(split != test.split)
+	{
+		error = split ? "Capture was split" : "Capture wasn't split";
+		return false;
+	}
+	
+	test_launcher launcher(stand_in);
+	
+	bool launched = launch_capture(launcher, settings, parts, error);
+	
+	if(!launcher.wait(error) || !launched)
+	{
+		return false;
+	}
+	
+	if(split && (!stitch_frames(dir, parts, error) || !stitch_audio_logs(dir, parts, test.frame_rate, error)))
+	{
+		return false;
+	}
+	
+	for(auto p = parts.begin(); split && p != parts.end(); ++p)
+	{
+		if(file_exists(frame_path(dir, p->prefix, 0)) || file_exists(dir + PATH_SEP + p->prefix + "audio.dat"))
+		{
+			error = "Files were left behind by " + p->prefix;
+			return false;
+		}
+	}
+	
+	/* The stitched capture should be what a single instance would have
+	 * captured on its own.
+	*/
+	
+	uint64_t length_ms, start_ms = 0, end_ms;
+	
+	parse_replay_time(test.length, length_ms);
+	parse_replay_time(test.start_time, start_ms);
+	
+	if(!parse_replay_time(test.end_time, end_ms) || end_ms > length_ms)
+	{
+		end_ms = length_ms;
+	}
+	
+	unsigned int frames = (end_ms - start_ms) * test.frame_rate / 1000;
+	
+	return check_frames(dir, start_ms * test.frame_rate / 1000, frames, error)
+		&& check_audio_log(dir, frames, error);
+}
+
+int main(int argc, char **argv)
+{
+	if(argc != 3)
+	{
+		fprintf(stderr, "Usage: %s <WA stand-in> <work directory>\n", argv[0]);
+		return 2;
+	}
+	
+	#ifdef _WIN32
+	_mkdir(argv[2]);
+	#else
+	mkdir(argv[2], 0777);
+	#endif
+	
+	unsigned int count  = sizeof(tests) / sizeof(*tests);
+	unsigned int failed = 0;
+	
+	for(unsigned int i = 0; i < count; ++i)
+	{
+		std::string error;
+		
+		if(run_test(tests[i], argv[1], argv[2], error))
+		{
+			printf("PASS %s\n", tests[i].name);
+		}
+		else{
+			printf("FAIL %s: %s\n", tests[i].name, error.c_str());
+			++failed;
+		}
+	}
+	
+	printf("%u of %u cases passed\n", count - failed, count);
+	
+	return failed ? 1 : 0;
+}
@@ -0,0 +1,201 @@
+/* Armageddon Recorder - QOI encoder/decoder tests
+ * Copyright (C) 2013 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "qoi.hpp"
+
+/* Round trips images built to exercise every op the encoder writes, and
+ * checks the decoder turns away images it can't decode in full.
+*/
+
+struct qoi_test
+{
+	const char *name;
+	
+	unsigned int width, height;
+	
+	/* Fill in the BGR pixel at x, y. */
+	void (*pixel)(unsigned int x, unsigned int y, unsigned char *bgr);
+};
+
+static uint32_t noise(unsigned int x, unsigned int y)
+{
+	uint32_t n = x * 374761393U + y * 668265263U;
+	n = (n ^ (n >> 13)) * 1274126177U;
+	
+	return n ^ (n >> 16);
+}
+
+static void flat_pixel(unsigned int x, unsigned int y, unsigned char *bgr)
+{
+	bgr[0] = 200;
+	bgr[1] = 100;
+	bgr[2] = 50;
+}
+
+static void gradient_pixel(unsigned int x, unsigned int y, unsigned char *bgr)
+{
+	bgr[0] = x;
+	bgr[1] = x * 3 + y;
+	bgr[2] = x * 7 - y * 2;
+}
+
+static void noise_pixel(unsigned int x, unsigned int y, unsigned char *bgr)
+{
+	uint32_t n = noise(x, y);
+	
+	bgr[0] = n;
+	bgr[1] = n >> 8;
+	bgr[2] = n >> 16;
+}
+
+/* A few colours in short runs, like WA's palette frames. */
+static void palette_pixel(unsigned int x, unsigned int y, unsigned char *bgr)
+{
+	static const unsigned char palette[][3] = {
+		{ 0, 0, 0 }, { 255, 255, 255 }, { 30, 90, 200 }, { 40, 160, 60 }, { 250, 10, 130 },
+	};
+	
+	const unsigned char *c = palette[noise(x / 3, y) % (sizeof(palette) / sizeof(*palette))];
+	
+	bgr[0] = c[0];
+	bgr[1] = c[1];
+	bgr[2] = c[2];
+}
+
+static const qoi_test tests[] = {
+	{ "flat",     1920, 4,  &flat_pixel },
+	{ "gradient", 640,  48, &gradient_pixel },
+	{ "noise",    333,  17, &noise_pixel },
+	{ "palette",  640,  48, &palette_pixel },
+	{ "one",      1,    1,  &noise_pixel },
+};
+
+static bool run_test(const qoi_test &test, std::string &error)
+{
+	std::vector<unsigned char> pixels(test.width * test.height * 3);
+	
+	for(unsigned int y = 0; y < test.height; ++y)
+	{
+		for(unsigned int x = 0; x < test.width; ++x)
+		{
+			test.pixel(x, y, &(pixels[(y * test.width + x) * 3]));
+		}
+	}
+	
+	std::vector<unsigned char> image;
+	qoi_encode(&(pixels[0]), test.width, test.height, image);
+	
+	std::vector<unsigned char> decoded(pixels.size());
+	
+	if(!qoi_decode(&(image[0]), image.size(), test.width, test.height, &(decoded[0]), error))
+	{
+		return false;
+	}
+	
+	if(decoded != pixels)
+	{
+		error = "Decoded pixels differ";
+		return false;
+	}
+	
+	/* Every byte before the end marker is needed for the last pixel. */
+	
+	std::string ignored;
+	
+	for(size_t cut = 1; cut <= 8 && cut < image.size(); ++cut)
+	{
+		if(qoi_decode(&(image[0]), image.size() - 8 - cut, test.width, test.height, &(decoded[0]), ignored))
+		{
+			char msg[64];
+			snprintf(msg, sizeof(msg), "Decoded an image truncated by %u bytes", (unsigned int)(cut));
+			
+			error = msg;
+			return false;
+		}
+	}
+	
+	if(qoi_decode(&(image[0]), image.size(), test.width + 1, test.height, &(decoded[0]), ignored))
+	{
+		error = "Decoded an image of the wrong size";
+		return false;
+	}
+	
+	return true;
+}
+
+/* Two black pixels then a red one, encoded by hand from the specification. */
+static bool known_image(std::string &error)
+{
+	static const unsigned char pixels[] = { 0, 0, 0,  0, 0, 0,  0, 0, 255 };
+	
+	static const unsigned char expect[] = {
+		'q', 'o', 'i', 'f', 0, 0, 0, 3, 0, 0, 0, 1, 3, 0,
+		0xC1,	/* QOI_OP_RUN of 2 */
+		0x5A,	/* QOI_OP_DIFF of -1, 0, 0 */
+		0, 0, 0, 0, 0, 0, 0, 1,
+	};
+	
+	std::vector<unsigned char> image;
+	qoi_encode(pixels, 3, 1, image);
+	
+	if(image != std::vector<unsigned char>(expect, expect + sizeof(expect)))
+	{
+		error = "Encoded image differs from the specification";
+		return false;
+	}
+	
+	return true;
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int count  = sizeof(tests) / sizeof(*tests) + 1;
+	unsigned int failed = 0;
+	
+	std::string error;
+	
+	if(known_image(error))
+	{
+		printf("PASS known\n");
+	}
+	else{
+		printf("FAIL known: %s\n", error.c_str());
+		++failed;
+	}
+	
+	for(unsigned int i = 0; i < count - 1; ++i)
+	{
+		if(run_test(tests[i], error))
+		{
+			printf("PASS %s\n", tests[i].name);
+		}
+		else{
+			printf("FAIL %s: %s\n", tests[i].name, error.c_str());
+			++failed;
+		}
+	}
+	
+	printf("%u of %u cases passed\n", count - failed, count);
+	
+	return failed ? 1 : 0;
+}
@@ -19,6 +19,7 @@
 #include <windowsx.h>
 #include <commctrl.h>
 #include <assert.h>
+#include <stdio.h>
 
 #include "main.hpp"
 #include "ui.hpp"
@@ -29,6 +30,102 @@
 
 HWND progress_dialog = NULL;
 
+/* Seconds of the audio log to search for background music ahead of the frame
+ * being mixed while WA is still capturing. WA streams the music a second or
+ * two before it is played, anything found later than this is mixed again
+ * once WA exits.
+*/
+#define LIVE_SCAN_AHEAD 5
+
+/* Set once WA has finished writing the audio log. */
+static HANDLE wa_exited = NULL;
+
+/* Set to give up on streaming audio into ffmpeg. */
+static HANDLE audio_abort = NULL;
+
+/* ffmpeg exited before the audio thread had reported back. */
+static bool encoder_exited = false;
+
+/* The video is being encoded alongside the capture and isn't finished yet. */
+static bool video_pending = false;
+
+/* Whether the audio is streamed into ffmpeg rather than written out. */
+static bool piping_audio()
+{
+	return config.video_format > 0 && config.pipe_audio;
+}
+
+/* Whether the video is encoded while WA is capturing it, leaving only the
+ * audio to be added afterwards.
+*/
+static bool encoding_during_capture()
+{
+	return config.video_format > 0 && config.encode_during_capture;
+}
+
+/* Whether the video is encoded in segments once WA has finished capturing. */
+static bool encoding_in_segments()
+{
+	return config.video_format > 0 && ffmpeg_segmented();
+}
+
+/* Whether identical frames are collapsed once WA has finished capturing. */
+static bool collapsing_frames()
+{
+	return config.video_format > 0 && ffmpeg_collapsing();
+}
+
+/* Format a number of seconds as minutes and seconds, or hours if needed. */
+static std::string format_duration(double seconds)
+{
+	unsigned int s = seconds;
+	
+	char buf[32];
+	
+	if(s >= 3600)
+	{
+		snprintf(buf, sizeof(buf), "%u:%02u:%02u", s / 3600, (s / 60) % 60, s % 60);
+	}
+	else{
+		snprintf(buf, sizeof(buf), "%u:%02u", s / 60, s % 60);
+	}
+	
+	return buf;
+}
+
+static std::string format_rate(double rate)
+{
+	char buf[32];
+	snprintf(buf, sizeof(buf), "%.1f", rate);
+	
+	return buf;
+}
+
+/* Status line shown under the log while WA is capturing. */
+static std::string capture_status(const capture_stats &stats)
+{
+	std::string status = "Captured " + to_string(stats.frames);
+	
+	if(stats.expected)
+	{
+		status += " of " + to_string(stats.expected);
+	}
+	
+	status += " frames";
+	
+	if(stats.rate > 0)
+	{
+		status += ", " + format_rate(stats.rate) + " frames/sec";
+		
+		if(stats.expected)
+		{
+			status += ", about " + format_duration((stats.expected - stats.frames) / stats.rate) + " left";
+		}
+	}
+	
+	return status;
+}
+
 std::string get_window_string(HWND hwnd)
 {
 	int len = GetWindowTextLength(hwnd);
@@ -183,6 +280,140 @@ void volume_on_slider(HWND slider, HWND edit)
 	SetWindowText(edit, std::string(to_string(pos) + "%").c_str());
 }
 
+/* Passes messages from an audio_renderer on to the progress dialog. */
+struct log_push_listener: public audio_render_listener
+{
+	virtual void log(const std::string &msg)
+	{
+		log_push(msg + "\r\n");
+	}
+};
+
+/* Follows the audio log while WA is still writing it. */
+struct wa_log_tail: public audio_log_tail
+{
+	wa_log_tail(audio_log_source &log): audio_log_tail(log) {}
+	
+	virtual bool writer_done()
+	{
+		return WaitForSingleObject(wa_exited, 0) == WAIT_OBJECT_0;
+	}
+};
+
+/* Mix the audio log into the output WAV file. WA is still capturing, so the
+ * log is mixed as it is written, finishing once WA exits.
+*/
+static bool make_output_wav()
+{
+	std::string log_path = config.capture_dir + "\\" FRAME_PREFIX "audio.dat";
+	std::string wav_path = config.capture_dir + "\\" FRAME_PREFIX "audio.wav";
+	
+	/* The pipe is created first, ffmpeg is started as soon as WA exits
+	 * and expects to find it there.
+	*/
+	
+	audio_output *output;
+	
+	if(piping_audio())
+	{
+		output = new ffmpeg_audio_pipe(audio_abort);
+	}
+	else{
+		output = new audio_wav_output(wav_path);
+	}
+	
+	FILE *log;
+	
+	while(!(log = fopen(log_path.c_str(), "rb")))
+	{
+		/* WA doesn't create the log until it loads dsound.dll. */
+		
+		if(WaitForSingleObject(wa_exited, 0) == WAIT_OBJECT_0)
+		{
+			log_push(std::string("Could not open " FRAME_PREFIX "audio.dat: ") + w32_error(GetLastError()) + "\r\n");
+			
+			delete output;
+			return false;
+		}
+		
+		Sleep(100);
+	}
+	
+	audio_render_options options;
+	
+	options.frame_rate  = config.frame_rate;
+	options.sample_rate = config.audio_rate;
+	
+	options.mix_bus = config.mix_bus;
+	options.format  = wav_formats[config.wav_format].format;
+	
+	options.init_vol = config.init_vol;
+	
+	options.fix_clipping = config.fix_clipping;
+	options.min_vol      = config.min_vol;
+	
+	options.normalise = config.normalise_loudness;
+	
+	options.scan_ahead = LIVE_SCAN_AHEAD * config.frame_rate;
+	
+	/* WA hasn't finished, so the mix is sized from the length of the
+	 * replay instead.
+	*/
+	
+	options.frame_count = get_expected_frame_count();
+	
+	/* Keep the mix around with the rest of the capture so it can be
+	 * rendered again at a different volume without mixing it again.
+	*/
+	
+	if(!config.do_cleanup)
+	{
+		options.stem_path = config.capture_dir + "\\" FRAME_PREFIX "audio.bus";
+	}
+	
+	audio_log_file log_file(log);
+	wa_log_tail log_tail(log_file);
+	
+	log_push_listener listener;
+	
+	audio_renderer renderer(options, log_tail, *output, listener);
+	
+	/* Stems are saved beside the video, where they survive the capture
+	 * being cleaned up, or with the capture if there is no video.
+	*/
+	
+	std::string stem_base = config.capture_dir + "\\" FRAME_PREFIX;
+	
+	if(config.video_format > 0)
+	{
+		stem_base = config.video_file;
+		
+		size_t dot = stem_base.find_last_of('.');
+		if(dot != std::string::npos && stem_base.find_first_of("\\/", dot) == std::string::npos)
+		{
+			stem_base.erase(dot);
+		}
+		
+		stem_base += "-";
+	}
+	
+	audio_wav_output music(stem_base + "music.wav");
+	audio_wav_output effects(stem_base + "effects.wav");
+	
+	if(config.audio_stems)
+	{
+		renderer.set_stem_output(STEM_MUSIC, &music);
+		renderer.set_stem_output(STEM_EFFECTS, &effects);
+	}
+	
+	bool ok = renderer.render();
+	
+	fclose(log);
+	delete output;
+	
+	return ok;
+}
+
 static DWORD WINAPI audio_gen_thread(LPVOID lpParameter)
 {
 	if(make_output_wav())
@@ -217,6 +448,8 @@ INT_PTR CALLBACK prog_dproc(HWND hwnd, UINT msg, WPARAM wp, LPARAM lp)
 			progress_dialog = hwnd;
 			return_code = 0;
 			
+			state = s_init;
+			
 			SendMessage(hwnd, WM_SETICON, 0, (LPARAM)LoadIcon(GetModuleHandle(NULL), MAKEINTRESOURCE(ICON16)));
 			SendMessage(hwnd, WM_SETICON, 1, (LPARAM)LoadIcon(GetModuleHandle(NULL), MAKEINTRESOURCE(ICON32)));
 			
@@ -241,9 +474,49 @@ INT_PTR CALLBACK prog_dproc(HWND hwnd, UINT msg, WPARAM wp, LPARAM lp)
 		
 		case WM_BEGIN:
 		{
+			if(!wa_exited)
+			{
+				wa_exited   = CreateEvent(NULL, TRUE, FALSE, NULL);
+				audio_abort = CreateEvent(NULL, TRUE, FALSE, NULL);
+				
+				assert(wa_exited && audio_abort);
+			}
+			
+			ResetEvent(wa_exited);
+			ResetEvent(audio_abort);
+			
+			encoder_exited = false;
+			video_pending  = false;
+			
 			if(start_capture())
 			{
 				state = s_capture;
+				
+				if(encoding_during_capture())
+				{
+					log_push("Starting video encoder...\r\n");
+					
+					if(!ffmpeg_video_start(wa_exited))
+					{
+						PostMessage(hwnd, WM_ABORTED, 0, 0);
+						return TRUE;
+					}
+					
+					video_pending = true;
+				}
+				
+				/* The audio log is append-only and in frame
+				 * order, so the audio is mixed while WA is
+				 * still capturing and only has to be finished
+				 * off once it exits.
+				*/
+				
+				log_push("Creating audio file...\r\n");
+				
+				HANDLE at = CreateThread(NULL, 0, &audio_gen_thread, NULL, 0, NULL);
+				assert(at);
+				
+				CloseHandle(at);
 			}
 			else{
 				PostMessage(hwnd, WM_ABORTED, 0, 0);
@@ -258,21 +531,106 @@ INT_PTR CALLBACK prog_dproc(HWND hwnd, UINT msg, WPARAM wp, LPARAM lp)
 			
 			finish_capture();
 			
-			log_push("Creating audio file...\r\n");
+			capture_stats stats = get_capture_stats();
+			
+			log_push("Captured " + to_string(stats.frames) + " frames in " + format_duration(stats.elapsed)
+				+ " (" + format_rate(stats.rate) + " frames/sec)\r\n");
+			
+			SetWindowText(GetDlgItem(hwnd, CAPTURE_STATUS), "");
 			
-			HANDLE at = CreateThread(NULL, 0, &audio_gen_thread, NULL, 0, NULL);
-			assert(at);
+			/* The audio thread keeps waiting for the log until WA
+			 * has exited, so the segments are joined first.
+			*/
 			
-			CloseHandle(at);
+			if(!stitch_capture())
+			{
+				PostMessage(hwnd, WM_ABORTED, 0, 0);
+				return TRUE;
+			}
+			
+			log_push("Finishing audio file...\r\n");
+			
+			SetEvent(wa_exited);
 			
 			state = s_audio_gen;
 			
+			/* The segments are encoded alongside the audio, which
+			 * is added once they have been joined.
+			*/
+			
+			if(encoding_in_segments())
+			{
+				if(!ffmpeg_segments_start())
+				{
+					PostMessage(hwnd, WM_ABORTED, 0, 0);
+					return TRUE;
+				}
+				
+				video_pending = true;
+			}
+			else if(collapsing_frames())
+			{
+				if(!ffmpeg_collapse_start())
+				{
+					PostMessage(hwnd, WM_ABORTED, 0, 0);
+					return TRUE;
+				}
+				
+				video_pending = true;
+			}
+			
+			/* Piped audio is only written as ffmpeg reads it, so
+			 * the encoder has to be running to finish the audio.
+			 * If the video is still being encoded, it is started
+			 * once that has finished instead.
+			*/
+			
+			if(piping_audio() && !video_pending)
+			{
+				log_push("Starting encoder...\r\n");
+				
+				if(!ffmpeg_run())
+				{
+					PostMessage(hwnd, WM_ABORTED, 0, 0);
+				}
+			}
+			
 			return TRUE;
 		}
 		
 		case WM_AUDIO_DONE:
 		{
-			if(config.video_format > 0)
+			/* The audio thread can still finish after the capture
+			 * has been aborted.
+			*/
+			
+			if(state != s_audio_gen)
+			{
+				return TRUE;
+			}
+			
+			if(piping_audio())
+			{
+				/* The encoder was started when WA exited. */
+				
+				state = s_encode;
+				
+				if(encoder_exited)
+				{
+					PostMessage(hwnd, WM_ENC_EXIT, 0, 0);
+				}
+			}
+			else if(video_pending)
+			{
+				/* The audio is added once the video encoder has
+				 * caught up.
+				*/
+				
+				log_push("Waiting for the video encoder...\r\n");
+				
+				state = s_encode;
+			}
+			else if(config.video_format > 0)
 			{
 				log_push("Starting encoder...\r\n");
 				
@@ -291,10 +649,78 @@ INT_PTR CALLBACK prog_dproc(HWND hwnd, UINT msg, WPARAM wp, LPARAM lp)
 			return TRUE;
 		}
 		
+		case WM_CAPTURE_PROGRESS:
+		{
+			if(state == s_capture)
+			{
+				SetWindowText(GetDlgItem(hwnd, CAPTURE_STATUS), capture_status(get_capture_stats()).c_str());
+			}
+			
+			return TRUE;
+		}
+		
+		case WM_VIDEO_DONE:
+		{
+			/* The video encoder has used up all the frames, every
+			 * segment of the video has been encoded or the static
+			 * frames have been collapsed.
+			*/
+			
+			if(state == s_done)
+			{
+				return TRUE;
+			}
+			
+			if(wp != 0)
+			{
+				log_push("Video encoder exited with status " + to_string((DWORD)(wp)) + "\r\n");
+				PostMessage(hwnd, WM_ABORTED, 0, 0);
+				
+				return TRUE;
+			}
+			
+			video_pending = false;
+			
+			/* Add the audio to the video, straight away if it is
+			 * piped or has already been written.
+			*/
+			
+			if(piping_audio() || state == s_encode)
+			{
+				log_push("Starting encoder...\r\n");
+				
+				if(!ffmpeg_run())
+				{
+					PostMessage(hwnd, WM_ABORTED, 0, 0);
+				}
+			}
+			
+			return TRUE;
+		}
+		
 		case WM_ENC_EXIT:
 		{
 			/* The encoder process has exited */
 			
+			if(state == s_audio_gen)
+			{
+				/* ffmpeg reads piped audio to the end before it
+				 * finishes, so it can only succeed before the
+				 * audio thread has reported back by a whisker.
+				*/
+				
+				if(wp == 0)
+				{
+					encoder_exited = true;
+				}
+				else{
+					log_push("ffmpeg exited with status " + to_string((DWORD)(wp)) + "\r\n");
+					PostMessage(hwnd, WM_ABORTED, 0, 0);
+				}
+				
+				return TRUE;
+			}
+			
 			ffmpeg_cleanup();
 			
 			if(config.do_cleanup)
@@ -339,9 +765,24 @@ INT_PTR CALLBACK prog_dproc(HWND hwnd, UINT msg, WPARAM wp, LPARAM lp)
 		
 		case WM_ABORTED:
 		{
+			if(state == s_done)
+			{
+				return TRUE;
+			}
+			
 			finish_capture();
 			ffmpeg_cleanup();
 			
+			/* Let the audio thread run out of log and stop waiting
+			 * on ffmpeg.
+			*/
+			
+			if(wa_exited)
+			{
+				SetEvent(wa_exited);
+				SetEvent(audio_abort);
+			}
+			
 			MessageBox(hwnd, "Capture aborted due to error.\nCheck log window for details.", NULL, MB_OK | MB_ICONERROR);
 			
 			state = s_done;
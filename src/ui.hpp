@@ -27,6 +27,8 @@
 #define WM_ENC_EXIT   (WM_USER + 4)
 #define WM_AUDIO_DONE (WM_USER + 6)
 #define WM_ABORTED    (WM_USER + 7)
+#define WM_VIDEO_DONE (WM_USER + 8)
+#define WM_CAPTURE_PROGRESS (WM_USER + 9)
 
 extern HWND progress_dialog;
 
@@ -0,0 +1,183 @@
+#!/bin/sh
+# Armageddon Recorder - Audio regression tests
+# Copyright (C) 2013 Daniel Collins <solemnwarning@solemnwarning.net>
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+# Renders every case in cases.txt with arec-render and checks the samples
+# against the hashes in golden.txt.
+#
+# A change which is allowed to alter the output can be checked against the
+# arec-render it replaces instead, within a tolerance given as arec-compare
+# options, and then the hashes updated with -u.
+#
+# A case which names another case after its options has no stored hash, its
+# output must instead be identical to the one rendered for the case it names.
+
+usage()
+{
+	echo "Usage: $0 [options] <tool directory> [<executable suffix>]" >&2
+	echo "" >&2
+	echo "  -R <path>     Compare against the output of this arec-render instead" >&2
+	echo "                of the stored hashes" >&2
+	echo "  -t <options>  arec-compare options used with -R, e.g. \"-e 1 -s 90\"" >&2
+	echo "  -u            Replace the stored hashes with the ones rendered now" >&2
+	exit 2
+}
+
+here=$(cd "$(dirname "$0")" && pwd)
+
+ref=
+tolerance=
+update=
+
+while getopts "R:t:u" opt
+do
+	case "$opt" in
+		R) ref=$OPTARG ;;
+		t) tolerance=$OPTARG ;;
+		u) update=1 ;;
+		*) usage ;;
+	esac
+done
+
+shift $((OPTIND - 1))
+
+if [ $# -lt 1 ] || [ $# -gt 2 ] || { [ -n "$tolerance" ] && [ -z "$ref" ]; }
+then
+	usage
+fi
+
+render="$1/arec-render$2"
+compare="$1/arec-compare$2"
+synth="$1/arec-bench-mixer$2"
+
+work=$(mktemp -d "${TMPDIR:-/tmp}/arec-check.XXXXXX") || exit 2
+trap 'rm -rf "$work"' EXIT
+
+grep -v -e '^#' -e '^[[:space:]]*$' "$here/cases.txt" > "$work/cases"
+
+cases=0
+failed=0
+
+while IFS='|' read -r name log options same
+do
+	name=$(echo $name)
+	log=$(echo $log)
+	same=$(echo $same)
+
+	# Other files written by arec-render, such as stems, go in the work
+	# directory wherever the options say @.
+
+	options=$(echo "$options" | sed "s|@|$work/|g")
+
+	cases=$((cases + 1))
+
+	# Synthetic logs are generated afresh, the mix arec-bench-mixer makes
+	# of them is thrown away.
+
+	case "$log" in
+		synth*)
+			log_path="$work/$name.dat"
+
+			if ! "$synth" ${log#synth} -l "$log_path" > "$work/$name.out" 2>&1
+			then
+				echo "FAIL $name: could not generate log"
+				cat "$work/$name.out"
+				failed=$((failed + 1))
+				continue
+			fi
+			;;
+
+		*)
+			log_path="$here/$log"
+			;;
+	esac
+
+	if ! "$render" $options "$log_path" "$work/$name.wav" > "$work/$name.out" 2>&1
+	then
+		echo "FAIL $name: arec-render failed"
+		cat "$work/$name.out"
+		failed=$((failed + 1))
+		continue
+	fi
+
+	hash=$("$compare" -H "$work/$name.wav" | cut -d ' ' -f 1)
+	echo "$hash  $name" >> "$work/hashes"
+
+	if [ -n "$same" ]
+	then
+		expect=$(awk -v name="$same" '$2 == name { print $1 }' "$work/hashes")
+
+		if [ -z "$hash" ]
+		then
+			echo "FAIL $name: could not hash output"
+			failed=$((failed + 1))
+		elif [ "$hash" = "$expect" ]
+		then
+			echo "PASS $name"
+		else
+			echo "FAIL $name: hash $hash, $same rendered ${expect:-nothing}"
+			failed=$((failed + 1))
+		fi
+	elif [ -n "$ref" ]
+	then
+		if ! "$ref" $options "$log_path" "$work/$name-ref.wav" > "$work/$name.out" 2>&1
+		then
+			echo "FAIL $name: reference arec-render failed"
+			cat "$work/$name.out"
+			failed=$((failed + 1))
+		elif "$compare" -q $tolerance "$work/$name-ref.wav" "$work/$name.wav" > "$work/$name.out"
+		then
+			echo "PASS $name"
+		else
+			echo "FAIL $name"
+			cat "$work/$name.out"
+			failed=$((failed + 1))
+		fi
+	else
+		expect=$(awk -v name="$name" '$2 == name { print $1 }' "$here/golden.txt")
+
+		if [ -n "$update" ]
+		then
+			echo "$hash  $name" >> "$work/golden"
+
+			if [ "$hash" != "$expect" ]
+			then
+				echo "UPDATE $name: $hash"
+			fi
+		elif [ -z "$hash" ]
+		then
+			echo "FAIL $name: could not hash output"
+			failed=$((failed + 1))
+		elif [ "$hash" = "$expect" ]
+		then
+			echo "PASS $name"
+		else
+			echo "FAIL $name: hash $hash, expected ${expect:-nothing}"
+			failed=$((failed + 1))
+		fi
+	fi
+
+	rm -f "$work/$name.dat" "$work/$name.wav" "$work/$name-ref.wav" "$work"/*.stem.wav
+done < "$work/cases"
+
+if [ -n "$update" ] && [ $failed -eq 0 ]
+then
+	cp "$work/golden" "$here/golden.txt"
+fi
+
+echo "$((cases - failed)) of $cases cases passed"
+
+[ $failed -eq 0 ]